@@ -0,0 +1,253 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: thrift-bench; -*-
+
+(in-package :thrift-bench)
+
+;;; measurement, random data and reporting operators common to the benchmark suites
+;;;
+;;; Each benchmark is a function of no arguments. measure calls it *warmup* times, then
+;;; *repetitions* runs of *count* calls, and reports the median run time and the bytes consed
+;;; per call. A result is a property list, eg.
+;;;
+;;;   (:suite :codec :idl "ThriftTest" :name "xtruct" :path :inline :operation :encode
+;;;    :ops/s 2345678.0 :bytes/s 8.7e7 :consed/op 0.0 :size 37)
+;;;
+;;; Results are written one form per line, or as csv, and a later run is compared against a
+;;; baseline file by the key (suite idl name path operation threads):
+;;;
+;;;   (run-codec-benchmarks :output #p"/tmp/codec-new.sexp" :baseline #p"/tmp/codec-old.sexp")
+
+
+(defparameter *bench-root-pathname*
+  (make-pathname :name nil :type nil :defaults (or *compile-file-pathname* *load-pathname*)))
+
+(defparameter *idl-directory*
+  (merge-pathnames (make-pathname :directory '(:relative :up "test" "gen-cl")) *bench-root-pathname*)
+  "The location of the generated -types.lisp files for the test IDLs.")
+
+(defparameter *fasl-directory*
+  (merge-pathnames (make-pathname :directory '(:relative "thrift-bench")) (uiop:temporary-directory))
+  "The location for the compiled IDL files, in order to leave the source tree untouched.")
+
+(defparameter *warmup* 1000)
+(defparameter *repetitions* 5)
+(defparameter *count* 10000)
+
+(defparameter *result-columns*
+  '(:suite :idl :name :path :operation :threads :ops/s :bytes/s :consed/op :size :p50 :p99 :p999))
+
+
+;;;
+;;; measurement
+
+(defun bytes-consed ()
+  #+sbcl (sb-ext:get-bytes-consed)
+  #+ccl (ccl::total-bytes-allocated)
+  #-(or sbcl ccl) 0)
+
+(defun median (numbers)
+  (let ((sorted (sort (copy-list numbers) #'<)))
+    (nth (floor (length sorted) 2) sorted)))
+
+(defun measure (function &key (count *count*) (warmup *warmup*) (repetitions *repetitions*))
+  "Call FUNCTION WARMUP times, then REPETITIONS runs of COUNT times. Return the median seconds
+ per run and the mean bytes consed per call."
+  (declare (type function function) (type fixnum count))
+  (dotimes (i warmup) (funcall function))
+  (let ((times ())
+        (consed 0))
+    (dotimes (i repetitions)
+      (let ((start (get-internal-real-time))
+            (bytes (bytes-consed)))
+        (dotimes (i count) (funcall function))
+        (push (/ (max 1 (- (get-internal-real-time) start)) internal-time-units-per-second) times)
+        (incf consed (- (bytes-consed) bytes))))
+    (values (cl:float (median times) 1.0d0)
+            (cl:float (/ consed (* count (max repetitions 1))) 1.0d0))))
+
+(defun throughput-result (seconds consed count size &rest properties)
+  "Combine a measurement with the identifying PROPERTIES as a result."
+  (let ((ops/s (/ count seconds)))
+    (append properties
+            (list :ops/s ops/s
+                  :bytes/s (when size (* ops/s size))
+                  :consed/op consed
+                  :size size))))
+
+
+;;;
+;;; seeded random data
+;;; an explicit xorshift generator, rather than cl:random, in order that a seed reproduces
+;;; the same instances in every implementation.
+
+(defvar *bench-random-state* #x9e3779b97f4a7c15)
+
+(defparameter *random-container-size* 4
+  "The upper bound for random container lengths.")
+(defparameter *random-string-length* 16
+  "The upper bound for random string and binary lengths.")
+(defparameter *random-depth-limit* 3
+  "The nesting depth beyond which random containers are empty.")
+
+(defun random-seed (seed)
+  (setf *bench-random-state* (if (zerop seed) #x9e3779b97f4a7c15 (logand seed #xffffffffffffffff))))
+
+(defun bench-random (limit)
+  "Return a pseudo-random integer in [0, LIMIT) for LIMIT up to 2^64."
+  (let ((x *bench-random-state*))
+    (setf x (logxor x (ash x -12))
+          x (logxor x (logand (ash x 25) #xffffffffffffffff))
+          x (logxor x (ash x -27))
+          *bench-random-state* x)
+    (mod (logand (* x #x2545f4914f6cdd1d) #xffffffffffffffff) limit)))
+
+(defun random-signed (bits)
+  (- (bench-random (expt 2 bits)) (expt 2 (1- bits))))
+
+(defun random-size (depth)
+  (if (>= depth *random-depth-limit*) 0 (bench-random (1+ *random-container-size*))))
+
+(defun random-string ()
+  (let ((string (make-string (bench-random (1+ *random-string-length*)))))
+    (dotimes (i (length string) string)
+      (setf (char string i) (code-char (+ 32 (bench-random 95)))))))
+
+(defun random-value (type &optional (depth 0))
+  "Return a random value of the thrift TYPE. Enum and struct names are resolved in *package*."
+  (if (consp type)
+    (ecase (first type)
+      ((list set)
+       (loop repeat (random-size depth)
+             collect (random-value (second type) (1+ depth))))
+      (map
+       (loop repeat (random-size depth)
+             collect (cons (random-value (second type) (1+ depth))
+                           (random-value (third type) (1+ depth)))))
+      (enum
+       (let ((members (get (thrift.implementation::str-sym (second type)) 'thrift::enum-members)))
+         (nth (bench-random (length members)) members)))
+      (struct
+       (random-struct (second type) (1+ depth))))
+    (ecase type
+      (bool (zerop (bench-random 2)))
+      ((byte i08) (random-signed 8))
+      (i16 (random-signed 16))
+      (i32 (random-signed 32))
+      (i64 (random-signed 64))
+      (double (/ (random-signed 32) 1024.0d0))
+      (float (/ (random-signed 16) 64.0f0))
+      (string (random-string))
+      (binary (let ((vector (make-array (bench-random (1+ *random-string-length*))
+                                        :element-type '(unsigned-byte 8))))
+                (dotimes (i (length vector) vector)
+                  (setf (aref vector i) (bench-random 256))))))))
+
+(defun random-struct (type &optional (depth 0))
+  "Return an instance of the struct or exception TYPE with a random value for every field."
+  (let ((class (find-thrift-class (etypecase type
+                                    (symbol type)
+                                    (string (thrift.implementation::str-sym type))))))
+    (apply #'make-struct class
+           (loop for fd in (class-field-definitions class)
+                 collect (or (field-definition-initarg fd)
+                             (intern (symbol-name (field-definition-name fd)) :keyword))
+                 collect (random-value (field-definition-type fd) depth)))))
+
+
+;;;
+;;; idl loading
+
+(defun idl-package-name (idl)
+  (intern (format nil "THRIFT-BENCH.~:@(~a~)" idl) :keyword))
+
+(defun load-idl (idl &key (directory *idl-directory*) implementations)
+  "Compile and load the IDL's generated -types.lisp file in a package of its own, so that IDLs
+ which define the same identifiers can be loaded together. Return the package.
+ IMPLEMENTATIONS is an a-list of method identifier and function. Those functions are bound
+ before compiling, in order that the service's response methods are defined."
+  (let* ((package-name (idl-package-name idl))
+         (source (merge-pathnames (make-pathname :name (format nil "~a-types" idl) :type "lisp")
+                                  directory))
+         (fasl (compile-file-pathname (merge-pathnames (make-pathname :name (pathname-name source))
+                                                       *fasl-directory*))))
+    (eval `(def-package ,package-name))
+    (let ((*package* (find-package package-name)))
+      (loop for (identifier . function) in implementations
+            do (setf (fdefinition (thrift.implementation::implementation-str-sym identifier)) function))
+      (ensure-directories-exist fasl)
+      (load (compile-file source :output-file fasl))
+      *package*)))
+
+(defun idl-struct-classes (package)
+  "Return the struct classes defined in PACKAGE, sorted by identifier."
+  (let ((classes ()))
+    (do-symbols (symbol package)
+      (when (eq (symbol-package symbol) package)
+        (let ((class (find-class symbol nil)))
+          (when (typep class 'thrift-struct-class)
+            (pushnew class classes)))))
+    (sort classes #'string< :key #'class-identifier)))
+
+
+;;;
+;;; reporting
+
+(defun result-key (result)
+  (loop for property in '(:suite :idl :name :path :operation :threads)
+        collect (getf result property)))
+
+(defgeneric write-results (results destination &key format)
+  (:documentation "Write the RESULTS to the DESTINATION stream or file either as one property list
+ per line (:sexp) or as comma separated values with a header (:csv).")
+
+  (:method (results (destination pathname) &key (format :sexp))
+    (with-open-file (stream destination :direction :output :if-exists :supersede :if-does-not-exist :create)
+      (write-results results stream :format format))
+    destination)
+
+  (:method (results (destination null) &key (format :sexp))
+    (write-results results *standard-output* :format format))
+
+  (:method (results (stream stream) &key (format :sexp))
+    (ecase format
+      (:sexp
+       (with-standard-io-syntax
+         (let ((*print-readably* nil))
+           (dolist (result results)
+             (format stream "~s~%" result)))))
+      (:csv
+       (format stream "~{~(~a~)~^,~}~%" *result-columns*)
+       (dolist (result results)
+         (format stream "~{~@[~a~]~^,~}~%"
+                 (loop for column in *result-columns*
+                       for value = (getf result column)
+                       collect (typecase value
+                                 (cl:float (format nil "~,3f" value))
+                                 (keyword (string-downcase value))
+                                 (t value)))))))
+    results))
+
+(defun read-results (pathname)
+  "Read the results written by write-results as :sexp."
+  (with-open-file (stream pathname :direction :input)
+    (with-standard-io-syntax
+      (let ((*read-eval* nil))
+        (loop for result = (read stream nil stream)
+              until (eq result stream)
+              collect result)))))
+
+(defun compare-results (results baseline &key (threshold 0.1) (stream *standard-output*))
+  "Compare RESULTS with the BASELINE results or file by throughput and allocation.
+ Report and return as (result baseline-result ratio) those which are slower by more than
+ the THRESHOLD fraction, or which cons more per operation."
+  (let ((baseline (if (listp baseline) baseline (read-results baseline)))
+        (regressions ()))
+    (dolist (result results)
+      (let ((base (find (result-key result) baseline :key #'result-key :test #'equal)))
+        (when base
+          (let ((ratio (/ (getf result :ops/s) (getf base :ops/s))))
+            (when (or (< ratio (- 1 threshold))
+                      (> (getf result :consed/op) (* (1+ threshold) (getf base :consed/op) )))
+              (push (list result base ratio) regressions)
+              (format stream "~&regression: ~{~(~a~)~^/~}: ~,2f x ops/s, ~,1f -> ~,1f bytes consed/op"
+                      (result-key result) ratio (getf base :consed/op) (getf result :consed/op)))))))
+    (nreverse regressions)))
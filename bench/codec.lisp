@@ -0,0 +1,99 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: thrift-bench; -*-
+
+(in-package :thrift-bench)
+
+;;; struct codec throughput for the test IDLs
+;;; (run-codec-benchmarks)
+;;; (run-codec-benchmarks :idls '("ThriftTest") :output #p"/tmp/codec.csv" :format :csv)
+;;;
+;;; For each struct class in each IDL, a random instance is encoded to and decoded from a vector
+;;; stream through two paths:
+;;;  * :generic : the type is a run-time value, so that the codec operators dispatch on the
+;;;    class metadata
+;;;  * :inline : the type is a constant, so that the compiler macros expand the field codecs
+;;;    in-line, as for the generated request and response methods
+
+
+(defparameter *codec-idls* '("StressTest" "DebugProtoTest" "ThriftTest" "OptionalRequiredTest"))
+
+
+(defun make-codec-protocol ()
+  (make-instance 'binary-protocol
+    :transport (make-instance 'vector-stream-transport)
+    :direction :io))
+
+(defun rewind-protocol (protocol)
+  (thrift.implementation::stream-position (protocol-output-transport protocol) 0))
+
+
+(defun struct-codec-functions (type path)
+  "Return an encoder of (protocol value) and a decoder of (protocol) for the struct TYPE
+ as per the PATH, :generic or :inline."
+  (ecase path
+    (:generic
+     (values #'(lambda (protocol value) (stream-write-struct protocol value))
+             #'(lambda (protocol) (stream-read-struct protocol type))))
+    (:inline
+     (values (compile nil `(lambda (protocol value) (stream-write-struct protocol value ',type)))
+             (compile nil `(lambda (protocol) (stream-read-struct protocol ',type)))))))
+
+
+(defun codec-benchmark (idl identifier instance path encoder decoder
+                        &rest measure-args &key (count *count*) &allow-other-keys)
+  "Measure the ENCODER of (protocol value) and the DECODER of (protocol) with the INSTANCE.
+ Return the encode and the decode results."
+  (declare (type function encoder decoder))
+  (let ((protocol (make-codec-protocol))
+        (size nil))
+    (rewind-protocol protocol)
+    (funcall encoder protocol instance)
+    (setf size (thrift.implementation::stream-position (protocol-output-transport protocol)))
+    (flet ((encode ()
+             (rewind-protocol protocol)
+             (funcall encoder protocol instance))
+           (decode ()
+             (rewind-protocol protocol)
+             (funcall decoder protocol)))
+      (list (multiple-value-bind (seconds consed) (apply #'measure #'encode measure-args)
+              (throughput-result seconds consed count size
+                                 :suite :codec :idl idl :name identifier
+                                 :path path :operation :encode))
+            (multiple-value-bind (seconds consed) (apply #'measure #'decode measure-args)
+              (throughput-result seconds consed count size
+                                 :suite :codec :idl idl :name identifier
+                                 :path path :operation :decode))))))
+
+
+(defun struct-codec-benchmark (idl class path &rest measure-args)
+  "Measure encoding and decoding a random instance of CLASS along the PATH."
+  (let ((type (class-name class)))
+    (multiple-value-bind (encoder decoder) (struct-codec-functions type path)
+      (apply #'codec-benchmark idl (class-identifier class) (random-struct type) path
+             encoder decoder measure-args))))
+
+
+(defun idl-codec-benchmarks (idl &rest measure-args)
+  (let ((*package* (load-idl idl)))
+    (loop for class in (idl-struct-classes *package*)
+          append (loop for path in '(:generic :inline)
+                       append (handler-case (apply #'struct-codec-benchmark idl class path measure-args)
+                                (error (condition)
+                                  (warn "codec benchmark failed: ~a ~a ~(~a~): ~a"
+                                        idl (class-identifier class) path condition)
+                                  nil))))))
+
+
+(defun run-codec-benchmarks (&key (idls *codec-idls*) (seed 1)
+                                  (count *count*) (warmup *warmup*) (repetitions *repetitions*)
+                                  output (format :sexp) baseline (threshold 0.1))
+  "Run the codec benchmarks for each of the IDLS with random instances generated from SEED.
+ Write the results to OUTPUT, if given, and compare them with the BASELINE results file, if given.
+ Return the results and the regressions."
+  (random-seed seed)
+  (let ((results (loop for idl in idls
+                       append (idl-codec-benchmarks idl :count count :warmup warmup :repetitions repetitions))))
+    (when output
+      (write-results results output :format format))
+    (values results
+            (when baseline
+              (compare-results results baseline :threshold threshold)))))
@@ -0,0 +1,138 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: thrift-bench; -*-
+
+(in-package :thrift-bench)
+
+;;; definition operators for the <program>-bench.lisp files which the cl generator writes given
+;;; the `bench` option, eg. `thrift --gen cl:bench service.thrift`
+;;;
+;;;  * def-random-struct : defines random-<struct> (&optional depth), which generates a random
+;;;    instance with code compiled from the field type specifications
+;;;  * def-codec-benchmark : registers an encode/decode benchmark for a struct, for both the
+;;;    :generic and the :inline paths
+;;;  * def-call-benchmark : registers a request/response benchmark for a service method through
+;;;    a loopback transport. The service implementation functions must be loaded first.
+;;;
+;;; Load the -types.lisp, the implementation and the -bench.lisp files and run
+;;;   (run-benchmarks :program "Service")
+
+
+(defvar *benchmarks* (make-hash-table :test 'equal)
+  "Binds (program kind name) to a function of the measurement arguments which returns results.")
+
+(defun register-benchmark (program kind name function)
+  (setf (gethash (cl:list program kind name) *benchmarks*) function))
+
+
+(defun random-value-form (type depth)
+  "Return a form which generates a random value of TYPE. DEPTH is the form for the nesting depth."
+  (if (consp type)
+    (ecase (first type)
+      ((list set)
+       `(loop repeat (random-size ,depth)
+              collect ,(random-value-form (second type) `(1+ ,depth))))
+      (map
+       `(loop repeat (random-size ,depth)
+              collect (cons ,(random-value-form (second type) `(1+ ,depth))
+                            ,(random-value-form (third type) `(1+ ,depth)))))
+      (enum
+       (let ((members (get (thrift.implementation::str-sym (second type)) 'thrift::enum-members)))
+         `(nth (bench-random ,(length members)) ',members)))
+      (struct
+       (let ((identifier (second type)))
+         (if (and (stringp identifier) (not (find #\: identifier)))
+           `(,(thrift.implementation::str-sym "random-" identifier) (1+ ,depth))
+           `(random-struct ',(thrift.implementation::str-sym identifier) (1+ ,depth))))))
+    (ecase type
+      (bool '(zerop (bench-random 2)))
+      ((byte i08) '(random-signed 8))
+      (i16 '(random-signed 16))
+      (i32 '(random-signed 32))
+      (i64 '(random-signed 64))
+      ((double float string binary) `(random-value ',type)))))
+
+
+(defmacro def-random-struct (identifier fields)
+  "Define random-<identifier> to generate an instance of the struct or exception with random
+ values for each of the FIELDS, given as (field-identifier type)."
+  (let* ((type (thrift.implementation::str-sym identifier))
+         (name (thrift.implementation::str-sym "random-" identifier))
+         (field-definitions (class-field-definitions (find-thrift-class type))))
+    `(defun ,name (&optional (depth 0))
+       (declare (ignorable depth))
+       (make-struct ',type
+                    ,@(loop for (field-identifier field-type) in fields
+                            for fd = (or (find field-identifier field-definitions
+                                               :key #'field-definition-identifier :test #'string=)
+                                         (error "Field not found: ~s.~s" identifier field-identifier))
+                            collect (or (field-definition-initarg fd)
+                                        (intern (symbol-name (field-definition-name fd)) :keyword))
+                            collect (random-value-form field-type 'depth))))))
+
+
+(defmacro def-codec-benchmark (program identifier)
+  "Register the codec benchmark for the struct IDENTIFIER. The :inline path is compiled here
+ with the constant type."
+  (let ((type (thrift.implementation::str-sym identifier))
+        (random-name (thrift.implementation::str-sym "random-" identifier)))
+    `(register-benchmark ,program :codec ,identifier
+                         #'(lambda (&rest measure-args)
+                             (let ((instance (,random-name)))
+                               (append (apply #'codec-benchmark ,program ,identifier instance :generic
+                                              #'(lambda (protocol value) (stream-write-struct protocol value))
+                                              (let ((type ',type))
+                                                #'(lambda (protocol) (stream-read-struct protocol type)))
+                                              measure-args)
+                                       (apply #'codec-benchmark ,program ,identifier instance :inline
+                                              #'(lambda (protocol value) (stream-write-struct protocol value ',type))
+                                              #'(lambda (protocol) (stream-read-struct protocol ',type))
+                                              measure-args)))))))
+
+
+(defun call-benchmark (program name service request arguments
+                       &rest measure-args &key (count *count*) &allow-other-keys)
+  "Measure calls to the REQUEST function with the ARGUMENTS through a loopback client of SERVICE."
+  (with-loopback-client (protocol service)
+    (multiple-value-bind (seconds consed)
+                         (apply #'measure #'(lambda () (apply request protocol arguments)) measure-args)
+      (cl:list (throughput-result seconds consed count nil
+                                  :suite :call :idl program :name name
+                                  :path :loopback :operation :call)))))
+
+
+(defmacro def-call-benchmark (program service identifier parameter-list)
+  "Register the loopback call benchmark for the SERVICE method IDENTIFIER, with random arguments
+ generated from the PARAMETER-LIST, given as (identifier type id)."
+  (let ((request (thrift.implementation::str-sym identifier))
+        (service-name (thrift.implementation::str-sym service))
+        (name (concatenate 'string service "." identifier)))
+    `(register-benchmark ,program :call ,name
+                         #'(lambda (&rest measure-args)
+                             (apply #'call-benchmark ,program ,name ,service-name #',request
+                                    (cl:list ,@(loop for (nil type) in parameter-list
+                                                     collect (random-value-form type 0)))
+                                    measure-args)))))
+
+
+(defun run-benchmarks (&key program (kinds '(:codec :call)) (seed 1)
+                            (count *count*) (warmup *warmup*) (repetitions *repetitions*)
+                            output (format :sexp) baseline (threshold 0.1))
+  "Run the registered benchmarks for the PROGRAM, or for all programs, of the given KINDS.
+ Write the results to OUTPUT, if given, and compare them with the BASELINE results file, if given.
+ Return the results and the regressions."
+  (random-seed seed)
+  (let* ((keys (sort (loop for key being each hash-key of *benchmarks*
+                           when (and (or (null program) (equal program (first key)))
+                                     (member (second key) kinds))
+                           collect key)
+                     #'string< :key #'(lambda (key) (format nil "~{~a~^ ~}" key))))
+         (results (loop for key in keys
+                        append (handler-case (funcall (gethash key *benchmarks*)
+                                                      :count count :warmup warmup :repetitions repetitions)
+                                 (error (condition)
+                                   (warn "benchmark failed: ~{~a~^ ~}: ~a" key condition)
+                                   nil)))))
+    (when output
+      (write-results results output :format format))
+    (values results
+            (when baseline
+              (compare-results results baseline :threshold threshold)))))
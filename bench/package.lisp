@@ -0,0 +1,25 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: common-lisp-user; -*-
+
+(in-package :common-lisp-user)
+
+
+(defpackage :thrift-bench
+  (:shadowing-import-from :thrift :byte :set :list :map :type-of :float)
+  (:use :common-lisp :thrift)
+  (:export :*count*
+           :*idl-directory*
+           :*repetitions*
+           :*warmup*
+           :compare-results
+           :def-call-benchmark
+           :def-codec-benchmark
+           :def-random-struct
+           :load-idl
+           :random-seed
+           :random-struct
+           :random-value
+           :read-results
+           :run-benchmarks
+           :run-codec-benchmarks
+           :run-rpc-benchmarks
+           :write-results))
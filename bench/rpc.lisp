@@ -0,0 +1,155 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: thrift-bench; -*-
+
+(in-package :thrift-bench)
+
+;;; end-to-end request latency and throughput for the ThriftTest service
+;;; (run-rpc-benchmarks)
+;;; (run-rpc-benchmarks :threads 16 :count 20000 :output #p"/tmp/rpc.csv" :format :csv)
+;;; (run-rpc-benchmarks :transport :loopback)
+;;;
+;;; The service runs in-process. With the :socket transport, a threaded-socket-server listens on
+;;; *rpc-location*, which should be a loopback address, and serves each client connection in its
+;;; own thread. With the :loopback transport, each client is paired with a server thread through
+;;; an in-memory transport, which excludes the kernel networking stack.
+;;; Each of THREADS clients makes WARMUP calls and then COUNT timed calls through the generated
+;;; request methods. The result reports requests per second over the interval from the common
+;;; start until the last client completes, and the p50/p99/p999 call latency in microseconds.
+
+
+(defparameter *rpc-location* (puri:parse-uri "thrift://127.0.0.1:9092"))
+
+(defparameter *rpc-map-size* 16)
+
+(defparameter *thrift-test-implementations*
+  (cl:list (cons "testVoid" #'(lambda () nil))
+           (cons "testString" #'identity)
+           (cons "testByte" #'identity)
+           (cons "testI32" #'identity)
+           (cons "testI64" #'identity)
+           (cons "testDouble" #'identity)
+           (cons "testStruct" #'identity)
+           (cons "testNest" #'identity)
+           (cons "testMap" #'identity)
+           (cons "testSet" #'identity)
+           (cons "testList" #'identity)
+           (cons "testEnum" #'identity)
+           (cons "testTypedef" #'identity)
+           (cons "testOneway" #'(lambda (seconds) (declare (ignore seconds)) nil)))
+  "Echo implementations for the ThriftTest methods which the benchmarks call.")
+
+(defparameter *rpc-methods*
+  (cl:list (cons "testString" #'(lambda () (cl:list (random-string))))
+           (cons "testStruct" #'(lambda () (cl:list (random-struct "xtruct"))))
+           (cons "testMap" #'(lambda ()
+                               (cl:list (loop for key below *rpc-map-size*
+                                              collect (cons key (random-signed 32))))))
+           (cons "testOneway" #'(lambda () (cl:list 0))))
+  "The ThriftTest methods to measure, each with a function which returns random arguments.")
+
+
+(defun call-with-rpc-client (op transport location service)
+  (ecase transport
+    (:socket (with-client (protocol location :pool nil)
+               (funcall op protocol)))
+    (:loopback (call-with-loopback-client op service))))
+
+
+(defun latency-percentiles (latencies)
+  "Return the 50th, 99th and 99.9th percentiles of the LATENCIES in microseconds."
+  (let* ((sorted (sort (copy-seq latencies) #'<))
+         (length (length sorted)))
+    (flet ((percentile (fraction)
+             (/ (* (aref sorted (min (1- length) (floor (* fraction length)))) 1000000.0d0)
+                internal-time-units-per-second)))
+      (values (percentile 0.5) (percentile 0.99) (percentile 0.999)))))
+
+
+(defun rpc-method-benchmark (identifier argument-function
+                             &key transport location service threads count warmup)
+  "Run THREADS clients which call the request method for IDENTIFIER. Return the result, or nil
+ if a client failed."
+  (let* ((request (thrift.implementation::str-sym identifier))
+         (package *package*)
+         (latencies (make-array (* threads count) :element-type 'fixnum :initial-element 0))
+         (arguments (loop repeat threads collect (funcall argument-function)))
+         (lock (bt:make-lock "thrift rpc benchmark"))
+         (ready 0)
+         (go nil)
+         (failure nil))
+    (flet ((run-client (index arguments)
+             (handler-case
+               (let ((*package* package))
+                 (call-with-rpc-client
+                  #'(lambda (protocol)
+                      (dotimes (i warmup) (apply request protocol arguments))
+                      (bt:with-lock-held (lock) (incf ready))
+                      (loop until go do (bt:thread-yield))
+                      (loop for i from (* index count) below (* (1+ index) count)
+                            do (let ((start (get-internal-real-time)))
+                                 (apply request protocol arguments)
+                                 (setf (aref latencies i) (- (get-internal-real-time) start)))))
+                  transport location service))
+               (error (condition)
+                 (bt:with-lock-held (lock)
+                   (setf failure condition)
+                   (incf ready))))))
+      (let ((clients (loop for index below threads
+                           for client-arguments in arguments
+                           collect (let ((index index) (client-arguments client-arguments))
+                                     (bt:make-thread #'(lambda () (run-client index client-arguments))
+                                                     :name (format nil "thrift rpc client ~d" index)))))
+            (start nil)
+            (consed nil))
+        (loop until (>= (bt:with-lock-held (lock) ready) threads)
+              do (bt:thread-yield))
+        (setf consed (bytes-consed)
+              start (get-internal-real-time)
+              go t)
+        (mapc #'bt:join-thread clients)
+        (let ((seconds (/ (max 1 (- (get-internal-real-time) start)) internal-time-units-per-second))
+              (calls (* threads count)))
+          (setf consed (- (bytes-consed) consed))
+          (cond (failure
+                 (warn "rpc benchmark failed: ~a ~(~a~): ~a" identifier transport failure)
+                 nil)
+                (t
+                 (multiple-value-bind (p50 p99 p999) (latency-percentiles latencies)
+                   (list :suite :rpc :idl "ThriftTest" :name identifier
+                         :path transport :operation :call :threads threads
+                         :ops/s (cl:float (/ calls seconds) 1.0d0)
+                         :consed/op (cl:float (/ consed calls) 1.0d0)
+                         :p50 p50 :p99 p99 :p999 p999)))))))))
+
+
+(defun run-rpc-benchmarks (&key (transport :socket) (location *rpc-location*) (threads 4)
+                                (count *count*) (warmup *warmup*) (methods *rpc-methods*) (seed 1)
+                                output (format :sexp) baseline (threshold 0.1))
+  "Serve ThriftTest and measure each of the METHODS with THREADS concurrent clients over the
+ TRANSPORT, :socket or :loopback. Write the results to OUTPUT, if given, and compare them with
+ the BASELINE results file, if given. Return the results and the regressions."
+  (random-seed seed)
+  (let* ((*package* (load-idl "ThriftTest" :implementations *thrift-test-implementations*))
+         (service (symbol-value (thrift.implementation::str-sym "ThriftTest")))
+         (server (when (eq transport :socket)
+                   (make-socket-server location :class 'threaded-socket-server)))
+         (server-thread (when server
+                          (bt:make-thread #'(lambda ()
+                                              ;; closing the listening socket terminates the accept loop
+                                              (handler-case (serve server service)
+                                                (error () nil)))
+                                          :name "thrift rpc benchmark server"))))
+    (unwind-protect
+      (let ((results (loop for (identifier . argument-function) in methods
+                           for result = (rpc-method-benchmark identifier argument-function
+                                                              :transport transport :location location
+                                                              :service service :threads threads
+                                                              :count count :warmup warmup)
+                           when result collect result)))
+        (when output
+          (write-results results output :format format))
+        (values results
+                (when baseline
+                  (compare-results results baseline :threshold threshold))))
+      (when server
+        (server-close server)
+        (bt:join-thread server-thread)))))
@@ -162,6 +162,80 @@
     ;; would need to check the length before trying stack allocation
     (stream-read-sequence (protocol-input-transport protocol) result)
     result))
+
+;;; a binary field with :representation :stream decodes a value longer than *binary-spill-threshold*
+;;; into a new file and yields its pathname, so that the value never resides in memory. The
+;;; application owns the file, and either renames it into place or deletes it. Symmetrically, the
+;;; writer accepts a pathname or a binary file stream as a binary value and copies it in chunks.
+
+(defparameter *binary-spill-threshold* (* 1024 1024)
+  "The length beyond which stream-read-binary-spill writes a binary value to a file.")
+
+(defparameter *binary-spill-directory* nil
+  "The directory in which stream-read-binary-spill creates files. If null, the temporary directory,
+ from TMPDIR or the platform's default, when the file is created.")
+
+(defparameter *binary-chunk-size* (* 64 1024)
+  "The size of the pooled buffer through which large binary values are copied.")
+
+(defvar *binary-spill-lengths* (make-hash-table :test 'eq
+                                               #+sbcl :weakness #+sbcl :key #+sbcl :synchronized #+sbcl t
+                                               #+ccl :weak #+ccl :key)
+  "Binds the pathnames which stream-read-binary-spill returns to their file lengths, in order that
+ the encoded size of a spilled value need not open the file.")
+
+(defun binary-spill-directory ()
+  (or *binary-spill-directory* (uiop:temporary-directory)))
+
+(defun open-binary-spill-file ()
+  "Create a new spill file with a random name. The names are drawn from a private, freshly seeded
+ random state, in order that neither processes started from the same image nor the application's
+ use of *random-state* make them collide or repeat."
+  (let ((state (make-random-state t)))
+    (loop (let ((stream (open (merge-pathnames (format nil "thrift-~36r.bin" (random (expt 36 10) state))
+                                               (binary-spill-directory))
+                              :direction :output :element-type '(unsigned-byte 8)
+                              :if-exists nil :if-does-not-exist :create)))
+            (when stream (return stream))))))
+
+(defmethod stream-read-binary-spill ((protocol binary-protocol))
+  "Read a binary value. If it is longer than *binary-spill-threshold*, copy it in chunks to a new
+ file in *binary-spill-directory* and return the file's pathname. Otherwise return a vector."
+  (let ((l (stream-read-i32 protocol))
+        (transport (protocol-input-transport protocol)))
+    (if (<= l *binary-spill-threshold*)
+      (let ((result (make-array l :element-type *binary-transport-element-type*)))
+        (stream-read-sequence transport result)
+        result)
+      (let ((output (open-binary-spill-file))
+            (complete nil))
+        ;; an incomplete file is deleted
+        (unwind-protect (with-octet-buffer (buffer *binary-chunk-size*)
+                          (loop with remaining = l
+                                while (plusp remaining)
+                                do (let ((count (min remaining (length buffer))))
+                                     (stream-read-sequence transport buffer 0 count)
+                                     (write-sequence buffer output :end count)
+                                     (decf remaining count)))
+                          (setf complete t))
+          (close output :abort (not complete)))
+        (let ((pathname (pathname output)))
+          (setf (gethash pathname *binary-spill-lengths*) l)
+          pathname)))))
+
+(defmethod stream-read-binary-view ((protocol binary-protocol))
+  "Read a binary value as an array displaced into the input transport's buffer, if the transport
+ holds the complete value. The array shares the buffer's lifetime, which ends for a framed
+ transport with the message. Otherwise read a fresh vector."
+  (let ((l (stream-read-i32 protocol))
+        (transport (protocol-input-transport protocol)))
+    (multiple-value-bind (buffer start) (transport-octet-view transport l)
+      (if buffer
+        (make-array l :element-type (array-element-type buffer)
+                    :displaced-to buffer :displaced-index-offset start)
+        (let ((result (make-array l :element-type *binary-transport-element-type*)))
+          (stream-read-sequence transport result)
+          result)))))
   
 
 
@@ -273,14 +347,104 @@
 
 
 (defmethod stream-write-binary ((protocol binary-protocol) (bytes vector))
-  (let ((unsigned-bytes (make-array (length bytes) :element-type '(unsigned-byte 8))))
-    (stream-write-i32 protocol (length bytes))
-    (map-into unsigned-bytes #'unsigned-byte-8 bytes)
-    (stream-write-sequence (protocol-output-transport protocol) unsigned-bytes)
-    (+ 4 (length bytes))))
+  (stream-write-i32 protocol (length bytes))
+  (if (typep bytes '(array (unsigned-byte 8) (*)))
+    ;; an octet vector, eg. a view or a large value, is written as is
+    (stream-write-sequence (protocol-output-transport protocol) bytes)
+    (let ((unsigned-bytes (make-array (length bytes) :element-type '(unsigned-byte 8))))
+      (map-into unsigned-bytes #'unsigned-byte-8 bytes)
+      (stream-write-sequence (protocol-output-transport protocol) unsigned-bytes)))
+  (+ 4 (length bytes)))
+
+(defmethod stream-write-binary ((protocol binary-protocol) (pathname pathname))
+  (with-open-file (input pathname :element-type '(unsigned-byte 8))
+    (stream-write-binary protocol input)))
+
+(defmethod stream-write-binary ((protocol binary-protocol) (input stream))
+  "Write the remaining content of the binary INPUT stream, which must have a file length, in
+ chunks through a pooled buffer."
+  (let ((length (- (file-length input) (file-position input)))
+        (transport (protocol-output-transport protocol)))
+    (stream-write-i32 protocol length)
+    (with-octet-buffer (buffer (min length *binary-chunk-size*))
+      (loop with remaining = length
+            while (plusp remaining)
+            do (let ((count (read-sequence buffer input :end (min remaining (length buffer)))))
+                 (when (zerop count)
+                   (error 'end-of-file :stream input))
+                 (stream-write-sequence transport buffer 0 count)
+                 (decf remaining count))))
+    (+ 4 length)))
 
 (defmethod stream-write-binary ((protocol binary-protocol) (string string))
   (let ((bytes (funcall (transport-string-encoder protocol) string)))
     (stream-write-i32 protocol (length bytes))
     (stream-write-sequence (protocol-output-transport protocol) bytes)
     (+ 4 (length bytes))))
+
+(defmethod stream-write-encoded-value ((protocol binary-protocol) (value encoded-value))
+  (let ((octets (encoded-value-octets value)))
+    (stream-write-sequence (protocol-output-transport protocol) octets)
+    (length octets)))
+
+
+;;;
+;;; encoded size
+;;; def-struct defines <struct>-encoded-size from the field types (see binary-size-form), which
+;;; permits a writer to allocate its buffer once or to write a length prefix before the struct.
+;;; The sizes assume the utf-8 string encoding and struct-id-mode :none.
+
+(defgeneric thrift-encoded-size (value)
+  (:documentation "Return the exact number of bytes in the binary protocol encoding of the
+ struct VALUE.")
+
+  (:method ((value encoded-value))
+    (length (encoded-value-octets value))))
+
+(defun binary-string-size (value)
+  "Return the encoded size of a string or binary VALUE, including its length prefix."
+  (+ 4 (etypecase value
+         (string (trivial-utf-8:utf-8-byte-length value))
+         (vector (length value))
+         (symbol (trivial-utf-8:utf-8-byte-length (symbol-name value)))
+         (pathname (or (gethash value *binary-spill-lengths*)
+                       (with-open-file (input value :element-type '(unsigned-byte 8))
+                         (file-length input))))
+         (stream (- (file-length value) (file-position value))))))
+
+(defun binary-value-size (value type)
+  "Return the encoded size of a VALUE of TYPE, as computed at run time. A null TYPE is
+ determined from the value."
+  (etypecase type
+    (null (binary-value-size value (thrift:type-of value)))
+    ((member bool thrift:byte i08) 1)
+    ((eql i16) 2)
+    ((member i32 thrift:float) 4)
+    ((member i64 u64 double) 8)
+    ((member string binary) (binary-string-size value))
+    (cons
+     (if (typep value 'encoded-value)
+       (length (encoded-value-octets value))
+       (ecase (first type)
+         (enum 4)
+         (struct (thrift-encoded-size value))
+         ((thrift:list thrift:set)
+          (+ 5 (reduce #'+ value :key #'(lambda (element) (binary-value-size element (second type))))))
+         (thrift:map
+          (let ((size 6))
+            (map-map #'(lambda (key element)
+                         (incf size (+ (binary-value-size key (second type))
+                                       (binary-value-size element (third type)))))
+                     value)
+            size)))))))
+
+(defgeneric stream-write-framed-struct (protocol value &optional type)
+  (:documentation "Write the struct VALUE preceded by its encoded size as an i32, as for a
+ framed transport. The size is computed from the value, so that no intermediate buffer is
+ required. Return the number of bytes written.")
+
+  (:method ((protocol binary-protocol) value &optional (type (type-of value)))
+    (let ((size (thrift-encoded-size value)))
+      (stream-write-i32 protocol size)
+      (stream-write-struct protocol value type)
+      (+ 4 size))))
@@ -0,0 +1,207 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: org.apache.thrift.implementation; -*-
+
+(in-package :org.apache.thrift.implementation)
+
+;;; This file implements an octet buffer pool for the `org.apache.thrift` library.
+;;;
+;;; Licensed to the Apache Software Foundation (ASF) under one
+;;; or more contributor license agreements. See the NOTICE file
+;;; distributed with this work for additional information
+;;; regarding copyright ownership. The ASF licenses this file
+;;; to you under the Apache License, Version 2.0 (the
+;;; "License"); you may not use this file except in compliance
+;;; with the License. You may obtain a copy of the License at
+;;;
+;;;   http://www.apache.org/licenses/LICENSE-2.0
+;;;
+;;; Unless required by applicable law or agreed to in writing,
+;;; software distributed under the License is distributed on an
+;;; "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+;;; KIND, either express or implied. See the License for the
+;;; specific language governing permissions and limitations
+;;; under the License.
+
+
+;;; The pool retains (unsigned-byte 8) buffers in power-of-two size classes, from 64 bytes to
+;;; 4 megabytes. A thread which binds *octet-buffer-cache*, eg. a server connection thread, keeps
+;;; a short stack per class and exchanges half of it with the shared depot when it is empty or
+;;; full, so that the depot lock is taken once per several buffers. Without a cache, each operation
+;;; takes the depot lock. Requests beyond the largest class are allocated, and released to the
+;;; garbage collector.
+;;;
+;;;  * acquire-octet-buffer : return a buffer at least as long as the requested size
+;;;  * release-octet-buffer : return a buffer to the pool. the caller must not refer to it afterwards
+;;;  * with-octet-buffer : acquire a buffer for the extent of a body
+;;;  * with-octet-buffer-cache : bind a thread-local cache for the extent of a body, and return
+;;;    its buffers to the depot on exit
+;;;
+;;; A buffer's length is that of its size class, not the requested size: the user tracks the fill.
+;;; The framed transport and pooled vector streams acquire their buffers here and release them at
+;;; message end, as does with-encoded-struct.
+
+
+(defconstant +octet-buffer-minimum-shift+ 6)
+(defconstant +octet-buffer-maximum-shift+ 22)
+(defconstant +octet-buffer-class-count+ (1+ (- +octet-buffer-maximum-shift+ +octet-buffer-minimum-shift+)))
+
+(deftype octet-buffer () '(simple-array (unsigned-byte 8) (*)))
+
+
+(defun octet-buffer-size-class (size)
+  "Return the index of the smallest size class which holds SIZE octets, or nil if none does."
+  (declare (type fixnum size))
+  (let ((shift (max +octet-buffer-minimum-shift+ (integer-length (1- size)))))
+    (when (<= shift +octet-buffer-maximum-shift+)
+      (- shift +octet-buffer-minimum-shift+))))
+
+(defun octet-buffer-class-size (class)
+  (ash 1 (+ class +octet-buffer-minimum-shift+)))
+
+(defun make-octet-buffer-stacks (limit-function)
+  (let ((stacks (make-array +octet-buffer-class-count+)))
+    (dotimes (class +octet-buffer-class-count+ stacks)
+      (setf (aref stacks class)
+            (make-array (funcall limit-function class) :fill-pointer 0)))))
+
+
+(defclass octet-buffer-depot ()
+  ((lock
+    :initform (bt:make-lock "thrift octet buffer depot")
+    :reader octet-buffer-depot-lock)
+   (stacks
+    :reader octet-buffer-depot-stacks
+    :documentation "A vector, per size class, of vectors with fill pointer of free buffers.")
+   (class-bytes
+    :initform (* 4 1024 1024) :initarg :class-bytes
+    :reader octet-buffer-depot-class-bytes
+    :documentation "The number of bytes to retain per size class. Each class retains at least
+     two buffers.")
+   (allocations
+    :initform 0
+    :accessor octet-buffer-depot-allocations
+    :documentation "The count of buffers which acquire-octet-buffer has allocated."))
+  (:documentation "The shared store of free octet buffers."))
+
+(defmethod initialize-instance :after ((instance octet-buffer-depot) &key)
+  (let ((class-bytes (octet-buffer-depot-class-bytes instance)))
+    (setf (slot-value instance 'stacks)
+          (make-octet-buffer-stacks #'(lambda (class)
+                                        (max 2 (min 1024 (floor class-bytes (octet-buffer-class-size class)))))))))
+
+(defun make-octet-buffer-depot (&rest initargs &key class-bytes)
+  (declare (ignore class-bytes))
+  (apply #'make-instance 'octet-buffer-depot initargs))
+
+(defvar *octet-buffer-depot* (make-octet-buffer-depot)
+  "The depot from which acquire-octet-buffer draws and to which release-octet-buffer returns.")
+
+
+(defstruct (octet-buffer-cache (:constructor %make-octet-buffer-cache (stacks)))
+  (stacks nil :type simple-vector))
+
+(defparameter *octet-buffer-cache-limit* 8
+  "The number of buffers which a thread-local cache retains per size class.")
+
+(defun make-octet-buffer-cache ()
+  (%make-octet-buffer-cache (make-octet-buffer-stacks (constantly *octet-buffer-cache-limit*))))
+
+(defvar *octet-buffer-cache* nil
+  "The current thread's octet buffer cache, if any.")
+
+
+(defun depot-transfer (from to count)
+  (loop repeat count
+        while (and (plusp (fill-pointer from))
+                   (< (fill-pointer to) (array-dimension to 0)))
+        do (vector-push (vector-pop from) to)))
+
+(defun acquire-octet-buffer (size &key (cache *octet-buffer-cache*) (depot *octet-buffer-depot*))
+  "Return an octet buffer of at least SIZE bytes. Its content is unspecified."
+  (let ((class (octet-buffer-size-class size)))
+    (if (null class)
+      (make-array size :element-type '(unsigned-byte 8))
+      (or (let ((stack (when cache (aref (octet-buffer-cache-stacks cache) class))))
+            (cond ((null stack)
+                   (bt:with-lock-held ((octet-buffer-depot-lock depot))
+                     (let ((free (aref (octet-buffer-depot-stacks depot) class)))
+                       (when (plusp (fill-pointer free))
+                         (vector-pop free)))))
+                  ((plusp (fill-pointer stack))
+                   (vector-pop stack))
+                  (t
+                   ;; refill half of the cache from the depot
+                   (bt:with-lock-held ((octet-buffer-depot-lock depot))
+                     (depot-transfer (aref (octet-buffer-depot-stacks depot) class) stack
+                                     (ceiling (array-dimension stack 0) 2)))
+                   (when (plusp (fill-pointer stack))
+                     (vector-pop stack)))))
+          (progn (bt:with-lock-held ((octet-buffer-depot-lock depot))
+                   (incf (octet-buffer-depot-allocations depot)))
+                 (make-array (octet-buffer-class-size class) :element-type '(unsigned-byte 8)))))))
+
+(defun release-octet-buffer (buffer &key (cache *octet-buffer-cache*) (depot *octet-buffer-depot*))
+  "Return the BUFFER to the pool. A buffer whose length is not that of a size class, or which is
+ in excess of the limits, is left to the garbage collector."
+  (let* ((size (length buffer))
+         (class (octet-buffer-size-class size)))
+    (when (and class (typep buffer 'octet-buffer) (= size (octet-buffer-class-size class)))
+      (let ((stack (when cache (aref (octet-buffer-cache-stacks cache) class))))
+        (cond ((null stack)
+               (bt:with-lock-held ((octet-buffer-depot-lock depot))
+                 (vector-push buffer (aref (octet-buffer-depot-stacks depot) class))))
+              ((< (fill-pointer stack) (array-dimension stack 0))
+               (vector-push buffer stack))
+              (t
+               ;; return half of the cache to the depot
+               (bt:with-lock-held ((octet-buffer-depot-lock depot))
+                 (depot-transfer stack (aref (octet-buffer-depot-stacks depot) class)
+                                 (floor (array-dimension stack 0) 2)))
+               (vector-push buffer stack))))))
+  nil)
+
+(defun release-octet-buffer-cache (cache &optional (depot *octet-buffer-depot*))
+  "Return all buffers in the CACHE to the DEPOT."
+  (bt:with-lock-held ((octet-buffer-depot-lock depot))
+    (loop for stack across (octet-buffer-cache-stacks cache)
+          for free across (octet-buffer-depot-stacks depot)
+          do (depot-transfer stack free (fill-pointer stack))
+          do (setf (fill-pointer stack) 0))))
+
+
+(defmacro with-octet-buffer-cache ((&optional (cache '(make-octet-buffer-cache))) &body body)
+  "Execute BODY with *octet-buffer-cache* bound to CACHE, by default a new cache, and return its
+ buffers to the depot upon exit."
+  `(let ((*octet-buffer-cache* ,cache))
+     (unwind-protect (progn ,@body)
+       (release-octet-buffer-cache *octet-buffer-cache*))))
+
+(defmacro with-octet-buffer ((buffer size) &body body)
+  "Execute BODY with BUFFER bound to an octet buffer of at least SIZE bytes, and release it upon
+ exit."
+  `(let ((,buffer (acquire-octet-buffer ,size)))
+     (unwind-protect (progn ,@body)
+       (release-octet-buffer ,buffer))))
+
+
+(defun octet-buffer-pool-statistics (&optional (depot *octet-buffer-depot*) (cache *octet-buffer-cache*))
+  "Return a property list with the allocation count and, per size class, the count of free
+ buffers in the DEPOT and in the CACHE."
+  (list :allocations (octet-buffer-depot-allocations depot)
+        :classes (loop for class below +octet-buffer-class-count+
+                       for free = (bt:with-lock-held ((octet-buffer-depot-lock depot))
+                                    (fill-pointer (aref (octet-buffer-depot-stacks depot) class)))
+                       for cached = (if cache
+                                      (fill-pointer (aref (octet-buffer-cache-stacks cache) class))
+                                      0)
+                       when (or (plusp free) (plusp cached))
+                       collect (list :size (octet-buffer-class-size class)
+                                     :depot free :cache cached))))
+
+
+(defgeneric transport-release-buffers (transport)
+  (:documentation "Return the TRANSPORT's pooled buffers which hold no pending data to the pool.
+ The protocol calls this at the end of each message which it reads or writes. The base method
+ does nothing.")
+
+  (:method ((transport t))
+    nil))
@@ -50,6 +50,12 @@
   (:documentation "Each struct declaration creates a thrift-struct-class, which is used directly
  to instantiate structs."))
 
+(defclass thrift-sparse-struct-class (thrift-struct-class)
+  ()
+  (:documentation "A struct class for structs of which most fields are absent. Its field slots have
+ :sparse allocation: an instance holds a presence bit mask and a vector of just the present values,
+ ordered by field position, in place of one slot per field."))
+
 (defclass thrift-exception-class (thrift-class)
   ((condition-class
     :reader class-condition-class
@@ -64,6 +70,17 @@
   ()
   (:documentation "The abstract root class of all struct instances."))
 
+(defclass thrift-sparse-object (thrift-object)
+  ((sparse-presence
+    :initform 0 :type integer
+    :documentation "A bit mask of the present fields, by sparse field index.")
+   (sparse-values
+    :initform #() :type simple-vector
+    :documentation "The values of the present fields, in index order, in its first (logcount
+     sparse-presence) elements. It grows by doubling, so that a decoder which sets k fields in
+     order allocates O(log k) times rather than once per field."))
+  (:documentation "The abstract root class of instances of thrift-sparse-struct-class."))
+
 (defclass field-definition ()
   ((identifier
     :initarg :identifier :initarg :identifier-name
@@ -75,7 +92,23 @@
     :initarg :optional :initform nil
     :reader field-definition-optional
     :documentation "To be used to suppress unbound slots when serializing.
-     NYI, as the IDL translator does not provide the data.")))
+     NYI, as the IDL translator does not provide the data.")
+   (required
+    :initarg :required :initform nil
+    :reader field-definition-required
+    :documentation "True if the IDL declares the field required, in which case a decoded struct
+     which lacks it is invalid.")
+   (representation
+    :initarg :representation :initform nil
+    :reader field-definition-representation
+    :documentation "For a binary field, :view to decode the value as an array displaced into the
+     transport's buffer where the transport permits that, :stream to decode a large value into a
+     file, or nil to decode a fresh vector.")
+   (typedef
+    :initarg :typedef :initform nil
+    :reader field-definition-typedef
+    :documentation "The name of the typedef which the field declares, if any. Its representation
+     determines the conversion of decoded values.")))
    
 
 (defclass direct-field-definition (field-definition c2mop:standard-direct-slot-definition)
@@ -85,7 +118,11 @@
 
 (defclass effective-field-definition (field-definition c2mop:standard-effective-slot-definition)
   ((reader
-    :reader field-definition-reader)))
+    :reader field-definition-reader)
+   (sparse-index
+    :initform nil
+    :accessor field-definition-sparse-index
+    :documentation "For a field with :sparse allocation, its bit in the instance's presence mask.")))
 
 
 ;;; the specialized generic function classes
@@ -131,6 +168,13 @@
 (defmethod thrift:type-of ((value thrift-object))
   'struct)
 
+(defgeneric reset-struct (instance)
+  (:documentation "Make each field of the struct INSTANCE unbound, as when it is newly allocated,
+ and return it. def-struct defines a method for each struct class, which calls <struct>-reset.")
+  (:method ((instance thrift-object))
+    (dolist (fd (class-field-definitions instance) instance)
+      (slot-makunbound instance (field-definition-name fd)))))
+
 
 (defmethod make-instance ((class thrift-exception-class) &rest initargs)
   (declare (dynamic-extent initargs))
@@ -254,14 +298,17 @@
                                                 (error "No direct slot specified an id number: ~s." name)))
        (setf (slot-value sd 'reader) (or (some #'field-definition-reader direct-slots)
                                          (error "No direct slot specified a reader: ~s." name)))
-       (setf (slot-value sd 'optional) (some #'field-definition-optional direct-slots))))
+       (setf (slot-value sd 'optional) (some #'field-definition-optional direct-slots))
+       (setf (slot-value sd 'required) (some #'field-definition-required direct-slots))
+       (setf (slot-value sd 'representation) (some #'field-definition-representation direct-slots))
+       (setf (slot-value sd 'typedef) (some #'field-definition-typedef direct-slots))))
     sd))
 
 
 (defgeneric field-definition-identifier (field-definition)
   (:method ((fd cl:list))
-    ;; for use in macros
-    (first fd))
+    ;; for use in macros, where the first element may be a place
+    (or (getf (cddr fd) :identifier) (first fd)))
 
   (:method ((sd c2mop:slot-definition))
     "Provide a base method which returns nil to permit filtering all definitions."
@@ -287,6 +334,36 @@
     nil))
   
 
+(defgeneric field-definition-required (field-definition)
+  (:method ((fd cl:list))
+    ;; for use in macros
+    (getf (cddr fd) :required))
+
+  (:method ((sd c2mop:slot-definition))
+    "Provide a base method which returns nil to permit filtering all definitions."
+    nil))
+
+
+(defgeneric field-definition-typedef (field-definition)
+  (:method ((fd cl:list))
+    ;; for use in macros
+    (getf (cddr fd) :typedef))
+
+  (:method ((sd c2mop:slot-definition))
+    "Provide a base method which returns nil to permit filtering all definitions."
+    nil))
+
+
+(defgeneric field-definition-representation (field-definition)
+  (:method ((fd cl:list))
+    ;; for use in macros
+    (getf (cddr fd) :representation))
+
+  (:method ((sd c2mop:slot-definition))
+    "Provide a base method which returns nil to permit filtering all definitions."
+    nil))
+
+
 (defgeneric field-definition-initarg (field-definition)
   (:method ((sd c2mop:slot-definition))
     (first (c2mop:slot-definition-initargs sd))))
@@ -399,3 +476,87 @@
  disposition to the protocol."
 
   nil)
+
+
+;;;
+;;; sparse struct slot access
+;;;
+;;; A field slot with :sparse allocation has no instance storage. The slot access operators locate
+;;; its value in the sparse-values vector by counting the present fields of lower index. The vector
+;;; may be longer than the present count; fields are inserted and removed in place.
+
+(defmethod allocate-instance :around ((class thrift-sparse-struct-class) &rest initargs)
+  "Initialize the presence mask and the values directly, as the decoders allocate rather than
+ make instances."
+  (declare (ignore initargs))
+  (let ((instance (call-next-method)))
+    (setf (slot-value instance 'sparse-presence) 0
+          (slot-value instance 'sparse-values) #())
+    instance))
+
+(defmethod c2mop:compute-slots :around ((class thrift-sparse-struct-class))
+  (let ((slots (call-next-method))
+        (index 0))
+    (dolist (sd slots slots)
+      (when (eq (c2mop:slot-definition-allocation sd) :sparse)
+        (setf (field-definition-sparse-index sd) index)
+        (incf index)))))
+
+(defun sparse-value-position (presence index)
+  (logcount (ldb (byte index 0) presence)))
+
+(defmethod c2mop:slot-value-using-class ((class thrift-sparse-struct-class) object
+                                         (sd effective-field-definition))
+  (let ((index (field-definition-sparse-index sd)))
+    (if index
+      (let ((presence (slot-value object 'sparse-presence)))
+        (if (logbitp index presence)
+          (svref (slot-value object 'sparse-values) (sparse-value-position presence index))
+          (slot-unbound class object (c2mop:slot-definition-name sd))))
+      (call-next-method))))
+
+(defmethod (setf c2mop:slot-value-using-class) (value (class thrift-sparse-struct-class) object
+                                                (sd effective-field-definition))
+  (let ((index (field-definition-sparse-index sd)))
+    (if index
+      (let* ((presence (slot-value object 'sparse-presence))
+             (values (slot-value object 'sparse-values))
+             (position (sparse-value-position presence index)))
+        (if (logbitp index presence)
+          (setf (svref values position) value)
+          (let ((count (logcount presence)))
+            (if (< count (length values))
+              ;; shift the values above the position in place
+              (replace values values :start1 (1+ position) :start2 position :end2 count)
+              (let ((new-values (make-array (max 2 (* 2 (length values))) :initial-element 0)))
+                (replace new-values values :end2 position)
+                (replace new-values values :start1 (1+ position) :start2 position :end2 count)
+                (setf values new-values
+                      (slot-value object 'sparse-values) new-values)))
+            (setf (svref values position) value
+                  (slot-value object 'sparse-presence) (logior presence (ash 1 index)))
+            value)))
+      (call-next-method))))
+
+(defmethod c2mop:slot-boundp-using-class ((class thrift-sparse-struct-class) object
+                                          (sd effective-field-definition))
+  (let ((index (field-definition-sparse-index sd)))
+    (if index
+      (logbitp index (slot-value object 'sparse-presence))
+      (call-next-method))))
+
+(defmethod c2mop:slot-makunbound-using-class ((class thrift-sparse-struct-class) object
+                                              (sd effective-field-definition))
+  (let ((index (field-definition-sparse-index sd)))
+    (if index
+      (let ((presence (slot-value object 'sparse-presence)))
+        (when (logbitp index presence)
+          (let ((values (slot-value object 'sparse-values))
+                (position (sparse-value-position presence index))
+                (count (logcount presence)))
+            (replace values values :start1 position :start2 (1+ position) :end2 count)
+            ;; release the vacated element's value
+            (setf (svref values (1- count)) 0
+                  (slot-value object 'sparse-presence) (logandc2 presence (ash 1 index)))))
+        object)
+      (call-next-method))))
@@ -51,8 +51,8 @@
       (setf initargs (copy-list initargs))
       (remf initargs :protocol))
     (apply #'make-instance protocol
-      :input-transport (thrift:protocol-input-transport protocol)
-      :output-transport (thrift:protocol-output-transport protocol)
+      :input-transport (thrift:protocol-input-transport instance)
+      :output-transport (thrift:protocol-output-transport instance)
       :direction direction
       initargs))
 
@@ -72,9 +72,17 @@
        (call-with-client #',op ,@args))))
 
 
-(defun call-with-client (op &rest args)
+(defun call-with-client (op location &rest args &key (pool *connection-pool*) &allow-other-keys)
+  "Apply OP to a client protocol for LOCATION. If a connection POOL is given, or one is bound
+ globally, and the location is a thrift uri, lease the connection from the pool and return it
+ upon exit. Otherwise open a new connection and close it upon exit."
   (declare (dynamic-extent args))
-  (let ((protocol (apply #'client args)))
-    (unwind-protect (funcall op protocol)
-      (when (open-stream-p protocol)
-        (close protocol)))))
\ No newline at end of file
+  (when (nth-value 2 (get-properties args '(:pool)))
+    (setf args (copy-list args))
+    (remf args :pool))
+  (if (and pool (typep location 'puri:uri))
+    (apply #'call-with-pooled-client op pool location args)
+    (let ((protocol (apply #'client location args)))
+      (unwind-protect (funcall op protocol)
+        (when (open-stream-p protocol)
+          (close protocol))))))
\ No newline at end of file
@@ -12,12 +12,14 @@
 #include <vector>
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <boost/tokenizer.hpp>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sstream>
 #include <string>
 #include <algorithm>
+#include <cstring>
 
 #include "platform.h"
 #include "t_oop_generator.h"
@@ -37,6 +39,26 @@ class t_cl_generator : public t_oop_generator {
       const std::string& option_string)
     : t_oop_generator(program)
   {
+    std::map<std::string, std::string>::const_iterator iter;
+
+    iter = parsed_options.find("bench");
+    gen_bench_ = (iter != parsed_options.end());
+
+    iter = parsed_options.find("direct");
+    gen_direct_ = (iter != parsed_options.end());
+
+    iter = parsed_options.find("generic");
+    gen_generic_ = (iter != parsed_options.end());
+
+    iter = parsed_options.find("binary_views");
+    gen_binary_views_ = (iter != parsed_options.end());
+
+    iter = parsed_options.find("sparse");
+    sparse_threshold_ = 0;
+    if (iter != parsed_options.end()) {
+      sparse_threshold_ = iter->second.empty() ? 32 : atoi(iter->second.c_str());
+    }
+
     out_dir_base_ = "gen-cl";
   }
 
@@ -52,7 +74,12 @@ class t_cl_generator : public t_oop_generator {
   void generate_cl_struct (std::ofstream& out, t_struct* tstruct, bool is_exception);
   void generate_cl_struct_internal (std::ofstream& out, t_struct* tstruct, bool is_exception);
   void generate_exception_sig(std::ofstream& out, t_function* f);
+  void generate_bench_struct(t_struct* tstruct, bool is_exception);
+  void generate_bench_service(t_service* tservice);
   std::string render_const_value(t_type* type, t_const_value* value);
+  int binary_type_code(t_type* type);
+  void encode_const_value(std::string& out, t_type* type, t_const_value* value);
+  std::string render_octets(const std::string& octets);
 
   std::string cl_autogen_comment();
   void package_def(std::ofstream &out, std::string name);
@@ -64,6 +91,7 @@ class t_cl_generator : public t_oop_generator {
 
   std::string type_name(t_type* ttype);
   std::string typespec (t_type *t);
+  std::string field_typespec (t_type *t);
   std::string function_signature(t_function* tfunction);
   std::string argument_list(t_struct* tstruct);
 
@@ -77,6 +105,27 @@ class t_cl_generator : public t_oop_generator {
    */
   std::ofstream f_types_;
   std::ofstream f_vars_;
+  /**
+   * Random instance generators and benchmark registrations, iff the bench option is given
+   */
+  std::ofstream f_bench_;
+
+  bool gen_bench_;
+
+  /**
+   * Define the service request and response functions as plain functions, optionally
+   * with generic function wrappers
+   */
+  bool gen_direct_;
+  bool gen_generic_;
+
+  /**
+   * The optional field count from which structs use the sparse representation, or 0 for none
+   */
+  int sparse_threshold_;
+  bool is_sparse_struct(t_struct* tstruct);
+  bool gen_binary_views_;
+  std::string field_representation(t_field* tfield);
 
 };
 
@@ -97,6 +146,15 @@ void t_cl_generator::init_generator() {
   package_def(f_types_, program_name_);
   package_in(f_types_, program_name_);
   package_in(f_vars_, program_name_);
+
+  if (gen_bench_) {
+    string f_bench_name = get_out_dir()+"/"+program_name_+"-bench.lisp";
+    f_bench_.open(f_bench_name.c_str());
+    f_bench_ << cl_autogen_comment() << endl;
+    package_in(f_bench_, program_name_);
+    f_bench_ << ";;; load after " << program_name_ << "-types.lisp and the service implementation, then" << endl
+             << ";;; (thrift-bench:run-benchmarks :program \"" << program_name_ << "\")" << endl << endl;
+  }
 }
 
 string t_cl_generator::package_of(t_program* program) {
@@ -129,6 +187,9 @@ string t_cl_generator::cl_docstring(string raw) {
 void t_cl_generator::close_generator() {
   f_types_.close();
   f_vars_.close();
+  if (gen_bench_) {
+    f_bench_.close();
+  }
 }
 
 string t_cl_generator::generated_package() {
@@ -156,7 +217,25 @@ void t_cl_generator::package_in(std::ofstream &out, string name) {
   out << "(cl:in-package :" << package() << ")" << endl << endl;
 }
 
-void t_cl_generator::generate_typedef(t_typedef* ttypedef) {}
+/**
+ * Generate a typedef as a lisp type for the aliased type. A cl.representation annotation selects
+ * a specialized representation for the fields which declare the alias: typed, packed-array,
+ * hash-map or interned-string.
+ */
+void t_cl_generator::generate_typedef(t_typedef* ttypedef) {
+  f_types_ << "(thrift:def-typedef " << prefix(ttypedef->get_symbolic()) << " "
+           << field_typespec(ttypedef->get_type());
+
+  std::map<std::string, std::string>::const_iterator a_iter =
+    ttypedef->annotations_.find("cl.representation");
+  if (a_iter != ttypedef->annotations_.end()) {
+    f_types_ << " :representation :" << a_iter->second;
+  }
+  if (ttypedef->has_doc()) {
+    f_types_ << endl << "  :documentation \"" << cl_docstring(ttypedef->get_doc()) << "\"";
+  }
+  f_types_ << ")" << endl << endl;
+}
 
 void t_cl_generator::generate_enum(t_enum* tenum) {
   f_types_ << "(thrift:def-enum " << prefix(tenum->get_name()) << endl;
@@ -190,8 +269,169 @@ void t_cl_generator::generate_const(t_const* tconst) {
   string name = tconst->get_name();
   t_const_value* value = tconst->get_value();
 
-  f_vars_ << "(thrift:def-constant " << prefix(name) << " " << render_const_value(type, value) << ")"
-          << endl << endl;
+  t_type* true_type = get_true_type(type);
+
+  f_vars_ << "(thrift:def-constant " << prefix(name) << " " << render_const_value(type, value);
+  // compound constants carry their binary encoding, in order that they can be written verbatim
+  if (true_type->is_struct() || true_type->is_xception() || true_type->is_container()) {
+    string octets;
+    encode_const_value(octets, type, value);
+    f_vars_ << endl << "  :type " << typespec(type)
+            << endl << "  :encoded " << render_octets(octets);
+  }
+  f_vars_ << ")" << endl << endl;
+}
+
+/**
+ * The binary protocol type code for a type, as per *binary-transport-types*
+ */
+int t_cl_generator::binary_type_code(t_type* type) {
+  type = get_true_type(type);
+  if (type->is_base_type()) {
+    t_base_type::t_base tbase = ((t_base_type*)type)->get_base();
+    switch (tbase) {
+    case t_base_type::TYPE_BOOL:
+      return 2;
+    case t_base_type::TYPE_BYTE:
+      return 3;
+    case t_base_type::TYPE_DOUBLE:
+      return 4;
+    case t_base_type::TYPE_I16:
+      return 6;
+    case t_base_type::TYPE_I32:
+      return 8;
+    case t_base_type::TYPE_I64:
+      return 10;
+    case t_base_type::TYPE_STRING:
+      return 11;
+    default:
+      throw "compiler error: no type code for base type " + t_base_type::t_base_name(tbase);
+    }
+  } else if (type->is_enum()) {
+    return 8;
+  } else if (type->is_struct() || type->is_xception()) {
+    return 12;
+  } else if (type->is_map()) {
+    return 13;
+  } else if (type->is_set()) {
+    return 14;
+  } else if (type->is_list()) {
+    return 15;
+  }
+  throw "compiler error: no type code for type " + type->get_name();
+}
+
+static void append_big_endian(std::string& out, uint64_t value, int length) {
+  for (int shift = (length - 1) * 8; shift >= 0; shift -= 8) {
+    out.push_back((char)((value >> shift) & 0xff));
+  }
+}
+
+/**
+ * Append the binary protocol encoding of a constant value, as the library's binary-protocol
+ * would write it. A struct includes the fields given in the constant and otherwise those with
+ * a default value.
+ */
+void t_cl_generator::encode_const_value(std::string& out, t_type* type, t_const_value* value) {
+  type = get_true_type(type);
+  if (type->is_base_type()) {
+    t_base_type::t_base tbase = ((t_base_type*)type)->get_base();
+    switch (tbase) {
+    case t_base_type::TYPE_STRING: {
+      string data = value->get_string();
+      append_big_endian(out, data.size(), 4);
+      out.append(data);
+      break;
+    }
+    case t_base_type::TYPE_BOOL:
+      append_big_endian(out, (value->get_integer() > 0) ? 1 : 0, 1);
+      break;
+    case t_base_type::TYPE_BYTE:
+      append_big_endian(out, (uint64_t)value->get_integer(), 1);
+      break;
+    case t_base_type::TYPE_I16:
+      append_big_endian(out, (uint64_t)value->get_integer(), 2);
+      break;
+    case t_base_type::TYPE_I32:
+      append_big_endian(out, (uint64_t)value->get_integer(), 4);
+      break;
+    case t_base_type::TYPE_I64:
+      append_big_endian(out, (uint64_t)value->get_integer(), 8);
+      break;
+    case t_base_type::TYPE_DOUBLE: {
+      double data = (value->get_type() == t_const_value::CV_INTEGER)
+        ? (double)value->get_integer() : value->get_double();
+      uint64_t bits;
+      memcpy(&bits, &data, sizeof(bits));
+      append_big_endian(out, bits, 8);
+      break;
+    }
+    default:
+      throw "compiler error: no const of base type " + t_base_type::t_base_name(tbase);
+    }
+  } else if (type->is_enum()) {
+    // enums are encoded as i32, type code 8
+    append_big_endian(out, (uint64_t)value->get_integer(), 4);
+  } else if (type->is_struct() || type->is_xception()) {
+    const vector<t_field*>& fields = ((t_struct*)type)->get_members();
+    vector<t_field*>::const_iterator f_iter;
+    const map<t_const_value*, t_const_value*>& val = value->get_map();
+    map<t_const_value*, t_const_value*>::const_iterator v_iter;
+
+    for (f_iter = fields.begin(); f_iter != fields.end(); ++f_iter) {
+      t_const_value* field_value = (*f_iter)->get_value();
+      for (v_iter = val.begin(); v_iter != val.end(); ++v_iter) {
+        if ((*f_iter)->get_name() == v_iter->first->get_string()) {
+          field_value = v_iter->second;
+        }
+      }
+      if (field_value != NULL) {
+        append_big_endian(out, binary_type_code((*f_iter)->get_type()), 1);
+        append_big_endian(out, (uint64_t)(*f_iter)->get_key(), 2);
+        encode_const_value(out, (*f_iter)->get_type(), field_value);
+      }
+    }
+    append_big_endian(out, 0, 1);
+  } else if (type->is_map()) {
+    t_type* ktype = ((t_map*)type)->get_key_type();
+    t_type* vtype = ((t_map*)type)->get_val_type();
+    const map<t_const_value*, t_const_value*>& val = value->get_map();
+    map<t_const_value*, t_const_value*>::const_iterator v_iter;
+    append_big_endian(out, binary_type_code(ktype), 1);
+    append_big_endian(out, binary_type_code(vtype), 1);
+    append_big_endian(out, val.size(), 4);
+    for (v_iter = val.begin(); v_iter != val.end(); ++v_iter) {
+      encode_const_value(out, ktype, v_iter->first);
+      encode_const_value(out, vtype, v_iter->second);
+    }
+  } else if (type->is_list() || type->is_set()) {
+    t_type* etype = type->is_list() ? ((t_list*)type)->get_elem_type() : ((t_set*)type)->get_elem_type();
+    const vector<t_const_value*>& val = value->get_list();
+    vector<t_const_value*>::const_iterator v_iter;
+    append_big_endian(out, binary_type_code(etype), 1);
+    append_big_endian(out, val.size(), 4);
+    for (v_iter = val.begin(); v_iter != val.end(); ++v_iter) {
+      encode_const_value(out, etype, *v_iter);
+    }
+  } else {
+    throw "CANNOT ENCODE CONSTANT FOR TYPE: " + type->get_name();
+  }
+}
+
+/**
+ * Render octets as a literal vector, 24 to a line.
+ */
+string t_cl_generator::render_octets(const std::string& octets) {
+  std::ostringstream out;
+  out << "#(";
+  for (size_t i = 0; i < octets.size(); ++i) {
+    if (i > 0) {
+      out << ((i % 24 == 0) ? "\n    " : " ");
+    }
+    out << (int)(unsigned char)octets[i];
+  }
+  out << ")";
+  return out.str();
 }
 
 /**
@@ -257,10 +497,10 @@ string t_cl_generator::render_const_value(t_type* type, t_const_value* value) {
 
     indent_down();
   } else if (type->is_map()) {
-    // emit an hash form with both keys and values to be evaluated
+    // emit an immutable hash table form with both keys and values to be evaluated
     t_type* ktype = ((t_map*)type)->get_key_type();
     t_type* vtype = ((t_map*)type)->get_val_type();
-    out << "(thrift:map ";
+    out << "(thrift:constant-map ";
     indent_up();
     const map<t_const_value*, t_const_value*>& val = value->get_map();
     map<t_const_value*, t_const_value*>::const_iterator v_iter;
@@ -301,10 +541,59 @@ string t_cl_generator::render_const_value(t_type* type, t_const_value* value) {
 
 void t_cl_generator::generate_struct(t_struct* tstruct) {
   generate_cl_struct(f_types_, tstruct, false);
+  if (gen_bench_) {
+    generate_bench_struct(tstruct, false);
+  }
 }
 
 void t_cl_generator::generate_xception(t_struct* txception) {
   generate_cl_struct(f_types_, txception, true);
+  if (gen_bench_) {
+    generate_bench_struct(txception, true);
+  }
+}
+
+/**
+ * Generate the random instance generator for a struct or exception and, for a struct,
+ * register its codec benchmark.
+ */
+void t_cl_generator::generate_bench_struct(t_struct* tstruct, bool is_exception) {
+  std::string name = type_name(tstruct);
+  const vector<t_field*>& members = tstruct->get_members();
+  vector<t_field*>::const_iterator m_iter;
+
+  f_bench_ << "(thrift-bench:def-random-struct " << prefix(name) << endl;
+  indent_up();
+  f_bench_ << indent() << "(";
+  for (m_iter = members.begin(); m_iter != members.end(); ++m_iter) {
+    if (m_iter != members.begin()) {
+      f_bench_ << endl << indent() << " ";
+    }
+    f_bench_ << "(" << prefix((*m_iter)->get_name()) << " " << field_typespec((*m_iter)->get_type()) << ")";
+  }
+  f_bench_ << "))" << endl << endl;
+  indent_down();
+
+  if (!is_exception) {
+    f_bench_ << "(thrift-bench:def-codec-benchmark " << prefix(program_name_) << " " << prefix(name) << ")"
+             << endl << endl;
+  }
+}
+
+/**
+ * Register a loopback call benchmark for each service method.
+ */
+void t_cl_generator::generate_bench_service(t_service* tservice) {
+  vector<t_function*> functions = tservice->get_functions();
+  vector<t_function*>::iterator f_iter;
+
+  for (f_iter = functions.begin(); f_iter != functions.end(); ++f_iter) {
+    f_bench_ << "(thrift-bench:def-call-benchmark " << prefix(program_name_) << " "
+             << prefix(service_name_) << " " << prefix((*f_iter)->get_name()) << endl;
+    indent_up();
+    f_bench_ << indent() << function_signature(*f_iter) << ")" << endl << endl;
+    indent_down();
+  }
 }
 
 void t_cl_generator::generate_cl_struct_internal(std::ofstream& out, t_struct* tstruct, bool is_exception) {
@@ -320,9 +609,16 @@ void t_cl_generator::generate_cl_struct_internal(std::ofstream& out, t_struct* t
     if (m_iter != members.begin()) {
       out << endl << indent() << " ";
     }
-    out << "(" << prefix((*m_iter)->get_name()) << " " <<
-        ( (NULL != value) ? render_const_value(type, value) : "nil" ) <<
-        " :id " << (*m_iter)->get_key();
+    out << "(" << prefix((*m_iter)->get_name()) << " ";
+    if (NULL == value) {
+      out << "nil";
+    } else if (get_true_type(type)->is_container()) {
+      // a container default is built once and shared by all instances
+      out << "(cl:load-time-value " << render_const_value(type, value) << " t)";
+    } else {
+      out << render_const_value(type, value);
+    }
+    out << " :id " << (*m_iter)->get_key();
     if ( type->is_base_type() && "string" == typespec(type) )
       if ( ((t_base_type*)type)->is_binary() )
         out << " :type binary";
@@ -332,6 +628,15 @@ void t_cl_generator::generate_cl_struct_internal(std::ofstream& out, t_struct* t
       out << " :type " << typespec(type);
     if ( (*m_iter)->get_req() == t_field::T_OPTIONAL ) {
       out << " :optional t";
+    } else if ( (*m_iter)->get_req() == t_field::T_REQUIRED ) {
+      out << " :required t";
+    }
+    if ( type->is_typedef() ) {
+      out << " :typedef " << prefix(type_name(type));
+    }
+    std::string representation = field_representation(*m_iter);
+    if ( !representation.empty() ) {
+      out << " :representation :" << representation;
     }
     if ( (*m_iter)->has_doc()) {
       out << " :documentation \"" << cl_docstring((*m_iter)->get_doc()) << "\"";
@@ -353,10 +658,56 @@ void t_cl_generator::generate_cl_struct(std::ofstream& out, t_struct* tstruct, b
   }
   out << indent() ;
   generate_cl_struct_internal(out, tstruct, is_exception);
+  if (!is_exception && is_sparse_struct(tstruct)) {
+    out << endl << indent() << "(:metaclass thrift:thrift-sparse-struct-class)";
+  }
   indent_down();
   out << ")" << endl << endl;
 }
 
+/**
+ * A binary field decodes as a view into the transport's buffer if it is annotated
+ * cl.representation = "view", or if the binary_views option is given. One annotated
+ * cl.representation = "stream" decodes a large value into a file.
+ */
+std::string t_cl_generator::field_representation(t_field* tfield) {
+  t_type* type = get_true_type(tfield->get_type());
+  if (!(type->is_base_type() && ((t_base_type*)type)->is_binary())) {
+    return "";
+  }
+  std::map<std::string, std::string>::iterator a_iter =
+    tfield->annotations_.find("cl.representation");
+  if (a_iter != tfield->annotations_.end()) {
+    return a_iter->second;
+  }
+  return gen_binary_views_ ? "view" : "";
+}
+
+/**
+ * A struct uses the sparse representation, with storage for just its present fields, if it is
+ * annotated cl.representation = "sparse", or if the sparse option is given and it has at least
+ * that many optional fields.
+ */
+bool t_cl_generator::is_sparse_struct(t_struct* tstruct) {
+  std::map<std::string, std::string>::const_iterator a_iter =
+    tstruct->annotations_.find("cl.representation");
+  if (a_iter != tstruct->annotations_.end()) {
+    return a_iter->second == "sparse";
+  }
+  if (sparse_threshold_ <= 0) {
+    return false;
+  }
+  const vector<t_field*>& members = tstruct->get_members();
+  vector<t_field*>::const_iterator m_iter;
+  int optional_count = 0;
+  for (m_iter = members.begin(); m_iter != members.end(); ++m_iter) {
+    if ((*m_iter)->get_req() == t_field::T_OPTIONAL) {
+      optional_count++;
+    }
+  }
+  return optional_count >= sparse_threshold_;
+}
+
 void t_cl_generator::generate_exception_sig(std::ofstream& out, t_function* f) {
   generate_cl_struct_internal(out, f->get_xceptions(), true);
 }
@@ -382,6 +733,13 @@ void t_cl_generator::generate_service(t_service* tservice) {
                << "(:documentation \"" << cl_docstring(tservice->get_doc()) << "\")";
     }
 
+  if (gen_direct_) {
+    f_types_ << endl << indent() << "(:direct-calls t)";
+    if (gen_generic_) {
+      f_types_ << endl << indent() << "(:generic-functions t)";
+    }
+  }
+
   for (f_iter = functions.begin(); f_iter != functions.end(); ++f_iter) {
     t_function* function = *f_iter;
     string fname = function->get_name();
@@ -408,6 +766,10 @@ void t_cl_generator::generate_service(t_service* tservice) {
   f_types_ << ")" << endl;
 
   indent_down();
+
+  if (gen_bench_) {
+    generate_bench_service(tservice);
+  }
 }
 
 string t_cl_generator::typespec(t_type *t) {
@@ -432,6 +794,17 @@ string t_cl_generator::typespec(t_type *t) {
   }
 }
 
+/**
+ * As typespec, but distinguish binary from string fields.
+ */
+string t_cl_generator::field_typespec(t_type *t) {
+  t_type* true_type = get_true_type(t);
+  if (true_type->is_base_type() && ((t_base_type*)true_type)->is_binary()) {
+    return "binary";
+  }
+  return typespec(t);
+}
+
 string t_cl_generator::function_signature(t_function* tfunction) {
   return argument_list(tfunction->get_arglist());
 }
@@ -474,4 +847,12 @@ string t_cl_generator::type_name(t_type* ttype) {
   return prefix + name;
 }
 
-THRIFT_REGISTER_GENERATOR(cl, "Common Lisp", "");
+THRIFT_REGISTER_GENERATOR(cl, "Common Lisp",
+"    bench:           Also generate <program>-bench.lisp with random instance generators\n"
+"                     and codec and loopback call benchmarks for the thrift-bench system.\n"
+"    binary_views:    Decode binary fields as arrays displaced into the transport buffer.\n"
+"    direct:          Define service request and response functions as plain functions\n"
+"                     with ftype declarations instead of generic functions.\n"
+"    generic:         With direct, also define generic functions which delegate to them.\n"
+"    sparse[=N]:      Store structs with at least N (default 32) optional fields sparsely,\n"
+"                     with storage for just the present fields.\n");
@@ -33,8 +33,13 @@
 ;;;   - protocol-version-error
 ;;;   - protocol-type-error (type-error)
 ;;; - unknown-field-error (cell-error)
+;;; - required-field-error (cell-error)
 ;;; - field-type-error (type-error)
 ;;; - transport-error
+;;;   - transport-closed-error
+;;;   - frame-size-error
+;;;   - record-log-error
+;;;   - connection-pool-timeout-error
 ;;; 
 
 
@@ -75,6 +80,62 @@
 (define-condition transport-error (thrift-error) ())
 
 
+(define-condition transport-closed-error (transport-error)
+  ((type :initform *transport-ex-not-open*)
+   (transport :initarg :transport :reader transport-closed-error-transport)))
+
+(defmethod thrift-error-format-control ((error transport-closed-error))
+  (concatenate 'string (call-next-method)
+               " the transport is closed: ~a."))
+
+(defmethod thrift-error-format-arguments ((error transport-closed-error))
+  (append (call-next-method)
+          (list (transport-closed-error-transport error))))
+
+
+(define-condition frame-size-error (transport-error)
+  ((transport :initarg :transport :reader frame-size-error-transport)
+   (size :initarg :size :reader frame-size-error-size)))
+
+(defmethod thrift-error-format-control ((error frame-size-error))
+  (concatenate 'string (call-next-method)
+               " the frame size ~d exceeds the limit: ~a."))
+
+(defmethod thrift-error-format-arguments ((error frame-size-error))
+  (append (call-next-method)
+          (list (frame-size-error-size error) (frame-size-error-transport error))))
+
+
+(define-condition record-log-error (transport-error)
+  ((pathname :initarg :pathname :reader record-log-error-pathname)
+   (offset :initarg :offset :reader record-log-error-offset)
+   (message :initarg :message :reader record-log-error-message)))
+
+(defmethod thrift-error-format-control ((error record-log-error))
+  (concatenate 'string (call-next-method)
+               " ~a at offset ~d of ~a."))
+
+(defmethod thrift-error-format-arguments ((error record-log-error))
+  (append (call-next-method)
+          (list (record-log-error-message error) (record-log-error-offset error)
+                (record-log-error-pathname error))))
+
+
+(define-condition connection-pool-timeout-error (transport-error)
+  ((type :initform *transport-ex-timed-out*)
+   (location :initarg :location :reader connection-pool-timeout-error-location)
+   (timeout :initarg :timeout :reader connection-pool-timeout-error-timeout)))
+
+(defmethod thrift-error-format-control ((error connection-pool-timeout-error))
+  (concatenate 'string (call-next-method)
+               " no pooled connection available for ~a within ~s seconds."))
+
+(defmethod thrift-error-format-arguments ((error connection-pool-timeout-error))
+  (append (call-next-method)
+          (list (connection-pool-timeout-error-location error)
+                (connection-pool-timeout-error-timeout error))))
+
+
 
 (define-condition application-error (protocol-error)
   ((type :initform *application-ex-unknown*)
@@ -236,6 +297,21 @@
 
 
 
+(define-condition required-field-error (protocol-error cell-error)
+  ((type :initform *protocol-ex-invalid-data*)
+   (structure-type :initarg :structure-type :reader required-field-error-structure-type)))
+
+(defmethod thrift-error-format-control ((error required-field-error))
+  (concatenate 'string (call-next-method)
+               " required field is missing from struct type: ~s: ~a."))
+
+(defmethod thrift-error-format-arguments ((error required-field-error))
+  (append (call-next-method)
+          (list (required-field-error-structure-type error)
+                (cell-error-name error))))
+
+
+
 (define-condition unknown-method-error (protocol-error )
   ((type :initform *application-ex-unknown-method*)
    (identifier :initarg :identifier :reader unknown-method-error-identifier)
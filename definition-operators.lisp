@@ -29,6 +29,7 @@
 ;;;
 ;;;   def-constant
 ;;;   def-eum
+;;;   def-typedef
 ;;;   def-struct
 ;;;   def-exception
 ;;;   def-request-method
@@ -111,38 +112,324 @@
 
 
 
+(defun enum-function-name (name suffix)
+  (cons-symbol (symbol-package name) name suffix))
+
+(defun enum-validation-form (value values)
+  "Return a form which is true iff the VALUE is one of the integer VALUES. A contiguous range
+ reduces to a bounds test, and a range at most eight times denser than the values to a bit
+ vector index. Others compile as a case."
+  (when values
+    (let* ((min (reduce #'min values))
+           (max (reduce #'max values))
+           (range (1+ (- max min))))
+      (cond ((= range (length (remove-duplicates values)))
+             `(and (typep ,value 'fixnum) (<= ,min ,value ,max)))
+            ((<= range (* 8 (length values)))
+             (let ((bits (make-array range :element-type 'bit :initial-element 0)))
+               (dolist (v values) (setf (sbit bits (- v min)) 1))
+               `(and (typep ,value 'fixnum) (<= ,min ,value ,max)
+                     (= 1 (sbit ,bits (- ,value ,min))))))
+            (t
+             `(case ,value (,(remove-duplicates values) t) (t nil)))))))
+
+(defgeneric enum-value-p (type value)
+  (:documentation "Return true iff the VALUE is a member of the enum TYPE. DEF-ENUM specializes
+ it on the enum's name to call the enum's validator, so that codecs which see the type only at
+ run time dispatch to the validator without a property lookup.")
+  (:method ((type t) value)
+    (typep value type)))
+
 (defmacro def-enum (identifier entries)
+  "DEF-ENUM identifier ( ( name . value )* )
+ [Macro]
+
+ Define the enum's member type, a constant for each member, and the inline functions
+ <enum>-value-p, to validate a value, <enum>-name, to return a value's name, and <enum>-value,
+ to return a name's value. The codecs call the validator directly when the type is known at
+ compile time."
   (assert (stringp identifier))
-  (let ((name (str-sym identifier))
-        (value-names (mapcar #'(lambda (entry) (str-sym identifier "." (car entry))) entries)))
-    ;; define the type, leave the keys are string
-    (let ((values (mapcar #'rest entries)))
-      (assert (stringp identifier))
-      (assert (every #'integerp values))
-      ;; some compilers require the compile-time type for slot definitions
-      `(eval-when (:compile-toplevel :load-toplevel :execute)
-         (setf (get ',name 'thrift::enum-members) ',values
-                    (get ',name 'thrift::enum-alist) ',entries)
-              ,@(mapcar #'(lambda (entry) `(defconstant ,(str-sym identifier "." (car entry)) ,(rest entry)))
-                        entries)
-              (eval-when (:load-toplevel :compile-toplevel :execute)
-                (export '(,name ,@value-names) (symbol-package ',name)))
-              ',name))))
-
-
-
-(defmacro def-constant (identifier val)
-  "Generate a defparameter form, as the 'constants' are often bound to constructed values."
-  (assert (stringp identifier))
-  `(defparameter ,(str-sym identifier) ,val))
+  (let* ((name (str-sym identifier))
+         (value-names (mapcar #'(lambda (entry) (str-sym identifier "." (car entry))) entries))
+         (values (mapcar #'rest entries))
+         (validator (enum-function-name name :-value-p))
+         (namer (enum-function-name name :-name))
+         (valuer (enum-function-name name :-value)))
+    (assert (every #'integerp values))
+    ;; some compilers require the compile-time type for slot definitions
+    `(eval-when (:compile-toplevel :load-toplevel :execute)
+       (setf (get ',name 'thrift::enum-members) ',values
+             (get ',name 'thrift::enum-alist) ',entries)
+       ,@(mapcar #'(lambda (entry) `(defconstant ,(str-sym identifier "." (car entry)) ,(rest entry)))
+                 entries)
+       (declaim (inline ,validator ,namer ,valuer))
+       (defun ,validator (value)
+         ,(enum-validation-form 'value values))
+       (defun ,namer (value)
+         (case value
+           ,@(loop for (entry-name . entry-value) in (remove-duplicates entries :key #'rest :from-end t)
+                   collect `(,entry-value ,(string entry-name)))))
+       (defun ,valuer (name)
+         (cond ,@(loop for (entry-name . entry-value) in entries
+                       collect `((string= name ,(string entry-name)) ,entry-value))))
+       (defmethod enum-value-p ((type (eql ',name)) value)
+         (,validator value))
+       (export '(,name ,@value-names ,validator ,namer ,valuer) (symbol-package ',name))
+       ',name)))
+
+
+;;; typedefs
+;;; an alias names a lisp type for its representation. The wire type is unchanged, but struct
+;;; fields which declare the alias convert decoded and assigned values to the representation:
+;;;
+;;;   :typed           i16, i32, i64 or double : the specialized integer or float type, which
+;;;                    the field accessors declare as their result type. The slot storage is
+;;;                    not specialized, as the slot type carries the thrift type for the codecs
+;;;   :packed-array    a list of a numeric type : a specialized simple vector
+;;;   :hash-map        a map : a hash table which compares keys with thrift-equal
+;;;   :interned-string a string : strings which are equal are shared
+
+(defun specialized-lisp-type (type)
+  (ecase type
+    ((thrift:byte i08) '(signed-byte 8))
+    (i16 '(signed-byte 16))
+    (i32 '(signed-byte 32))
+    (i64 '(signed-byte 64))
+    (double 'double-float)))
+
+(defun typedef-lisp-type (type representation)
+  (ecase representation
+    ((nil) type)
+    (:typed (specialized-lisp-type type))
+    (:packed-array
+     (assert (and (consp type) (member (first type) '(thrift:list thrift:set))) ()
+             "A packed array representation requires a list or set type: ~s." type)
+     `(simple-array ,(specialized-lisp-type (second type)) (*)))
+    (:hash-map
+     (assert (and (consp type) (eq (first type) 'thrift:map)) ()
+             "A hash map representation requires a map type: ~s." type)
+     'hash-table)
+    (:interned-string
+     (assert (eq type 'string) () "An interned string representation requires a string type: ~s." type)
+     'string)))
+
+(defun typedef-representation (name)
+  (get name 'typedef-representation))
+
+(defvar *interned-strings-lock* (bt:make-lock "thrift interned strings"))
+
+(defun typedef-value (name value)
+  "Return VALUE in the representation of the typedef NAME."
+  (case (typedef-representation name)
+    (:packed-array
+     (if (listp value)
+       (coerce value (typedef-lisp-type (get name 'typedef-type) :packed-array))
+       value))
+    (:hash-map
+     (if (listp value)
+       (let ((table (make-map-table (length value))))
+         (loop for (key . element) in value
+               do (setf (gethash key table) element))
+         table)
+       value))
+    (:interned-string
+     (if (stringp value)
+       (let ((table (or (get name 'interned-strings)
+                        (setf (get name 'interned-strings) (make-hash-table :test 'equal)))))
+         (bt:with-lock-held (*interned-strings-lock*)
+           (or (gethash value table)
+               (setf (gethash value table) value))))
+       value))
+    (t
+     value)))
+
+(defmacro def-typedef (identifier type &key representation documentation)
+  "DEF-TYPEDEF identifier type &key representation documentation
+ [Macro]
 
+ Define the alias as a lisp type for the REPRESENTATION of the thrift TYPE, and record both for
+ the struct fields which declare it."
+  (let ((name (str-sym identifier)))
+    `(eval-when (:compile-toplevel :load-toplevel :execute)
+       (deftype ,name () ',(typedef-lisp-type type representation))
+       ,@(when documentation
+           `((setf (documentation ',name 'type) ,(string-trim *whitespace* documentation))))
+       (setf (get ',name 'typedef-type) ',type
+             (get ',name 'typedef-representation) ,representation)
+       (export ',name (symbol-package ',name))
+       ',name)))
+
+
+(defmacro def-constant (identifier val &key type encoded)
+  "Generate a defparameter form, as the 'constants' are often bound to constructed values.
+ Given the ENCODED octets of a value of TYPE, as the generator emits them for compound constants,
+ also record an encoded-value, which constant-encoded-value returns, to be written in place of
+ the value without encoding it again."
+  (assert (stringp identifier))
+  (let ((name (str-sym identifier)))
+    (if encoded
+      `(progn (defparameter ,name ,val)
+              (setf (get ',name 'encoded-value) (make-encoded-value ',type ,(coerce encoded 'vector)))
+              ',name)
+      `(defparameter ,name ,val))))
+
+
+
+(defun generate-struct-equality (identifier name fields slot-names accessor-names)
+  "Return the definitions for <struct>-equal and <struct>-hash, which compare and hash the fields
+ in id order with the operators for each field's type, and the thrift-equal and thrift-hash
+ methods which call them. Any field, required ones included, may be unbound, and an unbound field
+ matches only an unbound field."
+  (let ((equal-name (str-sym identifier "-equal"))
+        (hash-name (str-sym identifier "-hash"))
+        (field-specs (sort (loop for field in fields
+                                 for slot-name in slot-names
+                                 for accessor in accessor-names
+                                 collect (destructuring-bind (slot-identifier default &key type id
+                                                                              &allow-other-keys)
+                                                             field
+                                           (declare (ignore slot-identifier default))
+                                           (list id slot-name accessor type)))
+                           #'< :key #'first)))
+    ;; a field named equal or hash would collide with an accessor
+    (when (member equal-name accessor-names) (setf equal-name (str-sym identifier "-thrift-equal")))
+    (when (member hash-name accessor-names) (setf hash-name (str-sym identifier "-thrift-hash")))
+    `((defun ,equal-name (a b)
+        (or (eq a b)
+            (and ,@(loop for (nil slot-name accessor type) in field-specs
+                         collect `(let ((a-bound (slot-boundp a ',slot-name)))
+                                    (and (eq a-bound (slot-boundp b ',slot-name))
+                                         (or (not a-bound)
+                                             ,(field-equal-form type `(,accessor a) `(,accessor b)))))))))
+      (defun ,hash-name (object)
+        (let ((hash ,(sxhash identifier)))
+          ,@(loop for (nil slot-name accessor type) in field-specs
+                  collect `(when (slot-boundp object ',slot-name)
+                             (setf hash (mix-hash hash ,(field-hash-form type `(,accessor object))))))
+          hash))
+      (defmethod thrift-equal ((a ,name) (b ,name))
+        (,equal-name a b))
+      (defmethod thrift-hash ((object ,name))
+        (,hash-name object))
+      (export '(,equal-name ,hash-name) (symbol-package ',name)))))
+
+
+(defun binary-size-form (type value)
+  "Return the exact binary protocol encoded size of the VALUE of TYPE as an integer, if it is
+ fixed, or otherwise as a form."
+  (etypecase type
+    ((member bool thrift:byte i08) 1)
+    ((eql i16) 2)
+    ((member i32 thrift:float) 4)
+    ((member i64 u64 double) 8)
+    ((member string binary) `(binary-string-size ,value))
+    (symbol `(binary-value-size ,value ',type))
+    (cons
+     (ecase (first type)
+       (enum 4)
+       (struct `(thrift-encoded-size ,value))
+       ((thrift:list thrift:set)
+        (let* ((element (gensym "ELEMENT-"))
+               (element-size (binary-size-form (second type) element)))
+          `(if (typep ,value 'encoded-value)
+             (length (encoded-value-octets ,value))
+             ,(if (integerp element-size)
+                `(+ 5 (* ,element-size (length ,value)))
+                `(+ 5 (loop for ,element in ,value sum ,element-size))))))
+       (thrift:map
+        (let* ((key (gensym "KEY-"))
+               (element (gensym "VALUE-"))
+               (key-size (binary-size-form (second type) key))
+               (value-size (binary-size-form (third type) element)))
+          `(if (typep ,value 'encoded-value)
+             (length (encoded-value-octets ,value))
+             ,(if (and (integerp key-size) (integerp value-size))
+                `(+ 6 (* ,(+ key-size value-size) (map-size ,value)))
+                `(let ((size 6))
+                   (map-map #'(lambda (,key ,element)
+                                (declare (ignorable ,key ,element))
+                                (incf size (+ ,key-size ,value-size)))
+                            ,value)
+                   size)))))))))
+
+(defun generate-struct-encoded-size (identifier name fields slot-names accessor-names)
+  "Return the definition for <struct>-encoded-size, which computes the exact binary protocol
+ size of an instance from its field values, and the thrift-encoded-size method which calls it.
+ An unbound field contributes nothing, whether or not it is optional, as the encoder writes no
+ field for it."
+  (let ((size-name (str-sym identifier "-encoded-size")))
+    (when (member size-name accessor-names) (setf size-name (str-sym identifier "-thrift-encoded-size")))
+    `((defun ,size-name (object)
+        (+ 1                            ; field stop
+           ,@(loop for field in fields
+                   for slot-name in slot-names
+                   for accessor in accessor-names
+                   collect (destructuring-bind (slot-identifier default &key type &allow-other-keys)
+                                               field
+                             (declare (ignore slot-identifier default))
+                             ;; field type, id, and the value
+                             `(if (slot-boundp object ',slot-name)
+                                (+ 3 ,(binary-size-form type `(,accessor object)))
+                                0)))))
+      (defmethod thrift-encoded-size ((object ,name))
+        (,size-name object))
+      (export ',size-name (symbol-package ',name)))))
+
+
+(defun generate-struct-typedef-accessors (name fields accessor-names)
+  "Return the definitions for the fields which declare a typedef with a specialized representation:
+ a writer method which converts the value, and the reader's result type. The result type holds as
+ the writer and the initform convert to the representation, and the container types include it."
+  (loop for field in fields
+        for accessor in accessor-names
+        for typedef = (getf (cddr field) :typedef)
+        for alias = (when typedef (str-sym typedef))
+        when (and alias (typedef-representation alias))
+        collect `(defmethod (setf ,accessor) :around (value (instance ,name))
+                   (call-next-method (typedef-value ',alias value) instance))
+        and collect `(declaim (ftype (function (t) ,alias) ,accessor))))
+
+
+(defun generate-struct-reset (identifier name slot-names accessor-names)
+  "Return the definition for <struct>-reset, which makes each field unbound in order to reuse the
+ instance as if newly allocated, and the reset-struct method which calls it."
+  (let ((reset-name (str-sym identifier "-reset")))
+    (when (member reset-name accessor-names) (setf reset-name (str-sym identifier "-thrift-reset")))
+    `((defun ,reset-name (instance)
+        ,@(loop for slot-name in slot-names
+                collect `(slot-makunbound instance ',slot-name))
+        instance)
+      (defmethod reset-struct ((instance ,name))
+        (,reset-name instance))
+      (export ',reset-name (symbol-package ',name)))))
+
+
+(defun generate-struct-isset-predicates (identifier name fields slot-names accessor-names)
+  "Return the definitions for <struct>-isset-<field>, which test whether the field is set. Each is a
+ generic function with one method on the struct class, which permits the implementation to compile
+ the slot test with the instance layout rather than through the slot-definition protocol. The
+ explicit defgeneric avoids the implicit generic function warning."
+  (loop for (slot-identifier) in fields
+        for slot-name in slot-names
+        for isset-name = (str-sym identifier "-isset-" slot-identifier)
+        ;; a field named isset-<field> would collide with an accessor
+        unless (member isset-name accessor-names)
+        collect `(defgeneric ,isset-name (instance)
+                   (:documentation ,(format nil "Return true iff the ~a field of the ~a is set."
+                                            slot-identifier identifier))
+                   (:method ((instance ,name))
+                     (slot-boundp instance ',slot-name)))
+          into definitions
+        and collect isset-name into isset-names
+        finally (return `(,@definitions (export ',isset-names (symbol-package ',name))))))
 
 
 (defmacro def-struct (identifier fields &rest options)
   "DEF-STRUCT identifier [doc-string] ( field-specifier* ) option*
  [Macro]
 
- field-specifier ::= ( field-identifier default &key type id documentation )
+ field-specifier ::= ( field-identifier default &key type id documentation optional required typedef
+                       representation )
  option ::= (:documentation docstring)
           | (:metaclass metaclass)
           | (:identifier identifier)
@@ -150,7 +437,11 @@
  Define a thrift struct with the declared fields. The class and field names are computed by cononicalizing the
  respective identifier and interning it in the current *package*. Each identifier remains associated with its
  metaobject for codec use. Options allow for an explicit identifier, a metacoal other than thrift-struct-class,
- and a documentation string.
+ and a documentation string. Given thrift-sparse-struct-class as the metaclass, an instance stores just
+ the values of its present fields. A binary field with :representation :view decodes as an
+ array displaced into the transport's buffer, which is valid only until the end of the message.
+ With :representation :stream, a value beyond *binary-spill-threshold* decodes to the pathname
+ of a file which holds it.
 
  The class is bound to its name as both the thrift class and CLOS class."
 
@@ -159,20 +450,23 @@
         (condition-class (second (assoc :condition-class options)))
         (name (str-sym identifier))
         (make-name (str-sym "make-" identifier))
+        (sparse-p nil)
         (slot-names nil)
         (accessor-names nil)
         (documentation nil))
     (when (stringp fields)
       (shiftf documentation fields (pop options)))
+    (setf sparse-p (subtypep metaclass 'thrift-sparse-struct-class))
     (setf slot-names (loop for (identifier) in fields collect (str-sym identifier)))
     (setf accessor-names (loop for (slot-identifier) in fields collect (str-sym identifier "-" slot-identifier)))
     ;; make the definitions available to compile codecs
     `(eval-when (:compile-toplevel :load-toplevel :execute)
-       (defclass ,name (thrift-object)
+       (defclass ,name (,(if sparse-p 'thrift-sparse-object 'thrift-object))
          ,(loop for field in fields
                 for slot-name in slot-names
                 for slot-accessor-name in accessor-names
-                collect (destructuring-bind (slot-identifier default &key type id documentation (optional nil o-s))
+                collect (destructuring-bind (slot-identifier default &key type id documentation (optional nil o-s)
+                                                             required typedef representation)
                                             field
                           (assert (typep id 'fixnum))
                           (when (struct-type-p type)    ; coerce this early to avoid package problems
@@ -182,13 +476,21 @@
                             ,@(when condition-class
                                 `(:initarg ,(cons-symbol :keyword slot-identifier)))
                             :accessor ,slot-accessor-name
+                            ,@(when sparse-p `(:allocation :sparse))
                             ,@(when type `(:type ,type))
                             :identifier-number ,id
                             :identifier-name ,slot-identifier
                             ,@(if (or default (eq type 'bool))
-                                `(:initform ,default)         ; are any bool fields optional?
+                                ;; are any bool fields optional?
+                                ;; a default takes the typedef's representation, as do assigned values
+                                `(:initform ,(if (and typedef (typedef-representation (str-sym typedef)))
+                                               `(typedef-value ',(str-sym typedef) ,default)
+                                               default))
                                 (unless o-s `(:initform (error ,(format nil "~a is required." slot-identifier)))))
                             ,@(when o-s `(:optional ,optional))
+                            ,@(when required `(:required t))
+                            ,@(when typedef `(:typedef ,(str-sym typedef)))
+                            ,@(when representation `(:representation ,representation))
                             ,@(when documentation `(:documentation ,(string-trim *whitespace* documentation))))))
          (:metaclass ,metaclass)
          (:identifier ,identifier)
@@ -214,7 +516,12 @@
                  ,@(loop for slot-name in slot-names
                          collect `(when (slot-boundp object ',slot-name)
                                     (format stream " :~a ~s"
-                                            ',slot-name (slot-value object ',slot-name))))))))
+                                            ',slot-name (slot-value object ',slot-name))))))
+             ,@(generate-struct-equality identifier name fields slot-names accessor-names)
+             ,@(generate-struct-encoded-size identifier name fields slot-names accessor-names)
+             ,@(generate-struct-typedef-accessors name fields accessor-names)
+             ,@(generate-struct-isset-predicates identifier name fields slot-names accessor-names)
+             ,@(generate-struct-reset identifier name slot-names accessor-names)))
        ,@(unless (eq metaclass 'thrift-exception-class)
            `((export '(,name ,make-name
                        ,@accessor-names)
@@ -255,9 +562,10 @@
          ,@options)
        (define-condition ,name (application-error)
          ,(loop for field in fields
-                collect (destructuring-bind (slot-identifier default &key type id documentation optional)
+                collect (destructuring-bind (slot-identifier default &key type id documentation optional required typedef
+                                                             representation)
                                             field
-                          (declare (ignore id optional))
+                          (declare (ignore id optional required typedef representation))
                           (when (struct-type-p type)    ; coerce this early to avoid package problems
                             (setf type `(struct, (str-sym (second type)))))
                           `(,(str-sym slot-identifier)
@@ -285,46 +593,109 @@
  PROT : a variable bound to a protocol instance
  CLASS : a form to be evaluated to compute the expected class
  FIELD-DEFINITIONS : a list of field definitions - either definition metaobjects or definition declarations
- EXTRA-FIELD-PLIST : a variable bound to a plist in which unknown fields are to be cached."
-
-  (with-gensyms (expected-class read-class read-type)
-    `(let* ((,expected-class ,class-form)
-            (,read-class (stream-read-struct-begin ,prot))
-            (,read-type (when ,read-class (struct-name ,read-class))))
-       (unless (or (null ,read-type) (equal ,read-type (struct-name ,expected-class)))
-         (invalid-struct-type ,prot (struct-name ,expected-class) ,read-type))
-       (loop (multiple-value-bind (name id read-field-type)
-                                  (stream-read-field-begin ,prot)
-               (when (eq read-field-type 'stop) (return))
-               (case id
-                 ,@(loop for fd in field-definitions
-                         for id = (field-definition-identifier-number fd)
-                         for field-type = (field-definition-type fd)
-                         do (list fd id)
-                         collect `(,id
-                                   (setf ,(field-definition-name fd)
-                                         (cond ,@(when (eq field-type 'binary)
-                                                   `(((eq read-field-type 'string)
-                                                      (stream-read-binary ,prot))))
-                                               ((equal read-field-type ',(type-category field-type))
-                                                (stream-read-value-as ,prot ',field-type))
-                                               (t
-                                                ;; iff it returns
-                                                (invalid-field-type ,prot ,read-class ,id name ',field-type
-                                                                    (stream-read-value-as ,prot read-field-type)))))))
-                 (t
-                  ;; handle unknown fields
-                  (let* ((value (stream-read-value-as ,prot read-field-type))
-                         (fd (unknown-field ,read-class name id read-field-type value)))
-                    (if fd
-                      (setf (getf ,extra-field-plist (field-definition-initarg fd)) value)
-                      (unknown-field ,prot name id read-field-type value)))))
-               (stream-read-field-end ,prot))))))
+ EXTRA-FIELD-PLIST : a variable bound to a plist in which unknown fields are to be cached.
+
+ Each required field sets its bit in a mask of the fields seen, which is compared with the
+ complete mask once the struct ends."
+
+  (with-gensyms (expected-class read-class read-type seen)
+    (let* ((required (remove-if-not #'field-definition-required field-definitions))
+           (required-mask (1- (ash 1 (length required)))))
+      `(let* ((,expected-class ,class-form)
+              (,read-class (stream-read-struct-begin ,prot))
+              (,read-type (when ,read-class (struct-name ,read-class)))
+              ,@(when required `((,seen 0))))
+         ,@(when required `((declare (type (unsigned-byte ,(length required)) ,seen))))
+         (unless (or (null ,read-type) (equal ,read-type (struct-name ,expected-class)))
+           (invalid-struct-type ,prot (struct-name ,expected-class) ,read-type))
+         (loop (multiple-value-bind (name id read-field-type)
+                                    (stream-read-field-begin ,prot)
+                 (when (eq read-field-type 'stop) (return))
+                 (case id
+                   ,@(loop for fd in field-definitions
+                           for id = (field-definition-identifier-number fd)
+                           for field-type = (field-definition-type fd)
+                           for typedef = (field-definition-typedef fd)
+                           for read-form = `(cond ,@(when (eq field-type 'binary)
+                                                      `(((eq read-field-type 'string)
+                                                         ,(case (field-definition-representation fd)
+                                                            (:view `(stream-read-binary-view ,prot))
+                                                            (:stream `(stream-read-binary-spill ,prot))
+                                                            (t `(stream-read-binary ,prot))))))
+                                                  ((equal read-field-type ',(type-category field-type))
+                                                   (stream-read-value-as ,prot ',field-type))
+                                                  (t
+                                                   ;; iff it returns
+                                                   (invalid-field-type ,prot ,read-class ,id name ',field-type
+                                                                       (stream-read-value-as ,prot read-field-type))))
+                           for bit = (position fd required)
+                           collect `(,id
+                                     ,@(when bit `((setf ,seen (logior ,seen ,(ash 1 bit)))))
+                                     (setf ,(field-definition-name fd)
+                                           ,(if (and typedef (typedef-representation typedef))
+                                              `(typedef-value ',typedef ,read-form)
+                                              read-form))))
+                   (t
+                    ;; handle unknown fields
+                    (let* ((value (stream-read-value-as ,prot read-field-type))
+                           (fd (unknown-field ,read-class name id read-field-type value)))
+                      (if fd
+                        (setf (getf ,extra-field-plist (field-definition-initarg fd)) value)
+                        (unknown-field ,prot name id read-field-type value)))))
+                 (stream-read-field-end ,prot)))
+         ,@(when required
+             `((unless (= ,seen ,required-mask)
+                 (missing-required-field ,prot (struct-name ,expected-class)
+                                         (loop for identifier in ',(mapcar #'field-definition-identifier required)
+                                               for bit from 0
+                                               unless (logbitp bit ,seen)
+                                               return identifier)))))))))
 
 (defmacro decode-struct (prot class field-definitions extra-plist)
   (generate-struct-decoder prot class field-definitions extra-plist))
 
 
+;;; request and response operators are generic functions by default, for which the service and
+;;; argument types are available for specialization. With the :direct option, each is a plain
+;;; function with an ftype declamation, which argument checks replace the dispatch. With :generic
+;;; as well, a generic function with the given name delegates to the direct function %<name>.
+
+(defun direct-function-name (name)
+  (cons-symbol (symbol-package name) "%" name))
+
+(defun generate-operator-definition (name parameters types lambda-list generic-function-class initargs
+                                          documentation &key direct generic body)
+  "Return the definition for a request or response operator with the given PARAMETERS, their
+ lisp TYPES and the BODY forms."
+  (flet ((generic-definition (method-body)
+           `((ensure-generic-function ',name
+                                      :lambda-list ',lambda-list
+                                      :generic-function-class ',generic-function-class
+                                      ,@initargs)
+             #+ccl (ccl::record-arglist ',name ',lambda-list)
+             (defmethod ,name ,(mapcar #'list parameters types)
+               ,@(when documentation `(,documentation))
+               ,@method-body)))
+         (direct-definition (function-name)
+           `((declaim (ftype (function ,types t) ,function-name))
+             (defun ,function-name ,parameters
+               ,@(when documentation `(,documentation))
+               ,@(remove 'declare body :key #'first :test-not #'eq)
+               ,@(loop for parameter in parameters
+                       for type in types
+                       unless (eq type t)
+                       collect `(check-type ,parameter ,type))
+               ,@(remove 'declare body :key #'first)))))
+    (cond ((not direct)
+           `(progn ,@(generic-definition body)))
+          ((not generic)
+           `(progn ,@(direct-definition name)))
+          (t
+           (let ((direct-name (direct-function-name name)))
+             `(progn ,@(direct-definition direct-name)
+                     ,@(generic-definition `((,direct-name ,@parameters)))))))))
+
+
 (defmacro def-request-method (name (parameter-list return-type) &rest options)
   "Generate a request function definition.
  Augment the base function signature with an initial
@@ -345,54 +716,52 @@
          (success (str-sym "success")))
     
     (with-gensyms (gprot extra-initargs)
-      `(progn
-         (ensure-generic-function ',name
-                                  :lambda-list '(protocol ,@parameter-names)
-                                  :generic-function-class 'thrift-request-function
-                                  :identifier ,identifier)
-         #+ccl (ccl::record-arglist ',name '(protocol ,@parameter-names))
-         (defmethod ,name ((,gprot protocol) ,@(mapcar #'list parameter-names type-names))
-           ,@(when documentation `(,documentation))
-           (stream-write-message-begin ,gprot ,identifier 'call
-                                       (protocol-next-sequence-number ,gprot))
-           ;; use the respective args structure as a template to generate the message
-           (stream-write-struct ,gprot (thrift:list ,@(mapcar #'(lambda (id name) `(cons ,id ,name)) parameter-ids parameter-names))
-                                ',(str-sym call-struct))
-           (stream-write-message-end ,gprot)
-           ,(if oneway-p
-              nil
-              `(multiple-value-bind (request-message-identifier type sequence)
-                                    (stream-read-message-begin ,gprot)
-                 (unless (eql sequence (protocol-sequence-number ,gprot))
-                   (invalid-sequence-number ,gprot sequence (protocol-sequence-number ,gprot)))
-                 (unless (equal ,identifier request-message-identifier)
-                   (warn "response does not match request: ~s, ~s." ,identifier request-message-identifier))
-                 (ecase type
-                   (reply
-                    (let (,@(unless (eq return-type 'void) `((,success nil)))
-                          ,@(loop for name in exception-names collect `(,name nil))
-                          (,extra-initargs nil))
-                      ,(generate-struct-decoder gprot
-                                                `(find-thrift-class ',(str-sym reply-struct))
-                                                `(,@(unless (eq return-type 'void) `((,success nil :id 0 :type ,return-type)))
-                                                  ,@exceptions)
-                                                extra-initargs)
-                      (stream-read-message-end ,gprot)
-                      ,@(when exceptions
-                          `((cond
-                             ,@(mapcar #'(lambda (ex) `(,ex (response-exception ,gprot request-message-identifier sequence ,ex)))
-                                       exception-names))))
-                      ,(if (eq return-type 'void) nil success )))
-                   ((call oneway)
-                    ;; received a call/oneway when expecting a response
-                    (unexpected-request ,gprot request-message-identifier sequence
-                                        (prog1 (stream-read-struct ,gprot)
-                                          (stream-read-message-end ,gprot))))
-                   (exception
-                    ;; received an exception as a response
-                    (response-exception ,gprot request-message-identifier sequence
-                                        (prog1 (stream-read-struct ,gprot *response-exception-type*)
-                                          (stream-read-message-end ,gprot))))))))))))
+      (generate-operator-definition
+       name `(,gprot ,@parameter-names) `(protocol ,@type-names) `(protocol ,@parameter-names)
+       'thrift-request-function `(:identifier ,identifier) documentation
+       :direct (second (assoc :direct options))
+       :generic (second (assoc :generic options))
+       :body
+       `((stream-write-message-begin ,gprot ,identifier 'call
+                                    (protocol-next-sequence-number ,gprot))
+        ;; use the respective args structure as a template to generate the message
+        (stream-write-struct ,gprot (thrift:list ,@(mapcar #'(lambda (id name) `(cons ,id ,name)) parameter-ids parameter-names))
+                             ',(str-sym call-struct))
+        (stream-write-message-end ,gprot)
+        ,(if oneway-p
+           nil
+           `(multiple-value-bind (request-message-identifier type sequence)
+                                 (stream-read-message-begin ,gprot)
+              (unless (eql sequence (protocol-sequence-number ,gprot))
+                (invalid-sequence-number ,gprot sequence (protocol-sequence-number ,gprot)))
+              (unless (equal ,identifier request-message-identifier)
+                (warn "response does not match request: ~s, ~s." ,identifier request-message-identifier))
+              (ecase type
+                (reply
+                 (let (,@(unless (eq return-type 'void) `((,success nil)))
+                       ,@(loop for name in exception-names collect `(,name nil))
+                       (,extra-initargs nil))
+                   ,(generate-struct-decoder gprot
+                                             `(find-thrift-class ',(str-sym reply-struct))
+                                             `(,@(unless (eq return-type 'void) `((,success nil :id 0 :type ,return-type)))
+                                               ,@exceptions)
+                                             extra-initargs)
+                   (stream-read-message-end ,gprot)
+                   ,@(when exceptions
+                       `((cond
+                          ,@(mapcar #'(lambda (ex) `(,ex (response-exception ,gprot request-message-identifier sequence ,ex)))
+                                    exception-names))))
+                   ,(if (eq return-type 'void) nil success )))
+                ((call oneway)
+                 ;; received a call/oneway when expecting a response
+                 (unexpected-request ,gprot request-message-identifier sequence
+                                     (prog1 (stream-read-struct ,gprot)
+                                       (stream-read-message-end ,gprot))))
+                (exception
+                 ;; received an exception as a response
+                 (response-exception ,gprot request-message-identifier sequence
+                                     (prog1 (stream-read-struct ,gprot *response-exception-type*)
+                                       (stream-read-message-end ,gprot))))))))))))
     
 
 
@@ -418,53 +787,60 @@
                                 (apply #',implementation ,@parameter-names ,extra-args)
                                 (,implementation ,@parameter-names))))
       (if (fboundp implementation)
-        `(progn (ensure-generic-function ',name
-                                         :lambda-list '(service sequence-number protocol)
-                                         :generic-function-class 'thrift-response-function
-                                         :identifier ,identifier
-                                         :implementation-function
-                                         ,(etypecase implementation
-                                            ;; defer the evaluation
-                                            (symbol `(quote ,implementation))
-                                            ((cons (eql lambda)) `(function ,implementation))))
-                #+ccl (ccl::record-arglist ',name '(service sequence-number protocol))
-                (defmethod ,name ((,service t) (,seq t) (,gprot protocol))
-                  ,@(when documentation `(,documentation))
-                  (let (,@(mapcar #'list parameter-names defaults)
-                        (,extra-args nil))
-                    ,(generate-struct-decoder gprot `(find-thrift-class ',(str-sym call-struct))
-                                              (mapcar #'parm-to-field-decl parameter-list) extra-args)
-                    ,(let ((expression
-                            (cond (oneway-p
-                                   application-form)
-                                  ((eq return-type 'void)
-                                   `(prog1
-                                      ,application-form
-                                      (stream-write-message-begin ,gprot ,identifier 'reply ,seq)
-                                      (stream-write-struct ,gprot (thrift:list) ',(str-sym reply-struct))
-                                      (stream-write-message-end ,gprot)))
-                                  (t
-                                   `(let ((result ,application-form))
-                                      (stream-write-message-begin ,gprot ,identifier 'reply ,seq)
-                                      (stream-write-struct ,gprot (thrift:list (cons 0 result)) ',(str-sym reply-struct))
-                                      (stream-write-message-end ,gprot)
-                                      result)))))
-                       (if exceptions
-                         `(handler-case ,expression
-                            ,@(loop for exception-spec in exceptions
-                                    collect (destructuring-bind (field-name default &key type id)
-                                                                exception-spec
-                                              (declare (ignore field-name default))
-                                              (let ((external-exception-type (second type)))
-                                                `(,(str-sym external-exception-type) (condition)
-                                                  ;; sent as a reply in order to effect operation-specific exception
-                                                  ;; processing.
-                                                  (stream-write-message-begin ,gprot ,identifier 'reply ,seq)
-                                                  (stream-write-struct ,gprot (thrift:list (cons ,id condition))
-                                                                       ',(str-sym reply-struct))
-                                                  (stream-write-message-end ,gprot)
-                                                  condition)))))
-                         expression)))))
+        (generate-operator-definition
+         name `(,service ,seq ,gprot) '(t t protocol) '(service sequence-number protocol)
+         'thrift-response-function
+         `(:identifier ,identifier
+           :implementation-function ,(etypecase implementation
+                                       ;; defer the evaluation
+                                       (symbol `(quote ,implementation))
+                                       ((cons (eql lambda)) `(function ,implementation))))
+         documentation
+         :direct (second (assoc :direct options))
+         :generic (second (assoc :generic options))
+         :body
+         `((declare (ignorable ,service ,seq))
+           (let (,@(mapcar #'list parameter-names defaults)
+                 (,extra-args nil))
+             ,(generate-struct-decoder gprot `(find-thrift-class ',(str-sym call-struct))
+                                       (mapcar #'parm-to-field-decl parameter-list) extra-args)
+             ;; the arguments are decoded, so the request's input buffers can return to the pool
+             (stream-read-message-end ,gprot)
+             (note-request-decoded)
+             ,(let ((expression
+                     (cond (oneway-p
+                            `(prog1 ,application-form (note-request-handled)))
+                           ((eq return-type 'void)
+                            `(prog1
+                               ,application-form
+                               (note-request-handled)
+                               (stream-write-message-begin ,gprot ,identifier 'reply ,seq)
+                               (stream-write-struct ,gprot (thrift:list) ',(str-sym reply-struct))
+                               (stream-write-message-end ,gprot)))
+                           (t
+                            `(let ((result ,application-form))
+                               (note-request-handled)
+                               (stream-write-message-begin ,gprot ,identifier 'reply ,seq)
+                               (stream-write-struct ,gprot (thrift:list (cons 0 result)) ',(str-sym reply-struct))
+                               (stream-write-message-end ,gprot)
+                               result)))))
+                (if exceptions
+                  `(handler-case ,expression
+                     ,@(loop for exception-spec in exceptions
+                             collect (destructuring-bind (field-name default &key type id)
+                                                         exception-spec
+                                       (declare (ignore field-name default))
+                                       (let ((external-exception-type (second type)))
+                                         `(,(str-sym external-exception-type) (condition)
+                                           (note-request-exception condition)
+                                           ;; sent as a reply in order to effect operation-specific exception
+                                           ;; processing.
+                                           (stream-write-message-begin ,gprot ,identifier 'reply ,seq)
+                                           (stream-write-struct ,gprot (thrift:list (cons ,id condition))
+                                                                ',(str-sym reply-struct))
+                                           (stream-write-message-end ,gprot)
+                                           condition)))))
+                  expression)))))
         ;; if no implementation is present, warn and emit no interface
         (progn (when *compile-verbose* (warn "No response implementation present: ~s." implementation))
                (values))))))
@@ -474,7 +850,8 @@
   "Given the external name for the service, an optional inheritance list, slot definitions
  and a list of method declarations, construct a class definition which include the precedence and the
  slots, and provides method bindings for the response methods as an initialization argument. For each method,
- generate a request/reponse method pair.
+ generate a request/reponse method pair. Given (:direct-calls t), these are plain functions rather
+ than generic functions, and given (:generic-functions t) as well, generic functions delegate to them.
 
  NB. THis must operate as a top-level form in order that the argument structure definitions be
  available to compile the request/response functions."
@@ -484,10 +861,12 @@
          (class (if class-identifier (str-sym class-identifier) 'service))
          (methods (remove :method options :test-not #'eq :key #'first))
          (documentation (second (assoc :documentation options)))
+         (direct-options `(,@(when (second (assoc :direct-calls options)) '((:direct t)))
+                           ,@(when (second (assoc :generic-functions options)) '((:generic t)))))
          (identifiers (mapcar #'second methods))
          (response-names (mapcar #'response-str-sym identifiers))
          (initargs (loop for (key . rest) in options
-                         unless (member key '(:service-class :method :documentation))
+                         unless (member key '(:service-class :method :documentation :direct-calls :generic-functions))
                          collect key
                          and collect (list 'quote rest)))
          (method-interfaces (loop for (nil identifier (parameter-list return-type)) in methods
@@ -519,14 +898,16 @@
                                   (:call-struct ,call-struct-identifier)
                                   (:reply-struct ,reply-struct-identifier)
                                   ,@(when exceptions `((:exceptions ,@exceptions)))
-                                  ,@(when oneway `((:oneway t))))
+                                  ,@(when oneway `((:oneway t)))
+                                  ,@direct-options)
                                 (def-response-method ,response-function-name (,parameter-list ,return-type)
                                   (:identifier ,identifier)
                                   (:call-struct ,call-struct-identifier)
                                   (:reply-struct ,reply-struct-identifier)
                                   (:implementation-function ,implementation-function-name)
                                   ,@(when exceptions `((:exceptions ,@exceptions)))
-                                  ,@(when oneway `((:oneway t))))))))
+                                  ,@(when oneway `((:oneway t)))
+                                  ,@direct-options)))))
                       methods)
 
             ;; export the service name only
@@ -0,0 +1,234 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: org.apache.thrift.implementation; -*-
+
+(in-package :org.apache.thrift.implementation)
+
+;;; This file implements a framed transport for the `org.apache.thrift` library.
+;;;
+;;; Licensed to the Apache Software Foundation (ASF) under one
+;;; or more contributor license agreements. See the NOTICE file
+;;; distributed with this work for additional information
+;;; regarding copyright ownership. The ASF licenses this file
+;;; to you under the Apache License, Version 2.0 (the
+;;; "License"); you may not use this file except in compliance
+;;; with the License. You may obtain a copy of the License at
+;;;
+;;;   http://www.apache.org/licenses/LICENSE-2.0
+;;;
+;;; Unless required by applicable law or agreed to in writing,
+;;; software distributed under the License is distributed on an
+;;; "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+;;; KIND, either express or implied. See the License for the
+;;; specific language governing permissions and limitations
+;;; under the License.
+
+
+;;; A framed transport wraps a base transport and prefixes each message with its length as a
+;;; big-endian i32, as does the TFramedTransport of the other language bindings. It reads a frame
+;;; at once into a pooled octet buffer and serves reads from it. It collects writes in a pooled
+;;; buffer and writes the frame when the output is forced, that is, at the end of each message.
+;;; The write buffer is released once it is written, and the read buffer at the end of the message
+;;; which consumed it, so that an idle connection holds no buffers. A read buffer from which a
+;;; decoder has taken a binary view is not returned to the pool or reused for the next frame, but
+;;; left to the garbage collector, so that the view remains valid for as long as the decoded value
+;;; refers to it.
+;;;
+;;;   (client (framed-transport (socket-transport #u"thrift://localhost:9090")))
+;;;
+;;; A server reads framed connections if its class includes framed-server, eg.
+;;;
+;;;   (defclass framed-socket-server (framed-server threaded-socket-server) ())
+
+
+(defparameter *framed-transport-maximum-frame-size* (* 16 1024 1024)
+  "The largest frame which a framed transport accepts. A longer frame signals a frame-size-error.")
+
+
+(defclass framed-transport (binary-transport)
+  ((base
+    :initarg :transport
+    :initform (error "transport is required.")
+    :reader framed-transport-base)
+   (read-buffer :initform nil :type (or null octet-buffer))
+   (read-buffer-viewed
+    :initform nil
+    :documentation "True if a binary view refers to the read buffer, which then must not be reused.")
+   (read-position :initform 0 :type fixnum)
+   (read-end :initform 0 :type fixnum)
+   (write-buffer :initform nil :type (or null octet-buffer))
+   (write-position :initform 0 :type fixnum))
+  (:documentation "A transport which wraps a base transport and exchanges length-prefixed frames."))
+
+
+(defun framed-transport (transport &rest initargs)
+  "Return a framed transport which wraps the base TRANSPORT."
+  (apply #'make-instance 'framed-transport
+         :transport transport
+         :direction (stream-direction transport)
+         initargs))
+
+
+(defmethod open-stream-p ((transport framed-transport))
+  (and (not (eq (stream-direction transport) :closed))
+       (open-stream-p (framed-transport-base transport))))
+
+(defun framed-transport-drop-read-buffer (transport)
+  "Release the read buffer to the pool, or, if a view refers to it, abandon it."
+  (with-slots (read-buffer read-buffer-viewed) transport
+    (when read-buffer
+      (let ((buffer (shiftf read-buffer nil)))
+        (if read-buffer-viewed
+          (setf read-buffer-viewed nil)
+          (release-octet-buffer buffer))))))
+
+(defun framed-transport-close (transport abort)
+  (with-slots (base write-buffer) transport
+    (framed-transport-drop-read-buffer transport)
+    (when write-buffer
+      (release-octet-buffer (shiftf write-buffer nil)))
+    (setf (stream-direction transport) :closed)
+    (close base :abort abort)))
+
+(when (fboundp 'stream-close)
+  (defmethod stream-close ((transport framed-transport))
+    (framed-transport-close transport nil)))
+
+(when (typep #'close 'generic-function)
+  (defmethod close ((transport framed-transport) &key abort)
+    (framed-transport-close transport abort)
+    t))
+
+
+;;;
+;;; input
+
+(defun framed-transport-read-frame (transport)
+  "Read the next frame from the base transport into the read buffer, which is reused if it is
+ large enough. Signal end-of-file at the base transport's end."
+  (with-slots (base read-buffer read-position read-end) transport
+    (let ((size (let ((header (make-array 4 :element-type '(unsigned-byte 8))))
+                  (declare (dynamic-extent header))
+                  (stream-read-sequence base header 0 4)
+                  (logior (ash (aref header 0) 24) (ash (aref header 1) 16)
+                          (ash (aref header 2) 8) (aref header 3)))))
+      (when (> size *framed-transport-maximum-frame-size*)
+        (error 'frame-size-error :transport transport :size size))
+      (when (and read-buffer
+                 (or (slot-value transport 'read-buffer-viewed) (< (length read-buffer) size)))
+        (framed-transport-drop-read-buffer transport))
+      (unless read-buffer
+        (setf read-buffer (acquire-octet-buffer size)))
+      (stream-read-sequence base read-buffer 0 size)
+      (setf read-position 0
+            read-end size))))
+
+(defmethod stream-read-byte ((transport framed-transport))
+  (with-slots (read-buffer read-position read-end) transport
+    (loop while (>= read-position read-end)
+          do (framed-transport-read-frame transport))
+    (incf (the fixnum (transport-bytes-read transport)))
+    (prog1 (signed-byte-8 (aref read-buffer read-position))
+      (incf read-position))))
+
+(defmethod stream-read-sequence ((transport framed-transport) (sequence vector)
+                                 #+mcl &key #-mcl &optional (start 0) (end nil))
+  ;; a message may span frames, although the other bindings write one frame per message
+  (let ((end (or end (length sequence))))
+    (with-slots (read-buffer read-position read-end) transport
+      (loop while (< start end)
+            do (when (>= read-position read-end)
+                 (framed-transport-read-frame transport))
+            do (let ((count (min (- end start) (- read-end read-position))))
+                 (replace sequence read-buffer :start1 start :start2 read-position
+                          :end2 (+ read-position count))
+                 (incf (the fixnum (transport-bytes-read transport)) count)
+                 (incf start count)
+                 (incf read-position count))))
+    end))
+
+
+(defmethod transport-octet-view ((transport framed-transport) length)
+  ;; a view extends only over the current frame
+  (with-slots (read-buffer read-buffer-viewed read-position read-end) transport
+    (when (and read-buffer (<= (+ read-position length) read-end))
+      (setf read-buffer-viewed t)
+      (incf (the fixnum (transport-bytes-read transport)) length)
+      (values read-buffer (shiftf read-position (+ read-position length))))))
+
+
+;;;
+;;; output
+
+(defun framed-transport-reserve (transport count)
+  "Ensure that the write buffer has room for COUNT more bytes and return it."
+  (with-slots (write-buffer write-position) transport
+    (let ((required (+ write-position count)))
+      (cond ((null write-buffer)
+             (setf write-buffer (acquire-octet-buffer (max required 1024))))
+            ((> required (length write-buffer))
+             (let ((new (acquire-octet-buffer (max required (* 2 (length write-buffer))))))
+               (replace new write-buffer :end2 write-position)
+               (release-octet-buffer write-buffer)
+               (setf write-buffer new))))
+      write-buffer)))
+
+(defmethod stream-write-byte ((transport framed-transport) byte)
+  (with-slots (write-position) transport
+    (setf (aref (framed-transport-reserve transport 1) write-position) (unsigned-byte-8 byte))
+    (incf write-position)
+    (incf (the fixnum (transport-bytes-written transport)))
+    byte))
+
+(defmethod stream-write-sequence ((transport framed-transport) (sequence vector)
+                                  #+mcl &key #-mcl &optional (start 0) (end nil))
+  (let ((end (or end (length sequence))))
+    (with-slots (write-position) transport
+      (replace (framed-transport-reserve transport (- end start)) sequence
+               :start1 write-position :start2 start :end2 end)
+      (incf write-position (- end start)))
+    (incf (the fixnum (transport-bytes-written transport)) (- end start)))
+  sequence)
+
+(defun framed-transport-write-frame (transport)
+  "Write the pending bytes to the base transport as a frame, and release the write buffer."
+  (with-slots (base write-buffer write-position) transport
+    (when write-buffer
+      (let ((header (make-array 4 :element-type '(unsigned-byte 8))))
+        (declare (dynamic-extent header))
+        (setf (aref header 0) (ldb (byte 8 24) write-position)
+              (aref header 1) (ldb (byte 8 16) write-position)
+              (aref header 2) (ldb (byte 8 8) write-position)
+              (aref header 3) (ldb (byte 8 0) write-position))
+        (stream-write-sequence base header 0 4))
+      (stream-write-sequence base write-buffer 0 write-position)
+      (release-octet-buffer (shiftf write-buffer nil))
+      (setf write-position 0))))
+
+(defmethod stream-force-output ((transport framed-transport))
+  (framed-transport-write-frame transport)
+  (stream-force-output (framed-transport-base transport)))
+
+(defmethod stream-finish-output ((transport framed-transport))
+  (framed-transport-write-frame transport)
+  (stream-finish-output (framed-transport-base transport)))
+
+
+(defmethod transport-release-buffers ((transport framed-transport))
+  (with-slots (read-buffer read-position read-end) transport
+    (when (and read-buffer (>= read-position read-end))
+      (framed-transport-drop-read-buffer transport)
+      (setf read-position 0
+            read-end 0))))
+
+
+;;;
+;;; server
+
+(defclass framed-server ()
+  ()
+  (:documentation "A server mixin which wraps each connection's transports as framed transports."))
+
+(defmethod server-input-transport :around ((server framed-server) connection)
+  (framed-transport (call-next-method)))
+
+(defmethod server-output-transport :around ((server framed-server) connection)
+  (framed-transport (call-next-method)))
@@ -0,0 +1,400 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: org.apache.thrift.implementation; -*-
+
+(in-package :org.apache.thrift.implementation)
+
+;;; This file implements per-method server instrumentation for the `org.apache.thrift` library.
+;;;
+;;; Licensed to the Apache Software Foundation (ASF) under one
+;;; or more contributor license agreements. See the NOTICE file
+;;; distributed with this work for additional information
+;;; regarding copyright ownership. The ASF licenses this file
+;;; to you under the Apache License, Version 2.0 (the
+;;; "License"); you may not use this file except in compliance
+;;; with the License. You may obtain a copy of the License at
+;;;
+;;;   http://www.apache.org/licenses/LICENSE-2.0
+;;;
+;;; Unless required by applicable law or agreed to in writing,
+;;; software distributed under the License is distributed on an
+;;; "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+;;; KIND, either express or implied. See the License for the
+;;; specific language governing permissions and limitations
+;;; under the License.
+
+
+;;; When *instrument-server* is true, process records for each request, in the statistics of the
+;;; service which defines the method:
+;;;
+;;;  * the request count, and the count of undeclared errors and of declared exceptions
+;;;  * the request and response sizes, as read from and written to the transports
+;;;  * the latency of the decode, handler and encode phases, and of the whole request, in
+;;;    microseconds, as log-linear histograms
+;;;  * the count of each condition type which a request signaled
+;;;
+;;; The response methods mark the end of argument decoding and the return from the implementation
+;;; function. Uninstrumented, each mark costs the test of a special variable.
+;;; The counters are structure slots and array elements of word type, in order that the threads
+;;; of a threaded server can increment them without a lock. Each service's statistics are allocated
+;;; for all of its methods at once with the first instrumented request.
+;;;
+;;;   (setf *instrument-server* t)
+;;;   (service-statistics service)
+;;;   (write-service-statistics service *trace-output*)
+
+
+(deftype statistics-counter ()
+  #+sbcl 'sb-ext:word
+  #-sbcl '(integer 0 *))
+
+(defvar *statistics-lock* (bt:make-lock "thrift statistics")
+  "Serializes changes to the statistics tables and exception counts, and, absent atomic
+ operations, all counter increments.")
+
+(defmacro counter-incf (place &optional (delta 1))
+  #+sbcl `(sb-ext:atomic-incf ,place ,delta)
+  #-sbcl `(bt:with-lock-held (*statistics-lock*) (incf ,place ,delta)))
+
+(defun internal-time-microseconds (units)
+  (if (= internal-time-units-per-second 1000000)
+    units
+    (round (* units 1000000) internal-time-units-per-second)))
+
+
+;;;
+;;; histograms
+;;; values below 32 have a bucket each. Above that, each power of two is divided into 16 buckets,
+;;; which bounds the error of a recorded value at 1/16.
+
+(defconstant +histogram-size+ (* 16 42))
+
+(defun make-histogram ()
+  (make-array +histogram-size+ :element-type 'statistics-counter :initial-element 0))
+
+(declaim (inline histogram-index))
+(defun histogram-index (value)
+  (declare (type (integer 0) value))
+  (if (< value 32)
+    value
+    (let ((shift (- (integer-length value) 5)))
+      (min (1- +histogram-size+) (+ (* shift 16) (ash value (- shift)))))))
+
+(defun histogram-bucket-value (index)
+  "Return the least value which the bucket INDEX records."
+  (if (< index 32)
+    index
+    (let ((shift (1- (floor index 16))))
+      (ash (- index (* shift 16)) shift))))
+
+(defun histogram-record (histogram value)
+  (declare (type (simple-array statistics-counter (*)) histogram))
+  (counter-incf (aref histogram (histogram-index (max value 0)))))
+
+(defun histogram-summary (histogram)
+  "Return a property list with the count, the mean, the 50th, 99th and 99.9th percentiles and the
+ maximum of the values recorded in HISTOGRAM. Each is the upper bound of its bucket."
+  (let* ((counts (copy-seq histogram))
+         (total (reduce #'+ counts)))
+    (flet ((upper-bound (index)
+             (1- (histogram-bucket-value (1+ index)))))
+      (if (zerop total)
+        (list :count 0 :mean 0 :p50 0 :p99 0 :p999 0 :max 0)
+        (flet ((percentile (fraction)
+                 (let ((threshold (ceiling (* fraction total)))
+                       (sum 0))
+                   (dotimes (index +histogram-size+ (upper-bound (1- +histogram-size+)))
+                     (incf sum (aref counts index))
+                     (when (>= sum threshold) (return (upper-bound index)))))))
+          (list :count total
+                :mean (/ (loop for index below +histogram-size+
+                               sum (* (aref counts index)
+                                      (/ (+ (histogram-bucket-value index) (upper-bound index)) 2)))
+                         total 1.0d0)
+                :p50 (percentile 0.5)
+                :p99 (percentile 0.99)
+                :p999 (percentile 0.999)
+                :max (upper-bound (position-if #'plusp counts :from-end t))))))))
+
+
+;;;
+;;; method statistics
+;;; a structure, rather than a class, in order that the counters are word slots for atomic-incf
+
+(defstruct (method-statistics (:constructor make-method-statistics (identifier)))
+  (identifier nil :read-only t)
+  (requests 0 :type statistics-counter)
+  (errors 0 :type statistics-counter)
+  (exceptions 0 :type statistics-counter)
+  (request-bytes 0 :type statistics-counter)
+  (response-bytes 0 :type statistics-counter)
+  (decode (make-histogram) :read-only t)
+  (handler (make-histogram) :read-only t)
+  (encode (make-histogram) :read-only t)
+  (total (make-histogram) :read-only t)
+  (condition-counts () :type list))
+
+
+(defun service-method-statistics (service identifier)
+  "Return the statistics for the SERVICE's method IDENTIFIER. The first call allocates the
+ statistics for all of the service's methods."
+  (let ((table (service-statistics-table service)))
+    (or (and table (gethash identifier table))
+        (bt:with-lock-held (*statistics-lock*)
+          (let* ((table (service-statistics-table service))
+                 (new-table (make-hash-table :test 'equal)))
+            (or (and table (gethash identifier table))
+                (flet ((add (identifier)
+                         (setf (gethash identifier new-table) (make-method-statistics identifier))))
+                  (if table
+                    (maphash #'(lambda (key value) (setf (gethash key new-table) value)) table)
+                    (loop for key being each hash-key of (service-methods service) do (add key)))
+                  (prog1 (or (gethash identifier new-table) (add identifier))
+                    (setf (service-statistics-table service) new-table)))))))))
+
+
+(defun record-condition (statistics condition)
+  (let ((type (type-of condition)))
+    (bt:with-lock-held (*statistics-lock*)
+      (let ((entry (assoc type (method-statistics-condition-counts statistics))))
+        (if entry
+          (incf (cdr entry))
+          (push (cons type 1) (method-statistics-condition-counts statistics)))))))
+
+
+;;;
+;;; request marks
+;;; while an instrumented request is in progress, *request-marks* is a vector of the time at
+;;; which the arguments were decoded, the time at which the implementation returned, and the
+;;; method statistics.
+
+(defvar *request-marks* nil)
+
+(declaim (inline note-request-decoded note-request-handled))
+
+(defun note-request-decoded ()
+  (let ((marks *request-marks*))
+    (when marks (setf (svref marks 0) (get-internal-real-time)))))
+
+(defun note-request-handled ()
+  (let ((marks *request-marks*))
+    (when marks (setf (svref marks 1) (get-internal-real-time)))))
+
+(defun note-request-exception (condition)
+  "Record a declared exception, which the response method returns as a reply."
+  (let ((marks *request-marks*))
+    (when marks
+      (setf (svref marks 1) (get-internal-real-time))
+      (let ((statistics (svref marks 2)))
+        (counter-incf (method-statistics-exceptions statistics))
+        (record-condition statistics condition)))))
+
+
+(defun call-instrumented (function service identifier sequence-number protocol bytes-read)
+  "Call the response FUNCTION and record the request in the SERVICE's statistics for the method
+ IDENTIFIER. BYTES-READ is the input transport's count before the message began."
+  (let* ((statistics (service-method-statistics service identifier))
+         (input-transport (protocol-input-transport protocol))
+         (output-transport (protocol-output-transport protocol))
+         (bytes-written (transport-bytes-written output-transport))
+         (start (get-internal-real-time))
+         (marks (vector 0 0 statistics)))
+    (declare (dynamic-extent marks))
+    (counter-incf (method-statistics-requests statistics))
+    (multiple-value-prog1
+      (handler-bind ((error (lambda (condition)
+                              ;; a declared exception is handled within the response method
+                              (counter-incf (method-statistics-errors statistics))
+                              (record-condition statistics condition))))
+        (let ((*request-marks* marks))
+          (funcall function service sequence-number protocol)))
+      (let* ((end (get-internal-real-time))
+             (decoded (if (eql (svref marks 0) 0) start (svref marks 0)))
+             (handled (if (eql (svref marks 1) 0) end (svref marks 1))))
+        (counter-incf (method-statistics-request-bytes statistics)
+                      (max 0 (- (transport-bytes-read input-transport) bytes-read)))
+        (counter-incf (method-statistics-response-bytes statistics)
+                      (max 0 (- (transport-bytes-written output-transport) bytes-written)))
+        (histogram-record (method-statistics-decode statistics) (internal-time-microseconds (- decoded start)))
+        (histogram-record (method-statistics-handler statistics) (internal-time-microseconds (- handled decoded)))
+        (histogram-record (method-statistics-encode statistics) (internal-time-microseconds (- end handled)))
+        (histogram-record (method-statistics-total statistics) (internal-time-microseconds (- end start)))))))
+
+
+;;;
+;;; snapshot and export
+
+(defun method-statistics-snapshot (statistics &optional service)
+  (list :service (when service (service-identifier service))
+        :method (method-statistics-identifier statistics)
+        :requests (method-statistics-requests statistics)
+        :errors (method-statistics-errors statistics)
+        :exceptions (method-statistics-exceptions statistics)
+        :request-bytes (method-statistics-request-bytes statistics)
+        :response-bytes (method-statistics-response-bytes statistics)
+        :decode (histogram-summary (method-statistics-decode statistics))
+        :handler (histogram-summary (method-statistics-handler statistics))
+        :encode (histogram-summary (method-statistics-encode statistics))
+        :total (histogram-summary (method-statistics-total statistics))
+        :conditions (bt:with-lock-held (*statistics-lock*)
+                      (copy-alist (method-statistics-condition-counts statistics)))))
+
+(defgeneric service-statistics (service)
+  (:documentation "Return a property list for each of the SERVICE's methods with its request,
+ error and exception counts, its request and response byte counts, the summaries of its decode,
+ handler, encode and total latency in microseconds, and the counts of conditions by type.")
+
+  (:method ((service service))
+    (let ((table (service-statistics-table service)))
+      (when table
+        (sort (loop for statistics being each hash-value of table
+                    collect (method-statistics-snapshot statistics service))
+              #'string< :key #'(lambda (snapshot) (getf snapshot :method)))))))
+
+(defgeneric reset-service-statistics (service)
+  (:method ((service service))
+    (setf (service-statistics-table service) nil)))
+
+(defun write-service-statistics (service &optional (stream *standard-output*))
+  "Write the SERVICE's statistics to STREAM, one property list per line."
+  (with-standard-io-syntax
+    (let ((*print-readably* nil))
+      (dolist (snapshot (service-statistics service))
+        (format stream "~s~%" snapshot))))
+  service)
+
+
+;;;
+;;; transport statistics
+;;; when *count-transport-statistics* is true, each new transport counts its sequence reads and its
+;;; flushes, the bytes transferred, and the microseconds spent in each kind of call, both in its own
+;;; transport-statistics and in the *transport-statistics-aggregate*. Counting can also be enabled
+;;; for one connection, before it is used, with
+;;;
+;;;   (setf (transport-statistics transport) (make-transport-statistics))
+;;;
+;;; Only the buffer-fill and flush boundaries are timed. Byte operations and sequence writes are
+;;; neither counted as calls nor timed, as that would cost a method and a clock read per byte;
+;;; they just maintain the transport's own byte counts, which are added to the statistics at the
+;;; next boundary. The counts are named for what they count:
+;;;
+;;;   fills          : sequence reads, which refill a buffer or read a value in bulk
+;;;   output-flushes : flushes which carried output, so that the bytes per output flush
+;;;                    distinguish small writes
+;;;   flushes        : all flushes, which show excess flushing
+;;;
+;;; and the fill and flush times show the time blocked on the peer or the network.
+
+(defparameter *count-transport-statistics* nil
+  "When true, transports count their operations as they are created.")
+
+(defstruct (transport-statistics (:constructor make-transport-statistics ()))
+  (fills 0 :type statistics-counter)
+  (output-flushes 0 :type statistics-counter)
+  (flushes 0 :type statistics-counter)
+  (bytes-read 0 :type statistics-counter)
+  (bytes-written 0 :type statistics-counter)
+  (fill-time 0 :type statistics-counter)
+  (flush-time 0 :type statistics-counter)
+  ;; the transport's byte counts as of the last boundary
+  (read-mark 0 :type fixnum)
+  (write-mark 0 :type fixnum))
+
+(defvar *transport-statistics-aggregate* (make-transport-statistics)
+  "The sum of the statistics of all counted transports.")
+
+
+(defmethod initialize-instance :after ((transport transport) &key)
+  (when (and *count-transport-statistics* (null (transport-statistics transport)))
+    (setf (transport-statistics transport) (make-transport-statistics))))
+
+
+(defun record-transport-bytes (statistics transport)
+  "Add the bytes which the TRANSPORT has transferred since the last boundary to its STATISTICS
+ and to the aggregate. Return the count written."
+  (declare (type transport-statistics statistics))
+  (let* ((read (transport-bytes-read transport))
+         (written (transport-bytes-written transport))
+         (bytes-read (- read (shiftf (transport-statistics-read-mark statistics) read)))
+         (bytes-written (- written (shiftf (transport-statistics-write-mark statistics) written))))
+    (declare (type fixnum read written bytes-read bytes-written))
+    (when (plusp bytes-read)
+      (counter-incf (transport-statistics-bytes-read statistics) bytes-read)
+      (counter-incf (transport-statistics-bytes-read *transport-statistics-aggregate*) bytes-read))
+    (when (plusp bytes-written)
+      (counter-incf (transport-statistics-bytes-written statistics) bytes-written)
+      (counter-incf (transport-statistics-bytes-written *transport-statistics-aggregate*) bytes-written))
+    bytes-written))
+
+(defun record-transport-operation (statistics operation bytes-written microseconds)
+  (declare (type transport-statistics statistics))
+  (ecase operation
+    (:fill (counter-incf (transport-statistics-fills statistics))
+           (counter-incf (transport-statistics-fill-time statistics) microseconds))
+    (:flush (counter-incf (transport-statistics-flushes statistics))
+            (counter-incf (transport-statistics-flush-time statistics) microseconds)
+            (when (plusp bytes-written)
+              (counter-incf (transport-statistics-output-flushes statistics))))))
+
+(defmacro with-transport-operation ((transport operation) &body body)
+  "Execute BODY and, if the TRANSPORT counts statistics, record the OPERATION, the bytes
+ transferred since the last boundary, and the elapsed time in its and the aggregate statistics."
+  (with-gensyms (statistics start elapsed written)
+    `(let ((,statistics (transport-statistics ,transport)))
+       (if (null ,statistics)
+         (progn ,@body)
+         (let ((,start (get-internal-real-time)))
+           (multiple-value-prog1 (progn ,@body)
+             (let ((,elapsed (internal-time-microseconds (- (get-internal-real-time) ,start)))
+                   (,written (record-transport-bytes ,statistics ,transport)))
+               (record-transport-operation ,statistics ,operation ,written ,elapsed)
+               (record-transport-operation *transport-statistics-aggregate* ,operation ,written ,elapsed))))))))
+
+
+(defmethod stream-read-sequence :around ((transport binary-transport) (sequence vector)
+                                         #+mcl &key #-mcl &optional start end)
+  (declare (ignore start end))
+  (with-transport-operation (transport :fill) (call-next-method)))
+
+(defmethod stream-force-output :around ((transport transport))
+  (with-transport-operation (transport :flush) (call-next-method)))
+
+(defmethod stream-finish-output :around ((transport transport))
+  (with-transport-operation (transport :flush) (call-next-method)))
+
+
+(defgeneric transport-statistics-snapshot (statistics)
+  (:documentation "Return the counts of the transport STATISTICS, or those of a transport, as a
+ property list with the mean bytes per fill and per flush which carried output. Times are in microseconds.")
+
+  (:method ((transport transport))
+    (let ((statistics (transport-statistics transport)))
+      (when statistics
+        (record-transport-bytes statistics transport)
+        (transport-statistics-snapshot statistics))))
+
+  (:method ((statistics null))
+    (transport-statistics-snapshot *transport-statistics-aggregate*))
+
+  (:method ((statistics transport-statistics))
+    (let ((fills (transport-statistics-fills statistics))
+          (output-flushes (transport-statistics-output-flushes statistics)))
+      (list :fills fills
+            :output-flushes output-flushes
+            :flushes (transport-statistics-flushes statistics)
+            :bytes-read (transport-statistics-bytes-read statistics)
+            :bytes-written (transport-statistics-bytes-written statistics)
+            :bytes/fill (if (plusp fills) (/ (transport-statistics-bytes-read statistics) fills 1.0d0) 0)
+            :bytes/output-flush (if (plusp output-flushes)
+                                  (/ (transport-statistics-bytes-written statistics) output-flushes 1.0d0)
+                                  0)
+            :fill-time (transport-statistics-fill-time statistics)
+            :flush-time (transport-statistics-flush-time statistics)))))
+
+(defun reset-transport-statistics (&optional transport)
+  "Reset the TRANSPORT's statistics, or the aggregate."
+  (if transport
+    (when (transport-statistics transport)
+      (let ((statistics (make-transport-statistics)))
+        (setf (transport-statistics-read-mark statistics) (transport-bytes-read transport)
+              (transport-statistics-write-mark statistics) (transport-bytes-written transport)
+              (transport-statistics transport) statistics)))
+    (setf *transport-statistics-aggregate* (make-transport-statistics))))
@@ -0,0 +1,259 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: org.apache.thrift.implementation; -*-
+
+(in-package :org.apache.thrift.implementation)
+
+;;; This file implements an in-process loopback transport for the `org.apache.thrift` library.
+;;;
+;;; Licensed to the Apache Software Foundation (ASF) under one
+;;; or more contributor license agreements. See the NOTICE file
+;;; distributed with this work for additional information
+;;; regarding copyright ownership. The ASF licenses this file
+;;; to you under the Apache License, Version 2.0 (the
+;;; "License"); you may not use this file except in compliance
+;;; with the License. You may obtain a copy of the License at
+;;;
+;;;   http://www.apache.org/licenses/LICENSE-2.0
+;;;
+;;; Unless required by applicable law or agreed to in writing,
+;;; software distributed under the License is distributed on an
+;;; "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+;;; KIND, either express or implied. See the License for the
+;;; specific language governing permissions and limitations
+;;; under the License.
+
+
+;;; A loopback transport pair is a duplex in-memory pipe. Each direction is a bounded ring buffer
+;;; with its own lock and two condition variables: a reader waits while the buffer is empty and
+;;; a writer waits while it is full. Closing either end closes both of its buffers, after which
+;;; the peer reads whatever remains and then end-of-file, and a write signals a transport-error.
+;;;
+;;; The pair permits a client and a server to run against each other in one process, with the
+;;; server in its own thread, in order to measure codec and dispatch costs without sockets:
+;;;
+;;;   (with-loopback-client (protocol service) (test-request protocol ...))
+;;;
+;;;  * make-loopback-transports : return the client and server ends
+;;;  * serve : given a loopback transport, process requests until the peer closes
+;;;  * call-with-loopback-client / with-loopback-client : serve a service in a thread for the extent of a body
+
+
+(defparameter *loopback-buffer-size* 8192
+  "The default capacity in bytes of each direction of a loopback transport pair.")
+
+
+(defclass loopback-buffer ()
+  ((vector
+    :initarg :vector
+    :reader loopback-buffer-vector
+    :type (simple-array (unsigned-byte 8) (*)))
+   (start
+    :initform 0
+    :accessor loopback-buffer-start
+    :type fixnum
+    :documentation "The index of the next byte to read.")
+   (count
+    :initform 0
+    :accessor loopback-buffer-count
+    :type fixnum
+    :documentation "The number of bytes available to read.")
+   (closed
+    :initform nil
+    :accessor loopback-buffer-closed)
+   (lock
+    :initform (bt:make-lock "thrift loopback buffer")
+    :reader loopback-buffer-lock)
+   (readable
+    :initform (bt:make-condition-variable)
+    :reader loopback-buffer-readable)
+   (writable
+    :initform (bt:make-condition-variable)
+    :reader loopback-buffer-writable))
+  (:documentation "A bounded single-direction ring buffer shared by the two ends of a loopback pair."))
+
+
+(defun make-loopback-buffer (size)
+  (make-instance 'loopback-buffer
+    :vector (make-array size :element-type '(unsigned-byte 8))))
+
+
+(defun loopback-buffer-close (buffer)
+  (bt:with-lock-held ((loopback-buffer-lock buffer))
+    (setf (loopback-buffer-closed buffer) t)
+    (bt:condition-notify (loopback-buffer-readable buffer))
+    (bt:condition-notify (loopback-buffer-writable buffer))))
+
+
+(defun loopback-buffer-write (buffer sequence start end transport)
+  "Copy the bytes from SEQUENCE into BUFFER, waiting for space as necessary."
+  (declare (type fixnum start end))
+  (let* ((vector (loopback-buffer-vector buffer))
+         (size (length vector))
+         (lock (loopback-buffer-lock buffer)))
+    (declare (type (simple-array (unsigned-byte 8) (*)) vector)
+             (type fixnum size))
+    (loop while (< start end)
+          do (bt:with-lock-held (lock)
+               (loop while (and (not (loopback-buffer-closed buffer))
+                                (= (loopback-buffer-count buffer) size))
+                     do (bt:condition-wait (loopback-buffer-writable buffer) lock))
+               (when (loopback-buffer-closed buffer)
+                 (error 'transport-closed-error :transport transport))
+               (let* ((count (loopback-buffer-count buffer))
+                      (tail (mod (+ (loopback-buffer-start buffer) count) size))
+                      (length (min (- end start) (- size count)))
+                      (first (min length (- size tail))))
+                 (declare (type fixnum count tail length first))
+                 (replace vector sequence :start1 tail :start2 start :end2 (+ start first))
+                 (when (< first length)
+                   (replace vector sequence :start1 0 :start2 (+ start first) :end2 (+ start length)))
+                 (setf (loopback-buffer-count buffer) (+ count length))
+                 (incf start length)
+                 (bt:condition-notify (loopback-buffer-readable buffer)))))))
+
+
+(defun loopback-buffer-read (buffer sequence start end)
+  "Copy bytes from BUFFER into SEQUENCE until it is filled or the buffer is closed and empty.
+ Return the index after the last byte read."
+  (declare (type fixnum start end))
+  (let* ((vector (loopback-buffer-vector buffer))
+         (size (length vector))
+         (lock (loopback-buffer-lock buffer)))
+    (declare (type (simple-array (unsigned-byte 8) (*)) vector)
+             (type fixnum size))
+    (loop while (< start end)
+          do (bt:with-lock-held (lock)
+               (loop while (and (zerop (loopback-buffer-count buffer))
+                                (not (loopback-buffer-closed buffer)))
+                     do (bt:condition-wait (loopback-buffer-readable buffer) lock))
+               (let* ((count (loopback-buffer-count buffer))
+                      (head (loopback-buffer-start buffer))
+                      (length (min (- end start) count))
+                      (first (min length (- size head))))
+                 (declare (type fixnum count head length first))
+                 (when (zerop count)
+                   (return))
+                 (replace sequence vector :start1 start :start2 head :end2 (+ head first))
+                 (when (< first length)
+                   (replace sequence vector :start1 (+ start first) :start2 0 :end2 (- length first)))
+                 (setf (loopback-buffer-start buffer) (mod (+ head length) size)
+                       (loopback-buffer-count buffer) (- count length))
+                 (incf start length)
+                 (bt:condition-notify (loopback-buffer-writable buffer)))))
+    start))
+
+
+
+(defclass loopback-transport (binary-transport)
+  ((input-buffer
+    :initarg :input-buffer
+    :reader transport-input-buffer)
+   (output-buffer
+    :initarg :output-buffer
+    :reader transport-output-buffer)
+   (byte-buffer
+    :initform (make-array 1 :element-type '(unsigned-byte 8))
+    :reader transport-byte-buffer))
+  (:default-initargs :direction :io)
+  (:documentation "One end of an in-process duplex pipe. It reads from the buffer to which its peer
+ writes and writes to the buffer from which its peer reads."))
+
+
+(defun make-loopback-transports (&key (buffer-size *loopback-buffer-size*))
+  "Return two values, the client and the server end of a new loopback pair."
+  (let ((request-buffer (make-loopback-buffer buffer-size))
+        (response-buffer (make-loopback-buffer buffer-size)))
+    (values (make-instance 'loopback-transport
+              :input-buffer response-buffer :output-buffer request-buffer)
+            (make-instance 'loopback-transport
+              :input-buffer request-buffer :output-buffer response-buffer))))
+
+
+(defmethod open-stream-p ((transport loopback-transport))
+  (not (eq (stream-direction transport) :closed)))
+
+(defun loopback-transport-close (transport)
+  (loopback-buffer-close (transport-output-buffer transport))
+  (loopback-buffer-close (transport-input-buffer transport))
+  (setf (stream-direction transport) :closed))
+
+(when (fboundp 'stream-close)
+  (defmethod stream-close ((transport loopback-transport))
+    (loopback-transport-close transport)))
+
+(when (typep #'close 'generic-function)
+  (defmethod close ((transport loopback-transport) &rest args)
+    (declare (ignore args))
+    (loopback-transport-close transport)
+    t))
+
+
+;;; written bytes are visible to the peer immediately, so that there is nothing to flush
+
+(defmethod stream-finish-output ((transport loopback-transport))
+  nil)
+
+(defmethod stream-force-output ((transport loopback-transport))
+  nil)
+
+
+(defmethod stream-read-byte ((transport loopback-transport))
+  (let ((buffer (transport-byte-buffer transport)))
+    (cond ((= (loopback-buffer-read (transport-input-buffer transport) buffer 0 1) 1)
+           (incf (the fixnum (transport-bytes-read transport)))
+           (signed-byte-8 (aref buffer 0)))
+          (t
+           (error 'end-of-file :stream transport)))))
+
+(defmethod stream-read-sequence ((transport loopback-transport) (sequence vector)
+                                 #+mcl &key #-mcl &optional (start 0) (end nil))
+  (let* ((end (or end (length sequence)))
+         (position (loopback-buffer-read (transport-input-buffer transport) sequence start end)))
+    (incf (the fixnum (transport-bytes-read transport)) (- position start))
+    (unless (= position end)
+      (error 'end-of-file :stream transport))
+    end))
+
+(defmethod stream-write-byte ((transport loopback-transport) byte)
+  (let ((buffer (transport-byte-buffer transport)))
+    (setf (aref buffer 0) (unsigned-byte-8 byte))
+    (loopback-buffer-write (transport-output-buffer transport) buffer 0 1 transport)
+    (incf (the fixnum (transport-bytes-written transport)))
+    byte))
+
+(defmethod stream-write-sequence ((transport loopback-transport) (sequence vector)
+                                  #+mcl &key #-mcl &optional (start 0) (end nil))
+  (let ((end (or end (length sequence))))
+    (loopback-buffer-write (transport-output-buffer transport) sequence start end transport)
+    (incf (the fixnum (transport-bytes-written transport)) (- end start)))
+  sequence)
+
+
+
+(defmethod serve ((transport loopback-transport) (service service))
+  "Given the server end of a loopback pair, process requests until the client end closes."
+  (unwind-protect (serve-connection service (client transport))
+    (close transport)))
+
+
+(defun call-with-loopback-client (op service &rest initargs &key (buffer-size *loopback-buffer-size*)
+                                     &allow-other-keys)
+  "Create a loopback pair, serve the SERVICE on its server end in a new thread, and call OP with
+ a client protocol on the client end. The remaining INITARGS are passed to the client protocol,
+ eg. :protocol 'multiplexed-protocol :service-identifier ..."
+  (multiple-value-bind (client-transport server-transport)
+                       (make-loopback-transports :buffer-size buffer-size)
+    (let ((server (bt:make-thread #'(lambda () (serve server-transport service))
+                                  :name (format nil "thrift loopback server: ~a" (service-identifier service)))))
+      (unwind-protect (let ((initargs (copy-list initargs)))
+                        (remf initargs :buffer-size)
+                        (funcall op (apply #'client client-transport initargs)))
+        (close client-transport)
+        (bt:join-thread server)))))
+
+
+(defmacro with-loopback-client ((protocol service &rest initargs) &body body)
+  "Execute BODY with PROTOCOL bound to a client connected through a loopback pair to SERVICE."
+  (with-gensyms (op)
+    `(flet ((,op (,protocol) ,@body))
+       (declare (dynamic-extent #',op))
+       (call-with-loopback-client #',op ,service ,@initargs))))
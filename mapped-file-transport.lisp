@@ -0,0 +1,143 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: org.apache.thrift.implementation; -*-
+
+(in-package :org.apache.thrift.implementation)
+
+;;; This file implements a memory-mapped file transport for the `org.apache.thrift` library.
+;;;
+;;; Licensed to the Apache Software Foundation (ASF) under one
+;;; or more contributor license agreements. See the NOTICE file
+;;; distributed with this work for additional information
+;;; regarding copyright ownership. The ASF licenses this file
+;;; to you under the Apache License, Version 2.0 (the
+;;; "License"); you may not use this file except in compliance
+;;; with the License. You may obtain a copy of the License at
+;;;
+;;;   http://www.apache.org/licenses/LICENSE-2.0
+;;;
+;;; Unless required by applicable law or agreed to in writing,
+;;; software distributed under the License is distributed on an
+;;; "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+;;; KIND, either express or implied. See the License for the
+;;; specific language governing permissions and limitations
+;;; under the License.
+
+
+;;; A mapped-file-transport maps a file read-only into memory and reads it as one octet region,
+;;; rather than through a file stream. The decoders' sequence reads copy directly from the mapped
+;;; pages, and stream-position seeks anywhere in the file at no cost, eg. to re-read a record whose
+;;; offset an index recorded. The file is unmapped when the transport is closed, or, should it never
+;;; be closed, by a finalizer once the transport is garbage.
+;;;
+;;;   (let ((transport (mapped-file-transport #p"/data/dump.bin")))
+;;;     (stream-position transport offset)
+;;;     (stream-read-struct (client transport :direction :input) 'record))
+;;;
+;;; The implementation uses sb-posix, and is loaded for sbcl only.
+
+
+(defclass mapped-file-transport (binary-transport)
+  ((pathname
+    :initarg :pathname :initform (error "pathname is required.")
+    :reader transport-pathname)
+   (sap
+    :initform nil
+    :reader mapped-file-transport-sap
+    :documentation "The address of the mapped region, or nil if the file is empty or the
+     transport is closed.")
+   (length
+    :initform 0 :type fixnum
+    :reader mapped-file-transport-length)
+   (position
+    :initform 0 :type fixnum
+    :accessor mapped-file-transport-position))
+  (:default-initargs :direction :input)
+  (:documentation "A read-only transport over a memory-mapped file."))
+
+
+(defmethod initialize-instance :after ((transport mapped-file-transport) &key pathname)
+  (let ((fd (sb-posix:open (sb-ext:native-namestring (translate-logical-pathname pathname))
+                           sb-posix:o-rdonly)))
+    (unwind-protect
+      (let ((length (sb-posix:stat-size (sb-posix:fstat fd))))
+        (setf (slot-value transport 'length) length)
+        (when (plusp length)
+          (let ((sap (sb-posix:mmap nil length sb-posix:prot-read sb-posix:map-private fd 0)))
+            (setf (slot-value transport 'sap) sap)
+            ;; the finalizer must not refer to the transport
+            (sb-ext:finalize transport #'(lambda () (sb-posix:munmap sap length))
+                             :dont-save t))))
+      ;; the mapping remains valid once the descriptor is closed
+      (sb-posix:close fd))))
+
+(defun mapped-file-transport (pathname &rest initargs)
+  "Return a transport which reads the file at PATHNAME through a read-only memory mapping."
+  (apply #'make-instance 'mapped-file-transport :pathname pathname initargs))
+
+
+(defmethod open-stream-p ((transport mapped-file-transport))
+  (not (eq (stream-direction transport) :closed)))
+
+(defun mapped-file-transport-close (transport)
+  (let ((sap (mapped-file-transport-sap transport)))
+    (when sap
+      (setf (slot-value transport 'sap) nil)
+      (sb-ext:cancel-finalization transport)
+      (sb-posix:munmap sap (mapped-file-transport-length transport)))
+    (setf (stream-direction transport) :closed)))
+
+(defmethod close ((transport mapped-file-transport) &key abort)
+  (declare (ignore abort))
+  (mapped-file-transport-close transport)
+  t)
+
+
+(defmethod stream-position ((transport mapped-file-transport) &optional new)
+  (if new
+    (setf (mapped-file-transport-position transport)
+          (min new (mapped-file-transport-length transport)))
+    (mapped-file-transport-position transport)))
+
+(defmethod stream-eofp ((transport mapped-file-transport))
+  (>= (mapped-file-transport-position transport) (mapped-file-transport-length transport)))
+
+
+(defmethod stream-read-byte ((transport mapped-file-transport))
+  (let ((position (mapped-file-transport-position transport)))
+    (declare (type fixnum position))
+    (when (>= position (mapped-file-transport-length transport))
+      (error 'end-of-file :stream transport))
+    (setf (mapped-file-transport-position transport) (1+ position))
+    (incf (the fixnum (transport-bytes-read transport)))
+    (signed-byte-8 (sb-sys:sap-ref-8 (mapped-file-transport-sap transport) position))))
+
+(defmethod stream-read-sequence ((transport mapped-file-transport) (sequence vector) &optional (start 0) (end nil))
+  (let* ((end (or end (length sequence)))
+         (position (mapped-file-transport-position transport))
+         (count (- end start))
+         (sap (mapped-file-transport-sap transport)))
+    (declare (type fixnum end position count))
+    (when (> (+ position count) (mapped-file-transport-length transport))
+      (error 'end-of-file :stream transport))
+    (cond ((zerop count))
+          ((typep sequence '(simple-array (unsigned-byte 8) (*)))
+           ;; pinned, in order that the collector cannot move the vector during the copy
+           (sb-sys:with-pinned-objects (sequence)
+             (sb-alien:alien-funcall (sb-alien:extern-alien "memcpy"
+                                                            (function sb-sys:system-area-pointer
+                                                                      sb-sys:system-area-pointer
+                                                                      sb-sys:system-area-pointer
+                                                                      sb-alien:unsigned-long))
+                                     (sb-sys:sap+ (sb-sys:vector-sap sequence) start)
+                                     (sb-sys:sap+ sap position)
+                                     count)))
+          (t
+           (loop for index from start below end
+                 for offset of-type fixnum from position
+                 do (setf (aref sequence index) (sb-sys:sap-ref-8 sap offset)))))
+    (setf (mapped-file-transport-position transport) (+ position count))
+    (incf (the fixnum (transport-bytes-read transport)) count)
+    end))
+
+
+(defmethod payload-source-eofp ((transport mapped-file-transport))
+  (stream-eofp transport))
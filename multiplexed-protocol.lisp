@@ -0,0 +1,125 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: org.apache.thrift.implementation; -*-
+
+(in-package :org.apache.thrift.implementation)
+
+;;; This file implements the multiplexed protocol and service for the `org.apache.thrift` library.
+;;;
+;;; Licensed to the Apache Software Foundation (ASF) under one
+;;; or more contributor license agreements. See the NOTICE file
+;;; distributed with this work for additional information
+;;; regarding copyright ownership. The ASF licenses this file
+;;; to you under the Apache License, Version 2.0 (the
+;;; "License"); you may not use this file except in compliance
+;;; with the License. You may obtain a copy of the License at
+;;;
+;;;   http://www.apache.org/licenses/LICENSE-2.0
+;;;
+;;; Unless required by applicable law or agreed to in writing,
+;;; software distributed under the License is distributed on an
+;;; "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+;;; KIND, either express or implied. See the License for the
+;;; specific language governing permissions and limitations
+;;; under the License.
+
+
+;;; The multiplexed variant is compatible with TMultiplexedProtocol/TMultiplexedProcessor.
+;;; A client multiplexed-protocol prefixes the identifier of each call/oneway message with
+;;; its service identifier and a ':'. A multiplexed-service registers any number of services
+;;; by identifier and routes each request to the one named by the prefix. The response is
+;;; encoded by the routed service's response method and carries the unprefixed identifier.
+;;;
+;;; In order to share one connection among several services, create the first client protocol
+;;; for the location and then further multiplexed-protocol instances on its transports:
+;;;
+;;;   (client (client location :protocol 'multiplexed-protocol :service-identifier "Calculator")
+;;;           :protocol 'multiplexed-protocol :service-identifier "SharedService")
+
+
+(defparameter *multiplexed-separator* ":")
+
+
+(defclass multiplexed-protocol (binary-protocol)
+  ((service-identifier
+    :initform nil :initarg :service-identifier
+    :accessor protocol-service-identifier
+    :documentation "The external service identifier with which to prefix call and oneway
+     message identifiers. If null, the identifiers are written as is."))
+  (:documentation "A binary protocol which prefixes request message identifiers with the service
+ identifier as per TMultiplexedProtocol."))
+
+
+(defmethod stream-write-message-begin ((protocol multiplexed-protocol) name type sequence)
+  (let ((service-identifier (protocol-service-identifier protocol)))
+    (call-next-method protocol
+                      (if (and service-identifier (member type '(call oneway)))
+                        (concatenate 'string service-identifier *multiplexed-separator* name)
+                        name)
+                      type sequence)))
+
+
+(defmethod reuse-client ((protocol multiplexed-protocol) &key (service-identifier nil s-i-s) &allow-other-keys)
+  "When a pooled connection is leased for another service, retarget the prefix."
+  (when s-i-s
+    (setf (protocol-service-identifier protocol) service-identifier))
+  protocol)
+
+
+
+(defclass multiplexed-service (service)
+  ((services
+    :initform (make-hash-table :test 'equal)
+    :reader multiplexed-service-services
+    :documentation "An equal hash table which binds service identifiers to the registered services.")
+   (default-service
+    :initform nil :initarg :default-service
+    :accessor multiplexed-service-default-service
+    :documentation "If non-null, the service to which unprefixed requests are routed. This permits
+     clients which are not multiplexed to continue to use a single service."))
+  (:default-initargs :identifier "multiplexed")
+  (:documentation "A multiplexed service routes requests to its registered services according to
+ the service identifier prefix of the message identifier."))
+
+
+(defmethod initialize-instance :after ((instance multiplexed-service) &key services)
+  (dolist (service services)
+    (register-service instance service)))
+
+
+(defgeneric register-service (multiplexed-service service &optional identifier)
+  (:documentation "Register the SERVICE in the MULTIPLEXED-SERVICE under the given IDENTIFIER,
+ which defaults to the service's own identifier.")
+
+  (:method ((multiplexed-service multiplexed-service) (service service)
+            &optional (identifier (service-identifier service)))
+    (setf (gethash identifier (multiplexed-service-services multiplexed-service)) service)))
+
+
+(defgeneric unregister-service (multiplexed-service identifier)
+  (:method ((multiplexed-service multiplexed-service) (identifier string))
+    (remhash identifier (multiplexed-service-services multiplexed-service)))
+
+  (:method ((multiplexed-service multiplexed-service) (service service))
+    (unregister-service multiplexed-service (service-identifier service))))
+
+
+(defmethod method-definition ((service multiplexed-service) (identifier string))
+  "Split the identifier at the service separator and delegate to the registered service.
+ Given no prefix, try the service's own methods and then the default service."
+  (let ((separator (search *multiplexed-separator* identifier)))
+    (if separator
+      (let ((delegate (gethash (subseq identifier 0 separator) (multiplexed-service-services service))))
+        (when delegate
+          (method-definition delegate (subseq identifier (+ separator (length *multiplexed-separator*))))))
+      (multiple-value-bind (function definer) (call-next-method)
+        (if function
+          (values function definer)
+          (let ((default (multiplexed-service-default-service service)))
+            (when default
+              (method-definition default identifier))))))))
+
+(defmethod method-dispatch ((service multiplexed-service) octets length)
+  "Decode the identifier in order to route it by its service prefix."
+  (let ((identifier (trivial-utf-8:utf-8-bytes-to-string octets :end length)))
+    (multiple-value-bind (function definer) (method-definition service identifier)
+      (when function
+        (values function definer identifier)))))
@@ -46,29 +46,54 @@
                 :stream-write-string)
   (:export 
    :*binary-transport-element-type*
+   :*binary-chunk-size*
+   :*binary-spill-directory*
+   :*binary-spill-threshold*
+   :*framed-transport-maximum-frame-size*
+   :*connection-pool*
+   :*struct-pool*
+   :*count-transport-statistics*
+   :*instrument-server*
+   :*octet-buffer-cache*
+   :*octet-buffer-depot*
+   :*record-log-sync-interval*
    :application-error
+   :acquire-octet-buffer
    :binary-protocol
    :binary-transport
    :binary
    :bool
    :byte
    :call
+   :call-with-loopback-client
    :class-condition-class
    :class-field-definitions
+   :constant-encoded-value
+   :constant-map
    :class-identifier
    :class-not-found
    :class-not-found-error
+   :close-record-log
    :client with-client
+   :close-connection-pool
+   :connection-pool
+   :connection-pool-statistics
+   :connection-pool-timeout-error
    :def-constant
    :def-enum
    :def-exception
    :def-package
    :def-service
    :def-struct
+   :def-typedef
    :direct-field-definition
    :double
    :effective-field-definition
    :element-type-error
+   :encode-struct
+   :encoded-value
+   :encoded-value-octets
+   :encoded-value-type
    :enum
    :enum-type-error
    :exception
@@ -78,11 +103,20 @@
    :field-definition-name
    :field-definition-optional
    :field-definition-reader
+   :field-definition-representation
    :field-definition-type
    :field-size-error
    :field-type-error
+   :find-thrift-class
    :float
+   :frame-size-error
+   :framed-server
+   :framed-transport
    :method-definition
+   :method-dispatch
+   :multiplexed-protocol
+   :multiplexed-service
+   :multiplexed-service-services
    :i08
    :i16
    :i32
@@ -93,26 +127,72 @@
    :invalid-field-type
    :invalid-protocol-version
    :invalid-struct-type
+   :lease-struct
    :list
+   :loopback-transport
+   :make-connection-pool
+   :make-encoded-value
+   :make-loopback-transports
+   :make-octet-buffer-cache
+   :make-octet-buffer-depot
+   :make-socket-server
+   :make-struct-pool
+   :make-transport-statistics
+   :make-struct
    :map
    :map-get
+   :map-record-log
+   :mapped-file-transport
+   :missing-required-field
+   :octet-buffer-pool-statistics
+   :open-record-log
+   :payload-profile-report
+   :pool-evict
+   :pool-lease
+   :pool-return
+   :profile-payloads
    :protocol
    :protocol-error
    :protocol-field-id-mode
    :protocol-input-transport
    :protocol-output-transport
+   :protocol-service-identifier
    :protocol-version-error
+   :record-log
+   :record-log-append
+   :record-log-bisect
+   :record-log-count
+   :record-log-error
+   :record-log-flush
+   :record-log-offset
+   :record-log-read
+   :record-log-refresh
+   :record-log-type
+   :register-service
+   :release-octet-buffer
+   :release-struct
    :reply
+   :required-field-error
+   :reset-service-statistics
+   :reset-struct
+   :reset-transport-statistics
    :serve
    :serve simple-server handler
+   :serve-connection
+   :server-close
    :service
    :service-base-services
    :service-identifier
    :service-package
+   :service-statistics
    :set
    :shared-service
+   :skip-record
+   :socket-server
    :stream-direction
    :stream-read-binary
+   :stream-read-binary-spill
+   :stream-read-binary-view
    :stream-read-bool
    :stream-read-double
    :stream-read-field
@@ -140,11 +220,13 @@
    :stream-read-struct
    :stream-read-struct-begin
    :stream-read-struct-end
+   :stream-read-struct-into
    :stream-read-type
    :stream-read-type-value
    :stream-write-binary
    :stream-write-bool
    :stream-write-double
+   :stream-write-encoded-value
    :stream-write-field
    :stream-write-float
    :stream-write-i08
@@ -156,6 +238,7 @@
    :stream-write-message
    :stream-write-message-type
    :stream-write-set
+   :stream-write-framed-struct
    :stream-write-string
    :stream-write-struct
    :stream-write-type
@@ -163,25 +246,48 @@
    :string
    :struct
    :struct-name
+   :struct-pool
    :struct-type-error
    :thrift
    :thrift-class
+   :thrift-encoded-size
+   :thrift-equal
    :thrift-error
    :thrift-object
+   :thrift-sparse-struct-class
    :thrift-struct-class
    :thrift-exception-class
+   :thrift-hash
+   :threaded-socket-server
    :transport
+   :transport-bytes-read
+   :transport-bytes-written
    :transport-error
+   :transport-octet-view
+   :transport-closed-error
+   :transport-release-buffers
+   :transport-statistics
+   :transport-statistics-snapshot
    :type-of
    :unknown-field
    :unknown-field-error
    :unknown-method
    :unknown-method-error
+   :unregister-service
    :vector-input-stream
    :vector-output-stream
    :vector-stream-transport
+   :vector-stream-release
    :vector-stream-vector
    :void
+   :with-encoded-struct
+   :with-loopback-client
+   :with-octet-buffer
+   :with-octet-buffer-cache
+   :with-record-log
+   :with-struct-pool
+   :write-payload-profile
+   :write-service-statistics
    ))
 
 
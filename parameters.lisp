@@ -33,8 +33,8 @@
     (double . 4)
     (thrift:float . 5)                         ; this is not standard
     (i16 . 6)
-    (enum . 6)
     (i32 . 8)
+    (enum . 8)                                 ; after i32, so that code 8 decodes as i32
     (u64 . 9)
     (i64 . 10)
     (string . 11)
@@ -71,7 +71,7 @@
     (utf7   . string)
     (binary . vector)
     (struct . standard-object)
-    (thrift:map . cl:list)
+    (thrift:map . t)                    ; an association list or a constant hash table
     (thrift:set . cl:list)
     (thrift:list . cl:list)
     (utf8 . vector)
@@ -103,6 +103,10 @@
 
 (defparameter *response-exception-type* 'response-exception)
 
+(defvar *connection-pool* nil
+  "When non-null, a connection-pool from which with-client leases connections to thrift uri
+ locations instead of opening a new socket for each use. (see pool.lisp)")
+
 ;;; the thrfit class registry binds class names (_not identifiers_) to either the
 ;;; 
 (defvar *thrift-classes* (make-hash-table :test 'eq)
@@ -0,0 +1,208 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: org.apache.thrift.implementation; -*-
+
+(in-package :org.apache.thrift.implementation)
+
+;;; This file implements a payload profiler for the `org.apache.thrift` library.
+;;;
+;;; Licensed to the Apache Software Foundation (ASF) under one
+;;; or more contributor license agreements. See the NOTICE file
+;;; distributed with this work for additional information
+;;; regarding copyright ownership. The ASF licenses this file
+;;; to you under the Apache License, Version 2.0 (the
+;;; "License"); you may not use this file except in compliance
+;;; with the License. You may obtain a copy of the License at
+;;;
+;;;   http://www.apache.org/licenses/LICENSE-2.0
+;;;
+;;; Unless required by applicable law or agreed to in writing,
+;;; software distributed under the License is distributed on an
+;;; "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+;;; KIND, either express or implied. See the License for the
+;;; specific language governing permissions and limitations
+;;; under the License.
+
+
+;;; profile-payloads decodes a sequence of binary encoded structs, eg. a sample stream captured to
+;;; a file, and attributes the encoded bytes and the decode time to field paths. A path names the
+;;; struct and then each field by identifier. List and set elements and map values are
+;;; denoted by [*], and map keys by {*}, eg.
+;;;
+;;;   Insanity
+;;;   Insanity.userMap
+;;;   Insanity.userMap{*}
+;;;   Insanity.userMap[*]
+;;;   Insanity.xtructs[*].string_thing
+;;;
+;;; The counts are inclusive: a field's bytes include its header and all nested values. Fields
+;;; which the class does not define appear as #<id>. The walk follows the encoded types, and
+;;; uses the class field definitions for names only, so that it also profiles data which was
+;;; written with a different version of the IDL.
+;;;
+;;;   (write-payload-profile (profile-payloads #p"/tmp/insanity.bin" 'insanity :every 10))
+
+
+(defstruct (payload-path-statistics (:constructor make-payload-path-statistics (path)))
+  (path "" :type string)
+  (count 0 :type integer)
+  (bytes 0 :type integer)
+  (microseconds 0 :type integer))
+
+(defstruct (payload-profile (:constructor make-payload-profile ()))
+  (root nil)
+  (records 0 :type integer)
+  (sampled 0 :type integer)
+  (paths (make-hash-table :test 'equal) :type hash-table))
+
+
+(defun record-payload-path (profile path transport bytes start)
+  (let* ((paths (payload-profile-paths profile))
+         (statistics (or (gethash path paths)
+                         (setf (gethash path paths) (make-payload-path-statistics path)))))
+    (incf (payload-path-statistics-count statistics))
+    (incf (payload-path-statistics-bytes statistics) (- (transport-bytes-read transport) bytes))
+    (incf (payload-path-statistics-microseconds statistics)
+          (internal-time-microseconds (- (get-internal-real-time) start)))))
+
+(defmacro with-payload-path ((profile path transport) &body body)
+  "Attribute the bytes which BODY reads from TRANSPORT, and its time, to the PATH. The path form
+ is evaluated after the body. A non-local exit records nothing."
+  (with-gensyms (bytes start)
+    `(let ((,bytes (transport-bytes-read ,transport))
+           (,start (get-internal-real-time)))
+       (multiple-value-prog1 (progn ,@body)
+         (record-payload-path ,profile ,path ,transport ,bytes ,start)))))
+
+
+(defun payload-struct-class (type)
+  (when (and (consp type) (eq (first type) 'struct))
+    (let ((name (second type)))
+      (find-thrift-class (if (symbolp name) name (str-sym name)) nil))))
+
+(defun profile-struct (profile protocol class path)
+  (let ((transport (protocol-input-transport protocol))
+        (fields (when class (class-field-definitions class))))
+    (stream-read-struct-begin protocol)
+    (loop (let ((field-path nil))
+            (with-payload-path (profile field-path transport)
+              (multiple-value-bind (name id wire-type) (stream-read-field-begin protocol)
+                (declare (ignore name))
+                (when (eq wire-type 'stop)
+                  (stream-read-struct-end protocol)
+                  (return))
+                (let ((fd (find id fields :key #'field-definition-identifier-number)))
+                  (setf field-path (concatenate 'string path "."
+                                                (if fd
+                                                  (field-definition-identifier fd)
+                                                  (format nil "#~d" id))))
+                  (profile-value profile protocol field-path wire-type
+                                 (when fd (field-definition-type fd)))
+                  (stream-read-field-end protocol))))))))
+
+(defun profile-value (profile protocol path wire-type type)
+  "Decode a value of the encoded WIRE-TYPE and attribute its constituents to paths below PATH.
+ TYPE is the declared type, if known, which supplies the nested struct classes."
+  (let ((transport (protocol-input-transport protocol)))
+    (case wire-type
+      (struct
+       (profile-struct profile protocol (payload-struct-class type) path))
+      ((thrift:list thrift:set)
+       (multiple-value-bind (element-wire-type size)
+                            (if (eq wire-type 'thrift:list)
+                              (stream-read-list-begin protocol)
+                              (stream-read-set-begin protocol))
+         (let ((element-path (concatenate 'string path "[*]"))
+               (element-type (when (consp type) (second type))))
+           (dotimes (i size)
+             (with-payload-path (profile element-path transport)
+               (profile-value profile protocol element-path element-wire-type element-type))))
+         (if (eq wire-type 'thrift:list)
+           (stream-read-list-end protocol)
+           (stream-read-set-end protocol))))
+      (thrift:map
+       (multiple-value-bind (key-wire-type value-wire-type size) (stream-read-map-begin protocol)
+         (let ((key-path (concatenate 'string path "{*}"))
+               (value-path (concatenate 'string path "[*]"))
+               (key-type (when (consp type) (second type)))
+               (value-type (when (consp type) (third type))))
+           (dotimes (i size)
+             (with-payload-path (profile key-path transport)
+               (profile-value profile protocol key-path key-wire-type key-type))
+             (with-payload-path (profile value-path transport)
+               (profile-value profile protocol value-path value-wire-type value-type))))
+         (stream-read-map-end protocol)))
+      (string
+       ;; binary fields need not be valid utf-8
+       (if (eq type 'binary)
+         (stream-read-binary protocol)
+         (stream-read-string protocol)))
+      (t
+       (stream-read-value-as protocol wire-type)))))
+
+
+(defgeneric payload-source-eofp (transport)
+  (:method ((transport vector-stream))
+    (stream-eofp transport))
+  (:method ((transport transport))
+    (let ((stream (transport-stream transport)))
+      (and (typep stream 'file-stream)
+           (>= (file-position stream) (file-length stream))))))
+
+(defgeneric profile-payloads (source type &key every limit profile)
+  (:documentation "Decode the binary encoded TYPE structs from SOURCE, a pathname or a transport,
+ until its end or until LIMIT records. Profile every EVERY'th record and skip the others.
+ Accumulate into PROFILE, if given, and return it.")
+
+  (:method ((source string) type &rest args)
+    (apply #'profile-payloads (pathname source) type args))
+
+  (:method ((source pathname) type &rest args)
+    (let ((transport (file-transport source :direction :input :if-does-not-exist :error)))
+      (unwind-protect (apply #'profile-payloads transport type args)
+        (transport-close transport))))
+
+  (:method ((source transport) type &key (every 1) limit (profile (make-payload-profile)))
+    (let* ((class (find-thrift-class (if (stringp type) (str-sym type) type)))
+           (type (class-name class))
+           (path (class-identifier class))
+           (protocol (make-instance 'binary-protocol :transport source :direction :input)))
+      (setf (payload-profile-root profile) path)
+      (loop for index from 0
+            until (or (and limit (>= index limit)) (payload-source-eofp source))
+            do (incf (payload-profile-records profile))
+            if (zerop (mod index every))
+            do (progn (incf (payload-profile-sampled profile))
+                      (with-payload-path (profile path source)
+                        (profile-struct profile protocol class path)))
+            else do (stream-read-struct protocol type))
+      profile)))
+
+
+(defun payload-profile-report (profile)
+  "Return a property list for each path in PROFILE, in order of decreasing bytes, with the
+ occurrence count, the bytes, their share of all sampled bytes, the mean bytes per sampled
+ record, and the decode microseconds."
+  (let* ((paths (payload-profile-paths profile))
+         (root (gethash (payload-profile-root profile) paths))
+         (total (if root (payload-path-statistics-bytes root) 0))
+         (sampled (max 1 (payload-profile-sampled profile))))
+    (loop for statistics in (sort (loop for statistics being each hash-value of paths
+                                        collect statistics)
+                                  #'> :key #'payload-path-statistics-bytes)
+          for bytes = (payload-path-statistics-bytes statistics)
+          collect (list :path (payload-path-statistics-path statistics)
+                        :count (payload-path-statistics-count statistics)
+                        :bytes bytes
+                        :share (if (plusp total) (cl:float (/ bytes total) 1.0d0) 0.0d0)
+                        :bytes/record (cl:float (/ bytes sampled) 1.0d0)
+                        :microseconds (payload-path-statistics-microseconds statistics)))))
+
+(defun write-payload-profile (profile &optional (stream *standard-output*))
+  "Write the PROFILE report to STREAM as a table, one path per line."
+  (format stream "~&~d records, ~d sampled~%~12@a ~7@a ~12@a ~10@a ~12@a  ~a~%"
+          (payload-profile-records profile) (payload-profile-sampled profile)
+          "bytes" "share" "bytes/record" "count" "microsec" "path")
+  (dolist (entry (payload-profile-report profile))
+    (destructuring-bind (&key path count bytes share bytes/record microseconds) entry
+      (format stream "~12d ~6,1f% ~12,1f ~10d ~12d  ~a~%"
+              bytes (* share 100) bytes/record count microseconds path)))
+  profile)
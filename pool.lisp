@@ -0,0 +1,452 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: org.apache.thrift.implementation; -*-
+
+(in-package :org.apache.thrift.implementation)
+
+;;; This file implements a client connection pool and struct pools for the `org.apache.thrift` library.
+;;;
+;;; Licensed to the Apache Software Foundation (ASF) under one
+;;; or more contributor license agreements. See the NOTICE file
+;;; distributed with this work for additional information
+;;; regarding copyright ownership. The ASF licenses this file
+;;; to you under the Apache License, Version 2.0 (the
+;;; "License"); you may not use this file except in compliance
+;;; with the License. You may obtain a copy of the License at
+;;;
+;;;   http://www.apache.org/licenses/LICENSE-2.0
+;;;
+;;; Unless required by applicable law or agreed to in writing,
+;;; software distributed under the License is distributed on an
+;;; "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+;;; KIND, either express or implied. See the License for the
+;;; specific language governing permissions and limitations
+;;; under the License.
+
+
+;;; A connection-pool retains open client protocols keyed by the thrift uri of their remote
+;;; location. with-client leases a connection from the pool, if one is given or *connection-pool*
+;;; is bound, and returns it upon exit. The interface comprises
+;;;
+;;;  * make-connection-pool : construct a pool with min/max idle and per-endpoint limits, and
+;;;    optionally the endpoints to fill to the minimum idle count at once
+;;;  * pool-lease : return an open protocol for a location, waiting if the endpoint is at its limit
+;;;  * pool-return : return a leased protocol, closing it if it is broken or in excess
+;;;  * pool-evict : close idle connections which have timed out and refill each endpoint to its
+;;;    minimum idle count
+;;;  * connection-pool-statistics : report per-endpoint lease, creation, eviction and wait counts
+;;;  * close-connection-pool : close all idle connections
+;;;
+;;; Endpoints are distinguished by location and protocol class. When an idle connection is
+;;; reused, reuse-client adapts it to the new lease's initargs, eg. a multiplexed service prefix.
+;;; Each endpoint has its own lock and condition variable, so that contention is limited to
+;;; clients of the same location. Connections are created and closed outside of the lock.
+;;; A connection is considered broken, if the body of with-client exits non-locally, since
+;;; the message stream may then be left in an indeterminate state, or if an idle connection
+;;; fails the health check when it is leased.
+;;; An endpoint remembers the client initargs of its latest lease. The pool creates the connections
+;;; which bring an endpoint up to min-idle with them, when it is constructed and on each
+;;; pool-evict, which an application calls periodically, so that discarded and broken connections
+;;; are replaced outside of the lease path.
+
+
+(defclass connection-pool ()
+  ((endpoints
+    :initform (make-hash-table :test 'equal)
+    :reader connection-pool-endpoints
+    :documentation "Binds the uri namestring to the respective endpoint.")
+   (leases
+    :initform (make-hash-table :test 'eq)
+    :reader connection-pool-leases
+    :documentation "Binds each leased protocol to its endpoint, for use when it is returned.")
+   (lock
+    :initform (bt:make-lock "thrift connection pool")
+    :reader connection-pool-lock)
+   (min-idle
+    :initform 0 :initarg :min-idle
+    :reader connection-pool-min-idle
+    :documentation "The number of idle connections per endpoint to retain despite the idle timeout,
+     and to which the pool creates connections on construction and in pool-evict.")
+   (max-idle
+    :initform 8 :initarg :max-idle
+    :reader connection-pool-max-idle
+    :documentation "The number of idle connections per endpoint beyond which returned connections are closed.")
+   (max-connections
+    :initform 16 :initarg :max-connections
+    :reader connection-pool-max-connections
+    :documentation "The limit on leased plus idle connections per endpoint. A lease beyond this
+     limit waits for a connection to be returned.")
+   (idle-timeout
+    :initform 60 :initarg :idle-timeout
+    :reader connection-pool-idle-timeout
+    :documentation "The number of seconds after which an idle connection is evicted. If null, none expire.")
+   (wait-timeout
+    :initform nil :initarg :wait-timeout
+    :reader connection-pool-wait-timeout
+    :documentation "The number of seconds a lease waits for a connection. If null, it waits indefinitely."))
+  (:documentation "A thread-safe pool of client connections keyed by thrift uri."))
+
+
+(defclass connection-pool-endpoint ()
+  ((location :initarg :location :reader endpoint-location)
+   (uri :initarg :uri :reader endpoint-uri)
+   (initargs
+    :initform nil :accessor endpoint-initargs
+    :documentation "The client initargs of the latest lease, with which to create idle connections.")
+   (lock :reader endpoint-lock)
+   (available :initform (bt:make-condition-variable) :reader endpoint-available)
+   (idle
+    :initform nil :accessor endpoint-idle
+    :documentation "A list of (protocol . universal-time) entries, most recently returned first.")
+   (leased :initform 0 :accessor endpoint-leased)
+   ;; statistics
+   (lease-count :initform 0 :accessor endpoint-lease-count)
+   (create-count :initform 0 :accessor endpoint-create-count)
+   (evict-count :initform 0 :accessor endpoint-evict-count)
+   (wait-count :initform 0 :accessor endpoint-wait-count)
+   (wait-time :initform 0 :accessor endpoint-wait-time
+              :documentation "The total wait time in internal time units.")
+   (max-wait-time :initform 0 :accessor endpoint-max-wait-time))
+  (:documentation "The pool state for a single location."))
+
+
+(defmethod initialize-instance :after ((instance connection-pool-endpoint) &key location)
+  (setf (slot-value instance 'lock)
+        (bt:make-lock (format nil "thrift connection pool: ~a" location))))
+
+(defmethod print-object ((object connection-pool-endpoint) stream)
+  (print-unreadable-object (object stream :identity t :type t)
+    (format stream "~a ~d/~d" (endpoint-location object)
+            (endpoint-leased object) (length (endpoint-idle object)))))
+
+
+(defun make-connection-pool (&rest initargs &key min-idle max-idle max-connections idle-timeout wait-timeout
+                                                endpoints)
+  "Construct a connection pool. ENDPOINTS is a list of (location . client-initargs) entries, each of
+ which the pool fills to its minimum idle count at once."
+  (declare (dynamic-extent initargs)
+           (ignore min-idle max-idle max-connections idle-timeout wait-timeout endpoints))
+  (apply #'make-instance 'connection-pool initargs))
+
+(defmethod initialize-instance :after ((instance connection-pool) &key endpoints)
+  (loop for (location . initargs) in endpoints
+        for endpoint = (connection-pool-endpoint instance location (getf initargs :protocol 'binary-protocol))
+        do (setf (endpoint-initargs endpoint) (copy-list initargs))
+           (endpoint-fill instance endpoint)))
+
+
+(defun connection-pool-endpoint (pool location &optional (protocol-class 'binary-protocol))
+  "Return the endpoint for the LOCATION and PROTOCOL-CLASS, creating it if necessary."
+  (let ((key (format nil "~a ~(~a~)" location protocol-class)))
+    (bt:with-lock-held ((connection-pool-lock pool))
+      (or (gethash key (connection-pool-endpoints pool))
+          (setf (gethash key (connection-pool-endpoints pool))
+                (make-instance 'connection-pool-endpoint :location (princ-to-string location)
+                               :uri location))))))
+
+
+(defgeneric reuse-client (protocol &key &allow-other-keys)
+  (:documentation "Adapt an idle pooled PROTOCOL to the client initargs of a new lease.
+ The base method does nothing.")
+
+  (:method ((protocol protocol) &key &allow-other-keys)
+    protocol))
+
+
+(defgeneric transport-healthy-p (transport)
+  (:documentation "Return true iff an idle TRANSPORT can be reused for a new request.")
+
+  (:method ((transport transport))
+    (open-stream-p transport))
+
+  (:method ((transport socket-transport))
+    ;; an idle connection should have no pending input. if it does, it is either at
+    ;; end-of-file, as the peer closed it, or holds a stray response.
+    (and (call-next-method)
+         (null (usocket:wait-for-input (transport-socket transport) :timeout 0 :ready-only t)))))
+
+(defun connection-healthy-p (protocol)
+  (and (open-stream-p protocol)
+       (transport-healthy-p (protocol-input-transport protocol))))
+
+
+(defun endpoint-expire-idle (pool endpoint now)
+  "Remove the idle connections which have exceeded the pool's idle timeout, but retain at least
+ its minimum idle count. Return the removed protocols. The endpoint lock must be held."
+  (let ((timeout (connection-pool-idle-timeout pool))
+        (min-idle (connection-pool-min-idle pool))
+        (kept ())
+        (expired ())
+        (count 0))
+    (when timeout
+      (loop for entry in (endpoint-idle endpoint)
+            do (if (and (>= count min-idle) (> (- now (rest entry)) timeout))
+                 (push (first entry) expired)
+                 (progn (push entry kept) (incf count))))
+      (when expired
+        (setf (endpoint-idle endpoint) (nreverse kept))
+        (incf (endpoint-evict-count endpoint) (length expired))))
+    expired))
+
+(defun close-pooled-connections (protocols)
+  (dolist (protocol protocols)
+    (ignore-errors (close protocol :abort t))))
+
+(defun endpoint-fill (pool endpoint)
+  "Create idle connections until the ENDPOINT holds the POOL's minimum idle count, within its
+ connection limit. The connections are reserved as leased while they are created outside of the
+ lock, with the initargs of the endpoint's latest lease. A failure to connect ends the fill, as
+ the next pool-evict tries again. Return the count created."
+  (let ((lock (endpoint-lock endpoint))
+        (initargs nil)
+        (count 0)
+        (created 0))
+    (bt:with-lock-held (lock)
+      (let ((idle (length (endpoint-idle endpoint))))
+        (setf initargs (endpoint-initargs endpoint)
+              count (max 0 (min (- (connection-pool-min-idle pool) idle)
+                                (- (connection-pool-max-connections pool) (endpoint-leased endpoint) idle))))
+        (incf (endpoint-leased endpoint) count)))
+    (unwind-protect
+      (loop repeat count
+            for protocol = (ignore-errors (apply #'client (endpoint-uri endpoint) initargs))
+            while protocol
+            do (bt:with-lock-held (lock)
+                 (decf (endpoint-leased endpoint))
+                 (incf (endpoint-create-count endpoint))
+                 (push (cons protocol (get-universal-time)) (endpoint-idle endpoint))
+                 (bt:condition-notify (endpoint-available endpoint)))
+               (incf created))
+      (when (< created count)
+        (bt:with-lock-held (lock)
+          (decf (endpoint-leased endpoint) (- count created))
+          (bt:condition-notify (endpoint-available endpoint)))))
+    created))
+
+
+(defgeneric pool-lease (pool location &rest initargs)
+  (:documentation "Return an open client protocol for LOCATION. Reuse an idle connection if a healthy
+ one is present, create one if the endpoint is within its connection limit, and otherwise wait for
+ a connection to be returned. The INITARGS are passed to client when creating a connection.")
+
+  (:method ((pool connection-pool) (location puri:uri) &rest initargs)
+    (declare (dynamic-extent initargs))
+    (let* ((endpoint (connection-pool-endpoint pool location (getf initargs :protocol 'binary-protocol)))
+           (lock (endpoint-lock endpoint))
+           (wait-timeout (connection-pool-wait-timeout pool))
+           (start (get-internal-real-time))
+           (waited nil))
+      (flet ((record-lease (protocol)
+               (let ((wait-time (- (get-internal-real-time) start)))
+                 (bt:with-lock-held (lock)
+                   (incf (endpoint-lease-count endpoint))
+                   (when waited
+                     (incf (endpoint-wait-count endpoint))
+                     (incf (endpoint-wait-time endpoint) wait-time)
+                     (setf (endpoint-max-wait-time endpoint)
+                           (max wait-time (endpoint-max-wait-time endpoint))))))
+               (bt:with-lock-held ((connection-pool-lock pool))
+                 (setf (gethash protocol (connection-pool-leases pool)) endpoint))
+               protocol))
+        (loop (let ((protocol nil)
+                    (create nil)
+                    (expired nil))
+                (bt:with-lock-held (lock)
+                  (unless (equal initargs (endpoint-initargs endpoint))
+                    (setf (endpoint-initargs endpoint) (copy-list initargs)))
+                  (setf expired (endpoint-expire-idle pool endpoint (get-universal-time)))
+                  (loop (cond ((endpoint-idle endpoint)
+                               (setf protocol (first (pop (endpoint-idle endpoint))))
+                               (incf (endpoint-leased endpoint))
+                               (return))
+                              ((< (+ (endpoint-leased endpoint) (length (endpoint-idle endpoint)))
+                                  (connection-pool-max-connections pool))
+                               (incf (endpoint-leased endpoint))
+                               (setf create t)
+                               (return))
+                              (t
+                               (let ((remaining (when wait-timeout
+                                                  (- wait-timeout
+                                                     (/ (- (get-internal-real-time) start)
+                                                        internal-time-units-per-second)))))
+                                 (when (and remaining (<= remaining 0))
+                                   (error 'connection-pool-timeout-error :location location
+                                          :timeout wait-timeout))
+                                 (setf waited t)
+                                 (bt:condition-wait (endpoint-available endpoint) lock
+                                                    :timeout remaining))))))
+                (close-pooled-connections expired)
+                (cond (create
+                       (let ((protocol nil))
+                         (unwind-protect (setf protocol (apply #'client location initargs))
+                           (unless protocol
+                             (bt:with-lock-held (lock)
+                               (decf (endpoint-leased endpoint))
+                               (bt:condition-notify (endpoint-available endpoint)))))
+                         (bt:with-lock-held (lock)
+                           (incf (endpoint-create-count endpoint)))
+                         (return (record-lease protocol))))
+                      ((connection-healthy-p protocol)
+                       (return (record-lease (apply #'reuse-client protocol initargs))))
+                      (t
+                       ;; a broken idle connection: discard it and try again
+                       (bt:with-lock-held (lock)
+                         (decf (endpoint-leased endpoint))
+                         (incf (endpoint-evict-count endpoint)))
+                       (close-pooled-connections (list protocol))))))))))
+
+
+(defgeneric pool-return (pool protocol &key broken)
+  (:documentation "Return a leased PROTOCOL to the POOL. If it is BROKEN, closed, or in excess of
+ the pool's maximum idle count, close it. Otherwise retain it as idle and notify a waiting lease.")
+
+  (:method ((pool connection-pool) (protocol protocol) &key broken)
+    (let ((endpoint (bt:with-lock-held ((connection-pool-lock pool))
+                      (prog1 (gethash protocol (connection-pool-leases pool))
+                        (remhash protocol (connection-pool-leases pool)))))
+          (discard nil))
+      (cond (endpoint
+             (bt:with-lock-held ((endpoint-lock endpoint))
+               (decf (endpoint-leased endpoint))
+               (if (or broken
+                       (not (open-stream-p protocol))
+                       (>= (length (endpoint-idle endpoint)) (connection-pool-max-idle pool)))
+                 (setf discard t)
+                 (push (cons protocol (get-universal-time)) (endpoint-idle endpoint)))
+               (bt:condition-notify (endpoint-available endpoint)))
+             (when discard
+               (close-pooled-connections (list protocol))))
+            (t
+             ;; not from this pool
+             (close-pooled-connections (list protocol))))
+      nil)))
+
+
+(defgeneric pool-evict (pool)
+  (:documentation "Close all idle connections which have exceeded the pool's idle timeout, then
+ create connections to bring each endpoint up to the pool's minimum idle count. Return the count
+ closed.")
+
+  (:method ((pool connection-pool))
+    (let ((now (get-universal-time))
+          (expired ())
+          (endpoints (bt:with-lock-held ((connection-pool-lock pool))
+                       (loop for endpoint being each hash-value of (connection-pool-endpoints pool)
+                             collect endpoint))))
+      (dolist (endpoint endpoints)
+        (bt:with-lock-held ((endpoint-lock endpoint))
+          (setf expired (nconc (endpoint-expire-idle pool endpoint now) expired))))
+      (close-pooled-connections expired)
+      (when (plusp (connection-pool-min-idle pool))
+        (dolist (endpoint endpoints)
+          (endpoint-fill pool endpoint)))
+      (length expired))))
+
+
+(defgeneric close-connection-pool (pool)
+  (:documentation "Close all idle connections. Leased connections are closed as they are returned
+ only if they exceed the idle limit.")
+
+  (:method ((pool connection-pool))
+    (let ((idle ()))
+      (dolist (endpoint (bt:with-lock-held ((connection-pool-lock pool))
+                          (loop for endpoint being each hash-value of (connection-pool-endpoints pool)
+                                collect endpoint)))
+        (bt:with-lock-held ((endpoint-lock endpoint))
+          (setf idle (nconc (mapcar #'first (endpoint-idle endpoint)) idle))
+          (setf (endpoint-idle endpoint) nil)))
+      (close-pooled-connections idle)
+      (length idle))))
+
+
+(defgeneric connection-pool-statistics (pool)
+  (:documentation "Return a list of property lists, one per endpoint, with the current leased and
+ idle counts, the total lease, creation and eviction counts, and the count, total and maximum
+ of the time in seconds which leases have waited for a connection.")
+
+  (:method ((pool connection-pool))
+    (flet ((seconds (internal-time)
+             (/ (float internal-time 1.0d0) internal-time-units-per-second)))
+      (loop for endpoint in (bt:with-lock-held ((connection-pool-lock pool))
+                              (loop for endpoint being each hash-value of (connection-pool-endpoints pool)
+                                    collect endpoint))
+            collect (bt:with-lock-held ((endpoint-lock endpoint))
+                      (list :location (endpoint-location endpoint)
+                            :leased (endpoint-leased endpoint)
+                            :idle (length (endpoint-idle endpoint))
+                            :leases (endpoint-lease-count endpoint)
+                            :created (endpoint-create-count endpoint)
+                            :evicted (endpoint-evict-count endpoint)
+                            :waits (endpoint-wait-count endpoint)
+                            :wait-time (seconds (endpoint-wait-time endpoint))
+                            :max-wait-time (seconds (endpoint-max-wait-time endpoint))))))))
+
+
+(defun call-with-pooled-client (op pool location &rest args)
+  "Lease a protocol from POOL for LOCATION, apply OP to it, and return it. A non-local exit from
+ OP marks the connection as broken, as the message stream may be incomplete."
+  (declare (dynamic-extent args))
+  (let ((protocol (apply #'pool-lease pool location args))
+        (broken t))
+    (unwind-protect (multiple-value-prog1 (funcall op protocol)
+                      (setf broken nil))
+      (pool-return pool protocol :broken broken))))
+
+
+
+;;;
+;;; struct pools
+;;;
+;;; A struct-pool retains reset struct instances by type, in order that steady-state request
+;;; processing can reuse them rather than allocate them. A pool has no lock: bind *struct-pool*
+;;; per thread, eg. with-struct-pool around a connection's processing loop. While it is bound,
+;;; the decoders lease the instances which they allocate from it. The application returns an
+;;; instance with release-struct once it no longer refers to it. An instance can also be decoded
+;;; into directly, with (stream-read-struct protocol type (<struct>-reset instance)) or
+;;; stream-read-struct-into.
+
+(defclass struct-pool ()
+  ((free
+    :initform (make-hash-table :test 'eq)
+    :reader struct-pool-free
+    :documentation "Binds each struct class to a vector, with fill pointer, of its reset instances.")
+   (limit
+    :initform 64 :initarg :limit
+    :type fixnum
+    :reader struct-pool-limit
+    :documentation "The number of instances to retain per class."))
+  (:documentation "A per-thread cache of reset struct instances."))
+
+(defvar *struct-pool* nil
+  "The current thread's struct-pool, if any.")
+
+(defun make-struct-pool (&rest initargs &key limit)
+  (declare (ignore limit))
+  (apply #'make-instance 'struct-pool initargs))
+
+(defmacro with-struct-pool ((&optional (pool '(make-struct-pool))) &body body)
+  "Execute BODY with *struct-pool* bound to POOL, by default a new pool."
+  `(let ((*struct-pool* ,pool))
+     ,@body))
+
+(defun allocate-struct (class &optional (pool *struct-pool*))
+  "Return a reset instance of the struct CLASS from the POOL, if one is available, and otherwise
+ allocate one."
+  (let ((free (when pool (gethash class (struct-pool-free pool)))))
+    (if (and free (plusp (fill-pointer free)))
+      (vector-pop free)
+      (allocate-instance class))))
+
+(defun lease-struct (type &optional (pool *struct-pool*))
+  "Return a reset instance of the struct TYPE, from the POOL if possible."
+  (allocate-struct (find-thrift-class type) pool))
+
+(defun release-struct (instance &optional (pool *struct-pool*))
+  "Reset the struct INSTANCE and retain it in the POOL for reuse, unless the pool is full.
+ The caller must not refer to the instance afterwards."
+  (when pool
+    (let* ((class (class-of instance))
+           (free (or (gethash class (struct-pool-free pool))
+                     (setf (gethash class (struct-pool-free pool))
+                           (make-array (struct-pool-limit pool) :fill-pointer 0)))))
+      (when (< (fill-pointer free) (array-dimension free 0))
+        (vector-push (reset-struct instance) free))))
+  nil)
@@ -71,12 +71,15 @@
 (defgeneric stream-read-double (protocol))
 (defgeneric stream-read-string (protocol))
 (defgeneric stream-read-binary (protocol))
+(defgeneric stream-read-binary-view (protocol))
+(defgeneric stream-read-binary-spill (protocol))
 
 (defgeneric stream-read-message-begin (protocol))
+(defgeneric stream-read-message-begin-octets (protocol))
 (defgeneric stream-read-message (protocol))
 (defgeneric stream-read-message-end (protocol))
 (defgeneric stream-read-struct-begin (protocol))
-(defgeneric stream-read-struct (protocol &optional type))
+(defgeneric stream-read-struct (protocol &optional type instance))
 (defgeneric stream-read-struct-end (protocol))
 (defgeneric stream-read-field-begin (protocol))
 (defgeneric stream-read-field (protocol &optional type))
@@ -122,6 +125,7 @@
 (defgeneric stream-write-set-begin (protocol etype size))
 (defgeneric stream-write-set (protocol value &optional type))
 (defgeneric stream-write-set-end (protocol))
+(defgeneric stream-write-encoded-value (protocol value))
 
 
 
@@ -199,6 +203,10 @@
    (version-id :initarg :version-id :reader protocol-version-id)
    (version-number :initarg :version-number :reader protocol-version-number)
    (sequence-number :initform 0 :accessor protocol-sequence-number)
+   (message-name-buffer
+    :initform nil :accessor protocol-message-name-buffer
+    :documentation "A reusable octet buffer for request message identifiers, which a server matches
+     against its dispatch table without decoding them.")
    (field-id-mode :initarg :field-key :reader protocol-field-id-mode
                   :type (member :identifier-number :identifier-name))
    (struct-id-mode :initarg :struct-id-mode :reader protocol-struct-id-mode
@@ -211,6 +219,26 @@
   (:default-initargs :charset :utf8))
 
 
+(defclass encoded-value ()
+  ((type
+    :initarg :type :reader encoded-value-type
+    :documentation "The thrift type specification of the encoded value.")
+   (octets
+    :initarg :octets :reader encoded-value-octets
+    :type (simple-array (unsigned-byte 8) (*))
+    :documentation "The value's binary protocol encoding, exclusive of any field header.")
+   (package
+    :initform *package* :initarg :package :reader encoded-value-package
+    :documentation "The package in which to resolve the type's struct and enum names.")
+   (value
+    :reader encoded-value-value
+    :documentation "The decoded value, cached for protocols other than the binary protocol."))
+  (:documentation "A value of a struct or container type, serialized in advance. Wherever the
+ codec operators write a value of that type, they write the octets verbatim in its place.
+ The generator emits the encodings of compound constants, which are available through
+ constant-encoded-value."))
+
+
 
 ;;;
 ;;; protocol operators
@@ -357,6 +385,15 @@
         (stream-read-field-end protocol)
         (values field-value identifier idnr)))))
 
+;;; a binary value may be read as a view into the transport's buffer, in order that large values
+;;; pass through without a copy, or spilled to a file. The base methods read a fresh vector.
+
+(defmethod stream-read-binary-view ((protocol protocol))
+  (stream-read-binary protocol))
+
+(defmethod stream-read-binary-spill ((protocol protocol))
+  (stream-read-binary protocol))
+
 ;;; a compiler macro would find no use, since the macro expansion for reading a struct already
 ;;; incorporates dispatches on field id to an inline-able call stream-read-value-as, while stream-read-field
 ;;; never itself knows the type at compile time.
@@ -373,10 +410,11 @@
 
 (defmethod stream-read-struct-end ((protocol protocol)))
 
-(defmethod stream-read-struct ((protocol protocol) &optional expected-type)
+(defmethod stream-read-struct ((protocol protocol) &optional expected-type instance)
   "Interpret an encoded structure as either an expcetion or a struct depending on the specified class.
  Decode each field in turn. When decoding exceptions, build the initargs list and construct it as the
- last step. Otherwise allocate an instacen and bind each value in succession.
+ last step. Otherwise allocate an instacen, or use the given INSTANCE, which should be reset, and
+ bind each value in succession.
  Should the field fail to correspond to a known slot, delegate unknown-field to the class for a field
  defintion. If it supplies none, then resort to the class."
   
@@ -416,21 +454,42 @@
                            (t
                             (unknown-field protocol id name field-type value)))))))
           (t
-           (let* ((instance (allocate-instance class))
+           (let* ((instance (or instance (allocate-struct class)))
                   (fields (class-field-definitions class))
+                  (seen 0)
                   (fd nil))
              (loop (multiple-value-bind (value name id field-type)
                                         (stream-read-field protocol)
                      (cond ((eq field-type 'stop)
                             (stream-read-struct-end protocol)
+                            (check-required-fields protocol type fields seen)
                             (return instance))
-                           ((setf fd (or (find id fields :key #'field-definition-identifier-number :test #'eql)
+                           ((setf fd (or (loop for field in fields
+                                               for bit of-type fixnum from 0
+                                               when (eql id (field-definition-identifier-number field))
+                                               do (setf seen (logior seen (ash 1 bit)))
+                                               and return field)
                                          (unknown-field class id name field-type value)))
                             (setf (slot-value instance (field-definition-name fd))
-                                  value))
+                                  (let ((typedef (field-definition-typedef fd)))
+                                    (if typedef (typedef-value typedef value) value))))
                            (t
                             (unknown-field protocol id name field-type value))))))))))
 
+(defgeneric stream-read-struct-into (protocol instance)
+  (:documentation "Reset the struct INSTANCE and decode the next struct of its type into it.")
+
+  (:method ((protocol protocol) (instance thrift-object))
+    (stream-read-struct protocol (class-name (class-of instance)) (reset-struct instance))))
+
+(defun check-required-fields (protocol type fields seen)
+  "Given the bit mask of the SEEN FIELDS, by position, signal for the first required field
+ which is absent."
+  (loop for fd in fields
+        for bit of-type fixnum from 0
+        when (and (field-definition-required fd) (not (logbitp bit seen)))
+        do (return (missing-required-field protocol type (field-definition-identifier fd)))))
+
 (define-compiler-macro stream-read-struct (&whole form prot &optional type instance &environment env)
   "Iff the type is a constant, compile the decoder inline. If class is not defined, signal an error.
  The intended use is to compile IDL files, for which the code generator and the definition macros
@@ -450,17 +509,25 @@
                                            (loop for fd in field-definitions
                                                  collect `((getf ,initargs ',(field-definition-initarg fd)) nil
                                                            :id ,(field-definition-identifier-number fd)
-                                                           :type ,(field-definition-type fd)))
+                                                           :type ,(field-definition-type fd)
+                                                           :typedef ,(field-definition-typedef fd)
+                                                           :required ,(field-definition-required fd)
+                                                           :representation ,(field-definition-representation fd)
+                                                           :identifier ,(field-definition-identifier fd)))
                                            initargs)
                  (apply #'make-struct ',type ,initargs))
               `(let* ((,initargs nil)
                       (,expected-class (find-thrift-class ',type))
-                      (,struct ,(if instance instance `(allocate-instance ,expected-class))))
+                      (,struct ,(if instance instance `(allocate-struct ,expected-class))))
                  ,(generate-struct-decoder prot expected-class
                                            (loop for fd in field-definitions
                                                  collect `((slot-value ,struct ',(field-definition-name fd)) nil
                                                            :id ,(field-definition-identifier-number fd)
-                                                           :type ,(field-definition-type fd)))
+                                                           :type ,(field-definition-type fd)
+                                                           :typedef ,(field-definition-typedef fd)
+                                                           :required ,(field-definition-required fd)
+                                                           :representation ,(field-definition-representation fd)
+                                                           :identifier ,(field-definition-identifier fd)))
                                            initargs)
                  (when ,initargs
                    (apply #'reinitialize-instance ,struct ,initargs))
@@ -517,6 +584,35 @@
       (values name type-name sequence))))
 
 
+(defmethod stream-read-message-begin-octets ((protocol encoded-protocol))
+  "Read a message header as per stream-read-message-begin, but leave the message identifier
+ encoded in the protocol's name buffer.
+ PROTOCOL : protocol
+ VALUES = (simple-array (unsigned-byte 8) (*)) : the name buffer
+        = fixnum : the identifier's octet length
+        = symbol : the message type
+        = i32 : sequence number"
+
+  (let* ((id (logand (stream-read-i08 protocol) #xff))
+         (ver (logand (stream-read-i08 protocol) #xff))
+         (type-name (stream-read-message-type protocol)))
+    (unless (and (= (protocol-version-id protocol) id) (= (protocol-version-number protocol) ver))
+      (invalid-protocol-version protocol id ver))
+    (let ((length (stream-read-i32 protocol))
+          (buffer (protocol-message-name-buffer protocol)))
+      (when (minusp length)
+        (invalid-field-size protocol 0 "message identifier" 'string length))
+      (when (or (null buffer) (< (length buffer) length))
+        (setf buffer (setf (protocol-message-name-buffer protocol)
+                           (make-array (max length 64) :element-type '(unsigned-byte 8)))))
+      (stream-read-sequence (protocol-input-transport protocol) buffer 0 length)
+      (values buffer length type-name (stream-read-i32 protocol)))))
+
+(defun message-name-string (protocol octets length)
+  "Decode the message identifier from the first LENGTH OCTETS."
+  (funcall (transport-string-decoder protocol) (subseq octets 0 length)))
+
+
 (defmethod stream-read-message ((protocol protocol))
   "Perform a generic 'read' of a complete message.
  PROTOCOL : protocol
@@ -541,6 +637,9 @@
 
 (defmethod stream-read-message-end ((protocol protocol)))
 
+(defmethod stream-read-message-end :after ((protocol protocol))
+  (transport-release-buffers (protocol-input-transport protocol)))
+
 
 
 (defmethod stream-read-map-begin ((protocol protocol))
@@ -658,20 +757,24 @@
 
 
 (defmethod stream-read-enum ((protocol protocol) type)
-  "Read an i32 and verify type"
+  "Read an i32 and verify it with the enum's validator."
   (let ((value (stream-read-i32 protocol)))
-    (unless (typep value type)
+    (unless (enum-value-p type value)
       (invalid-enum protocol type value))
     value))
 
-(define-compiler-macro stream-read-enum (&whole form prot type)
+(define-compiler-macro stream-read-enum (&whole form prot type &environment env)
+  "Given a constant type for a defined enum, call its inline validator."
   (expand-iff-constant-types (type) form
-    #+thrift-check-types
-    `(let ((value (stream-read-i32 ,prot)))
-       (unless (typep value ',type)
-         (invalid-enum protocol ',type value))
-       value)
-    `(stream-read-i32 ,prot)))
+    (let ((validator (when (symbolp type) (enum-function-name type :-value-p))))
+      (if (and validator (fboundp validator))
+        (with-gensyms (value)
+          (with-optional-gensyms (prot) env
+            `(let ((,value (stream-read-i32 ,prot)))
+               (unless (,validator ,value)
+                 (invalid-enum ,prot ',type ,value))
+               ,value)))
+        form))))
 
 
 (defgeneric stream-read-value-as (protocol type)
@@ -684,7 +787,7 @@
       (thrift:list (stream-read-list protocol (str-sym (second type))))
       (thrift:set (stream-read-set protocol (str-sym (second type))))
       (struct (stream-read-struct protocol (str-sym (second type))))
-      (enum (stream-read-map protocol (str-sym (second type))))))
+      (enum (stream-read-enum protocol (str-sym (second type))))))
 
   (:method ((protocol protocol) (type-code (eql 'bool)))
     (stream-read-bool protocol))
@@ -697,7 +800,7 @@
     (stream-read-i16 protocol))
   (:method ((protocol protocol) (type-code (eql 'enum)))
     ;; as a fall-back
-    (stream-read-i16 protocol))
+    (stream-read-i32 protocol))
   (:method ((protocol protocol) (type-code (eql 'i32)))
     (stream-read-i32 protocol))
   (:method ((protocol protocol) (type-code (eql 'i64)))
@@ -899,6 +1002,8 @@
              (list                      ;  allow s-exp encoded structs
               (let ((type ',type))
                 (stream-write-struct ,prot ,value type)))
+             (encoded-value
+              (stream-write-encoded-value ,prot ,value))
              (t
               (assert (typep ,value ',type) ()
                       "Attempt to serialize ~s as ~s." ,value ',type)))))))))
@@ -937,6 +1042,9 @@
 (defmethod stream-write-message-end ((protocol protocol))
   (stream-force-output (protocol-output-transport protocol)))
 
+(defmethod stream-write-message-end :after ((protocol protocol))
+  (transport-release-buffers (protocol-output-transport protocol)))
+
 
 (defgeneric stream-write-exception (protocol exception)
   (:method ((protocol protocol) (exception thrift-error))
@@ -968,16 +1076,40 @@
                     (stream-write-value-as protocol element-value value-type)))
     (stream-write-map-end protocol)))
 
+(defmethod stream-write-map ((protocol protocol) (value hash-table) &optional key-type value-type)
+  (let ((size (map-size value)))
+    (unless (and key-type value-type)
+      (block :first-entry
+        (maphash #'(lambda (element-key element-value)
+                     (unless key-type (setf key-type (thrift:type-of element-key)))
+                     (unless value-type (setf value-type (thrift:type-of element-value)))
+                     (return-from :first-entry))
+                 value)))
+    (stream-write-map-begin protocol key-type value-type size)
+    (maphash #'(lambda (element-key element-value)
+                 (stream-write-value-as protocol element-key key-type)
+                 (stream-write-value-as protocol element-value value-type))
+             value)
+    (stream-write-map-end protocol)))
+
 (define-compiler-macro stream-write-map (&whole form prot value &optional key-type value-type &environment env)
   (expand-iff-constant-types (key-type value-type) form
     (with-optional-gensyms (prot value) env
-      `(let ((size (map-size ,value)))
-         ;; nb. no need to check size as the map size is constrained by array size limits.
-         (stream-write-map-begin ,prot ',key-type ',value-type size)
-         (loop for (element-key . element-value) in ,value
-               do (progn (stream-write-value-as ,prot element-key ',key-type)
-                         (stream-write-value-as ,prot element-value ',value-type)))
-         (stream-write-map-end ,prot)))))
+      `(if (typep ,value 'encoded-value)
+         (stream-write-encoded-value ,prot ,value)
+         (let ((size (map-size ,value)))
+           ;; nb. no need to check size as the map size is constrained by array size limits.
+           (stream-write-map-begin ,prot ',key-type ',value-type size)
+           (flet ((write-entry (element-key element-value)
+                    (stream-write-value-as ,prot element-key ',key-type)
+                    (stream-write-value-as ,prot element-value ',value-type)))
+             (declare (dynamic-extent #'write-entry))
+             (if (listp ,value)
+               (loop for (element-key . element-value) in ,value
+                     do (write-entry element-key element-value))
+               ;; a constant map
+               (maphash #'write-entry ,value)))
+           (stream-write-map-end ,prot))))))
 
 
 
@@ -997,17 +1129,35 @@
       (stream-write-value-as protocol elt type))
     (stream-write-list-end protocol)))
 
+(defmethod stream-write-list ((protocol protocol) (value vector) &optional
+                              (type (if (plusp (length value)) (thrift:type-of (aref value 0))
+                                        (error "The element type is required."))))
+  "A packed array typedef represents a list as a specialized vector."
+  (let ((size (length value)))
+    (unless (typep size 'field-size)
+      (invalid-field-size protocol 0 "" 'field-size size))
+    (stream-write-list-begin protocol type size)
+    (loop for elt across value
+          do (stream-write-value-as protocol elt type))
+    (stream-write-list-end protocol)))
+
 (define-compiler-macro stream-write-list (&whole form prot value &optional element-type &environment env)
   (expand-iff-constant-types (element-type) form
     (with-optional-gensyms (prot value) env
-      `(let ((size (list-length ,value)))
-         (unless (typep size 'field-size)
-           (invalid-field-size ,prot 0 "" 'field-size size))
-         (stream-write-list-begin ,prot ',element-type size)
-         (dolist (element ,value)
-           #+thrift-check-types (assert (typep element ',element-type))
-           (stream-write-value-as ,prot element ',element-type))
-         (stream-write-list-end ,prot)))))
+      `(if (typep ,value 'encoded-value)
+         (stream-write-encoded-value ,prot ,value)
+         (let ((size (if (listp ,value) (list-length ,value) (length ,value))))
+           (unless (typep size 'field-size)
+             (invalid-field-size ,prot 0 "" 'field-size size))
+           (stream-write-list-begin ,prot ',element-type size)
+           (flet ((write-element (element)
+                    #+thrift-check-types (assert (typep element ',element-type))
+                    (stream-write-value-as ,prot element ',element-type)))
+             (declare (inline write-element))
+             (if (listp ,value)
+               (dolist (element ,value) (write-element element))
+               (loop for element across ,value do (write-element element))))
+           (stream-write-list-end ,prot))))))
 
 
 
@@ -1028,17 +1178,77 @@
       (stream-write-value-as protocol element type))
     (stream-write-set-end protocol)))
 
+(defmethod stream-write-set ((protocol protocol) (value vector) &optional
+                             (type (if (plusp (length value)) (thrift:type-of (aref value 0))
+                                       (error "The element type is required."))))
+  (let ((size (length value)))
+    (unless (typep size 'field-size)
+      (invalid-field-size protocol 0 "" 'field-size size))
+    (stream-write-set-begin protocol type size)
+    (loop for element across value
+          do (stream-write-value-as protocol element type))
+    (stream-write-set-end protocol)))
+
 (define-compiler-macro stream-write-set (&whole form prot value &optional element-type &environment env)
   (expand-iff-constant-types (element-type) form
     (with-optional-gensyms (prot value) env
-    `(let ((size (list-length ,value)))
-       (unless (typep size 'field-size)
-         (invalid-field-size ,prot 0 "" 'field-size size))
-       (stream-write-set-begin ,prot ',element-type size)
-       (dolist (element ,value)
-         #+thrift-check-types (assert (typep element ',element-type))
-         (stream-write-value-as ,prot element ',element-type))
-       (stream-write-set-end ,prot)))))
+    `(if (typep ,value 'encoded-value)
+       (stream-write-encoded-value ,prot ,value)
+       (let ((size (if (listp ,value) (list-length ,value) (length ,value))))
+         (unless (typep size 'field-size)
+           (invalid-field-size ,prot 0 "" 'field-size size))
+         (stream-write-set-begin ,prot ',element-type size)
+         (flet ((write-element (element)
+                  #+thrift-check-types (assert (typep element ',element-type))
+                  (stream-write-value-as ,prot element ',element-type)))
+           (declare (inline write-element))
+           (if (listp ,value)
+             (dolist (element ,value) (write-element element))
+             (loop for element across ,value do (write-element element))))
+         (stream-write-set-end ,prot))))))
+
+
+
+;;; pre-encoded values
+
+(defmethod stream-write-struct ((protocol protocol) (value encoded-value) &optional type)
+  (declare (ignore type))
+  (stream-write-encoded-value protocol value))
+
+(defmethod stream-write-map ((protocol protocol) (value encoded-value) &optional key-type value-type)
+  (declare (ignore key-type value-type))
+  (stream-write-encoded-value protocol value))
+
+(defmethod stream-write-list ((protocol protocol) (value encoded-value) &optional type)
+  (declare (ignore type))
+  (stream-write-encoded-value protocol value))
+
+(defmethod stream-write-set ((protocol protocol) (value encoded-value) &optional type)
+  (declare (ignore type))
+  (stream-write-encoded-value protocol value))
+
+(defmethod stream-write-encoded-value ((protocol protocol) (value encoded-value))
+  "The octets are a binary protocol encoding. Other protocols write the decoded value."
+  (let ((*package* (encoded-value-package value)))
+    (stream-write-value-as protocol (encoded-value-value value) (encoded-value-type value))))
+
+(defmethod slot-unbound ((class t) (instance encoded-value) (slot-name (eql 'value)))
+  (setf (slot-value instance 'value)
+        (let ((*package* (encoded-value-package instance)))
+          (stream-read-value-as (make-instance 'binary-protocol
+                                  :transport (make-instance 'vector-stream-transport
+                                               :vector (encoded-value-octets instance))
+                                  :direction :input)
+                                (encoded-value-type instance)))))
+
+(defun make-encoded-value (type octets)
+  (make-instance 'encoded-value :type type
+                 :octets (coerce octets '(simple-array (unsigned-byte 8) (*)))))
+
+(defun constant-encoded-value (name)
+  "Return the encoded-value which def-constant recorded for the constant NAME, a symbol or
+ the constant's identifier."
+  (get (etypecase name (symbol name) (string (str-sym name))) 'encoded-value))
 
 
 
@@ -1086,10 +1296,10 @@
     (stream-write-i16 protocol value))
   (:method ((protocol protocol) (value integer) (type (eql 'enum)))
     ;; as a fall-back
-    (stream-write-i16 protocol value))
+    (stream-write-i32 protocol value))
   (:method ((protocol protocol) (value integer) (type cons))
-    ;; as a fall-back
-    (stream-write-i16 protocol value))
+    ;; an enum
+    (stream-write-i32 protocol value))
   (:method ((protocol protocol) (value integer) (type (eql 'i32)))
     (stream-write-i32 protocol value))
   (:method ((protocol protocol) (value integer) (type (eql 'i64)))
@@ -1110,6 +1320,13 @@
     (stream-write-binary protocol (symbol-name value)))
   (:method ((protocol protocol) (value vector) (type (eql 'binary)))
     (stream-write-binary protocol value))
+  (:method ((protocol protocol) (value pathname) (type (eql 'binary)))
+    (stream-write-binary protocol value))
+  (:method ((protocol protocol) (value stream) (type (eql 'binary)))
+    (stream-write-binary protocol value))
+
+  (:method ((protocol protocol) (value encoded-value) (type t))
+    (stream-write-encoded-value protocol value))
 
   (:method ((protocol protocol) (value thrift-object) (type (eql 'struct)))
     (stream-write-struct protocol value))
@@ -1120,6 +1337,10 @@
 
   (:method ((protocol protocol) (value list) (type (eql 'thrift:map)))
     (stream-write-map protocol value))
+  (:method ((protocol protocol) (value hash-table) (type (eql 'thrift:map)))
+    (stream-write-map protocol value))
+  (:method ((protocol protocol) (value hash-table) (type cons))
+    (stream-write-map protocol value (str-sym (second type)) (str-sym (third type))))
   (:method ((protocol protocol) (value list) (type (eql 'thrift:list)))
     (stream-write-list protocol value))
   (:method ((protocol protocol) (value list) (type (eql 'thrift:set)))
@@ -1129,7 +1350,11 @@
       (ecase type
         (thrift:list (stream-write-list protocol value (str-sym t1)))
         (thrift:set (stream-write-set protocol value (str-sym t1)))
-        (thrift:map (stream-write-map protocol value (str-sym t1) (str-sym t2)))))))
+        (thrift:map (stream-write-map protocol value (str-sym t1) (str-sym t2))))))
+  (:method ((protocol protocol) (value vector) (type cons))
+    (ecase (first type)
+      (thrift:list (stream-write-list protocol value (str-sym (second type))))
+      (thrift:set (stream-write-set protocol value (str-sym (second type)))))))
 
 
 (define-compiler-macro stream-write-value-as (&whole form protocol value type)
@@ -1160,7 +1385,7 @@
     (struct-type
      `(stream-write-struct ,protocol ,value ',(str-sym (second type))))
     (enum-type
-     `(stream-write-i16 ,protocol ,value))))
+     `(stream-write-i32 ,protocol ,value))))
 
 
 (defgeneric stream-write-typed-value (protocol value)
@@ -1201,6 +1426,15 @@
     nil))
 
 
+(defgeneric missing-required-field (protocol structure-type field-name)
+  (:documentation "Called when a decoded struct lacks a field which its type declares required.
+ The base method for binary protocols signals a required-field-error")
+
+  (:method ((protocol protocol) (structure-type t) (name t))
+    (error 'required-field-error :protocol protocol
+           :structure-type structure-type :name name)))
+
+
 (defgeneric invalid-field-size (protocol field-id field-name expected-type size)
   (:documentation "Called when a read structure field exceeds the dimension limit.
  The base method for binary protocols signals a field-size-error")
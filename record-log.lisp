@@ -0,0 +1,455 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: org.apache.thrift.implementation; -*-
+
+(in-package :org.apache.thrift.implementation)
+
+;;; This file implements an indexed record log for the `org.apache.thrift` library.
+;;;
+;;; Licensed to the Apache Software Foundation (ASF) under one
+;;; or more contributor license agreements. See the NOTICE file
+;;; distributed with this work for additional information
+;;; regarding copyright ownership. The ASF licenses this file
+;;; to you under the Apache License, Version 2.0 (the
+;;; "License"); you may not use this file except in compliance
+;;; with the License. You may obtain a copy of the License at
+;;;
+;;;   http://www.apache.org/licenses/LICENSE-2.0
+;;;
+;;; Unless required by applicable law or agreed to in writing,
+;;; software distributed under the License is distributed on an
+;;; "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+;;; KIND, either express or implied. See the License for the
+;;; specific language governing permissions and limitations
+;;; under the License.
+
+
+;;; A record log is a file of binary encoded structs, each framed with its length and a crc-32,
+;;; together with a sidecar index of record offsets, so that a reader can start at any record
+;;; without decoding its predecessors. All integers are big-endian.
+;;;
+;;;   log    ::= header (record | sync)*
+;;;   header ::= "TRLG" version:u8 marker:16*u8
+;;;   record ::= length:u32 crc:u32 payload:length*u8
+;;;   sync   ::= #xffffffff marker:16*u8
+;;;
+;;; The marker is random per file. A writer emits a sync block every sync-interval records, and
+;;; whenever it opens an existing log, so that a scan which meets a damaged record, eg. the torn
+;;; tail of a crashed writer, can resume at the next sync block. The index, <log>.idx, holds the
+;;; offset of record n as a u64 at position 8n, and is written after each record. Opening a log
+;;; reads the index, checks its last entry against the log and scans the log past that entry for
+;;; records which the index lacks. If the last entry is not intact, the index is rebuilt from a scan
+;;; of the whole log.
+;;;
+;;;  * open-record-log, close-record-log, with-record-log : open a log for :input, or for :output
+;;;    to append to it
+;;;  * record-log-append : append a struct and return its record number
+;;;  * record-log-count : the number of records
+;;;  * record-log-offset : the file offset of record n
+;;;  * record-log-read : decode record n
+;;;  * map-record-log : call a function with each record in a range of record numbers
+;;;  * record-log-bisect : find the first record whose key is not less than a value, given records
+;;;    in key order
+;;;  * record-log-refresh : index the records which a writer has appended since the log was opened
+;;;  * record-log-flush : force the log and the index to the file system
+;;;
+;;; A damaged record signals a record-log-error, for which map-record-log provides a skip-record
+;;; restart. Binary views in a decoded record remain valid until the next read from the log.
+
+
+(defparameter *record-log-sync-interval* 64
+  "The number of records between the sync blocks which a record log writer emits.")
+
+(defconstant +record-log-version+ 1)
+(defconstant +record-log-sync-length+ #xffffffff)
+(defconstant +record-log-header-size+ 21)
+
+(defvar *record-log-magic*
+  (make-array 4 :element-type '(unsigned-byte 8) :initial-contents (cl:map 'cl:list #'char-code "TRLG")))
+
+
+(defvar *crc32-table*
+  (let ((table (make-array 256 :element-type '(unsigned-byte 32))))
+    (dotimes (n 256 table)
+      (let ((c n))
+        (dotimes (k 8)
+          (setf c (if (logbitp 0 c) (logxor #xedb88320 (ash c -1)) (ash c -1))))
+        (setf (aref table n) c)))))
+
+(defun crc32 (octets &optional (start 0) (end (length octets)))
+  "Return the crc-32 (ieee 802.3) of the OCTETS between START and END."
+  (declare (type (simple-array (unsigned-byte 8) (*)) octets)
+           (type fixnum start end))
+  (let ((table *crc32-table*)
+        (crc #xffffffff))
+    (declare (type (simple-array (unsigned-byte 32) (256)) table)
+             (type (unsigned-byte 32) crc))
+    (loop for index from start below end
+          do (setf crc (logxor (aref table (logand (logxor crc (aref octets index)) #xff))
+                               (ash crc -8))))
+    (logxor crc #xffffffff)))
+
+
+(defclass record-log ()
+  ((pathname
+    :initarg :pathname :initform (error "pathname is required.")
+    :reader record-log-pathname)
+   (direction
+    :initarg :direction :initform :input
+    :reader record-log-direction
+    :type (member :input :output))
+   (type
+    :initarg :type :initform nil
+    :reader record-log-type
+    :documentation "The struct type of the records, which reading requires.")
+   (sync-interval
+    :initarg :sync-interval :initform *record-log-sync-interval*
+    :reader record-log-sync-interval)
+   (stream :initform nil :reader record-log-stream)
+   (index-stream
+    :initform nil :reader record-log-index-stream
+    :documentation "For output, the stream to which the index entries are appended.")
+   (marker :reader record-log-marker)
+   (offsets
+    :initform (make-array 64 :adjustable t :fill-pointer 0)
+    :reader record-log-offsets
+    :documentation "The offset of each record, read from the index and extended by appends and scans.")
+   (end
+    :initform +record-log-header-size+ :accessor record-log-end
+    :documentation "The offset which follows the last valid block.")
+   (unsynced
+    :initform 0 :accessor record-log-unsynced
+    :documentation "The number of records appended since the last sync block.")
+   (buffer
+    :initform (make-array 1024 :element-type '(unsigned-byte 8))
+    :accessor record-log-buffer
+    :documentation "The buffer into which records are read.")
+   (protocol :reader record-log-protocol))
+  (:documentation "An open record log file together with its offset index."))
+
+
+;;;
+;;; integer codecs
+
+(defun read-u32 (stream)
+  "Read a big-endian u32 from the octet STREAM, or return nil at its end."
+  (let ((buffer (make-array 4 :element-type '(unsigned-byte 8))))
+    (declare (dynamic-extent buffer))
+    (when (= (read-sequence buffer stream) 4)
+      (logior (ash (aref buffer 0) 24) (ash (aref buffer 1) 16) (ash (aref buffer 2) 8) (aref buffer 3)))))
+
+(defun write-u32 (value stream)
+  (let ((buffer (make-array 4 :element-type '(unsigned-byte 8))))
+    (declare (dynamic-extent buffer))
+    (loop for index from 0
+          for shift from 24 downto 0 by 8
+          do (setf (aref buffer index) (ldb (byte 8 shift) value)))
+    (write-sequence buffer stream)
+    value))
+
+(defun read-u64 (stream)
+  "Read a big-endian u64 from the octet STREAM, or return nil at its end."
+  (let ((high (read-u32 stream))
+        (low (read-u32 stream)))
+    (when (and high low)
+      (logior (ash high 32) low))))
+
+(defun write-u64 (value stream)
+  (write-u32 (ldb (byte 32 32) value) stream)
+  (write-u32 (ldb (byte 32 0) value) stream)
+  value)
+
+
+;;;
+;;; files
+
+(defun record-log-index-pathname (pathname)
+  "Return the pathname of the index for the log at PATHNAME: its name with .idx appended."
+  (let ((pathname (pathname pathname)))
+    (make-pathname :type (if (pathname-type pathname)
+                           (concatenate 'string (pathname-type pathname) ".idx")
+                           "idx")
+                   :defaults pathname)))
+
+(defun record-log-write-header (stream)
+  "Write a log header with a new random sync marker, and return the marker."
+  (let ((marker (make-array 16 :element-type '(unsigned-byte 8)))
+        (state (make-random-state t)))
+    (dotimes (index 16)
+      (setf (aref marker index) (random 256 state)))
+    (write-sequence *record-log-magic* stream)
+    (write-byte +record-log-version+ stream)
+    (write-sequence marker stream)
+    marker))
+
+(defun record-log-read-header (stream pathname)
+  "Read and check the log header, and return its sync marker."
+  (let ((header (make-array +record-log-header-size+ :element-type '(unsigned-byte 8))))
+    (file-position stream 0)
+    (unless (and (= (read-sequence header stream) +record-log-header-size+)
+                 (equalp (subseq header 0 4) *record-log-magic*)
+                 (= (aref header 4) +record-log-version+))
+      (error 'record-log-error :pathname pathname :offset 0 :message "Invalid record log header"))
+    (subseq header 5)))
+
+
+(defmethod initialize-instance :after ((log record-log) &key)
+  (with-slots (pathname direction stream index-stream marker offsets end buffer protocol) log
+    (setf stream (ecase direction
+                   (:input (open pathname :direction :input :element-type '(unsigned-byte 8)))
+                   (:output (open pathname :direction :io :element-type '(unsigned-byte 8)
+                                  :if-exists :overwrite :if-does-not-exist :create))))
+    (setf protocol (make-instance 'binary-protocol
+                     :transport (make-instance 'vector-stream-transport :vector buffer)
+                     :direction :input))
+    (let ((complete nil)
+          (aligned nil))
+      (unwind-protect
+        (progn
+          (cond ((zerop (file-length stream))
+                 (assert (eq direction :output) ()
+                         "The record log is empty: ~a." pathname)
+                 (setf marker (record-log-write-header stream)
+                       end (file-position stream)))
+                (t
+                 (setf marker (record-log-read-header stream pathname)
+                       aligned (record-log-read-index log))))
+          (let* ((confirmed (record-log-recover log))
+                 ;; the count of index entries which can remain in place
+                 (indexed (when aligned confirmed)))
+            (when (eq direction :output)
+              (setf index-stream (open (record-log-index-pathname pathname)
+                                       :direction :output :element-type '(unsigned-byte 8)
+                                       :if-exists (if indexed :append :supersede)
+                                       :if-does-not-exist :create))
+              (loop for index from (or indexed 0) below (fill-pointer offsets)
+                    do (write-u64 (aref offsets index) index-stream))
+              (when (> (file-length stream) +record-log-header-size+)
+                ;; resume after any torn tail
+                (file-position stream (file-length stream))
+                (record-log-write-sync log))))
+          (setf complete t))
+        (unless complete
+          (close stream :abort t)
+          (when index-stream (close index-stream :abort t)))))))
+
+(defun open-record-log (pathname &rest initargs &key direction type sync-interval)
+  "Open the record log at PATHNAME. DIRECTION is :input, the default, or :output, to append to
+ the log, which is created if it does not exist. TYPE names the records' struct type."
+  (declare (ignore direction type sync-interval))
+  (apply #'make-instance 'record-log :pathname pathname initargs))
+
+(defun close-record-log (log)
+  (with-slots (stream index-stream) log
+    (when index-stream
+      (record-log-flush log)
+      (close (shiftf index-stream nil)))
+    (when stream
+      (close (shiftf stream nil))))
+  log)
+
+(defmacro with-record-log ((log pathname &rest args) &body body)
+  (with-gensyms (op)
+    `(flet ((,op (,log) ,@body))
+       (declare (dynamic-extent #',op))
+       (call-with-record-log #',op ,pathname ,@args))))
+
+(defun call-with-record-log (op pathname &rest args)
+  (declare (dynamic-extent args))
+  (let ((log (apply #'open-record-log pathname args)))
+    (unwind-protect (funcall op log)
+      (close-record-log log))))
+
+
+;;;
+;;; blocks
+
+(defun record-log-read-block (log offset)
+  "Read the block at OFFSET. Return its kind, :record, :sync, :damaged or :end, and the offset
+ which follows it. A record's payload is left in the log's buffer."
+  (with-slots (stream marker buffer) log
+    (file-position stream offset)
+    (let ((length (read-u32 stream)))
+      (cond ((null length)
+             (values :end offset))
+            ((= length +record-log-sync-length+)
+             (let ((sync (make-array 16 :element-type '(unsigned-byte 8))))
+               (declare (dynamic-extent sync))
+               (if (and (= (read-sequence sync stream) 16) (equalp sync marker))
+                 (values :sync (+ offset 20))
+                 (values :damaged offset))))
+            ((> (+ offset 8 length) (file-length stream))
+             (values :damaged offset))
+            (t
+             (let ((crc (read-u32 stream)))
+               (when (< (length buffer) length)
+                 (setf buffer (make-array (max length (* 2 (length buffer)))
+                                          :element-type '(unsigned-byte 8))))
+               (read-sequence buffer stream :end length)
+               (if (= crc (crc32 buffer 0 length))
+                 (values :record (+ offset 8 length))
+                 (values :damaged offset))))))))
+
+(defun record-log-resync (stream marker)
+  "Advance the STREAM past the next occurrence of the sync MARKER. Return true if there is one,
+ and otherwise nil, at the end of the stream."
+  (let ((matched 0))
+    (loop (let ((byte (read-byte stream nil nil)))
+            (cond ((null byte)
+                   (return nil))
+                  ((= byte (aref marker matched))
+                   (when (= (incf matched) 16)
+                     (return t)))
+                  (t
+                   ;; restart the match. a partial match within the random marker is improbable
+                   ;; enough that it need not be reconsidered.
+                   (setf matched (if (= byte (aref marker 0)) 1 0))))))))
+
+(defun record-log-scan (log start)
+  "Scan the log from the offset START, add the offset of each intact record to the log's offsets,
+ and resume after the next sync block at a damaged one. Return the offset which follows the last
+ valid block."
+  (with-slots (stream marker offsets) log
+    (let ((offset start)
+          (end start))
+      (loop (multiple-value-bind (kind next) (record-log-read-block log offset)
+              (ecase kind
+                (:record
+                 (vector-push-extend offset offsets)
+                 (setf offset next end next))
+                (:sync
+                 (setf offset next end next))
+                (:end
+                 (return end))
+                (:damaged
+                 (file-position stream (1+ offset))
+                 (if (record-log-resync stream marker)
+                   (setf offset (file-position stream))
+                   (return end)))))))))
+
+(defun record-log-read-index (log)
+  "Read the offsets from the index file, if it exists. Return false if the file ends with a
+ partial entry, in which case it must be rewritten rather than appended to."
+  (with-open-file (index (record-log-index-pathname (record-log-pathname log))
+                         :element-type '(unsigned-byte 8) :if-does-not-exist nil)
+    (if index
+      (let ((offsets (record-log-offsets log)))
+        (multiple-value-bind (count remainder) (floor (file-length index) 8)
+          (loop repeat count
+                do (vector-push-extend (read-u64 index) offsets))
+          (zerop remainder)))
+      t)))
+
+(defun record-log-recover (log)
+  "Check the last indexed record and scan the log past it. If it is not intact, discard the
+ offsets and scan the whole log. Return the count of offsets which were confirmed, or nil if
+ they were discarded."
+  (with-slots (offsets end) log
+    (let* ((count (fill-pointer offsets))
+           (last-end (when (plusp count)
+                       (multiple-value-bind (kind next)
+                                            (record-log-read-block log (aref offsets (1- count)))
+                         (when (eq kind :record) next)))))
+      (cond ((or last-end (zerop count))
+             (setf end (record-log-scan log (or last-end end)))
+             count)
+            (t
+             (setf (fill-pointer offsets) 0)
+             (setf end (record-log-scan log +record-log-header-size+))
+             nil)))))
+
+
+;;;
+;;; output
+
+(defun record-log-write-sync (log)
+  (with-slots (stream marker end unsynced) log
+    (write-u32 +record-log-sync-length+ stream)
+    (write-sequence marker stream)
+    (setf end (file-position stream)
+          unsynced 0)))
+
+(defun record-log-append (log value &optional (type (or (record-log-type log) (type-of value))))
+  "Append the struct VALUE to the log and its index, and return its record number. The record is
+ written to the file system when the log is flushed or closed."
+  (with-slots (direction stream index-stream offsets end unsynced sync-interval) log
+    (assert (eq direction :output) () "The record log is not open for output: ~a." log)
+    (file-position stream end)
+    (when (>= unsynced sync-interval)
+      (record-log-write-sync log))
+    (let ((offset end))
+      (with-encoded-struct ((octets length) value type)
+        (write-u32 length stream)
+        (write-u32 (crc32 octets 0 length) stream)
+        (write-sequence octets stream :end length))
+      ;; the index entry follows the record, so that a crash leaves it short rather than invalid
+      (write-u64 offset index-stream)
+      (setf end (file-position stream))
+      (incf unsynced)
+      (vector-push-extend offset offsets)
+      (1- (fill-pointer offsets)))))
+
+(defun record-log-flush (log)
+  "Force the log and then its index to the file system."
+  (with-slots (stream index-stream) log
+    (when index-stream
+      (finish-output stream)
+      (finish-output index-stream))
+    log))
+
+
+;;;
+;;; input
+
+(defun record-log-count (log)
+  (fill-pointer (record-log-offsets log)))
+
+(defun record-log-offset (log number)
+  "Return the file offset of record NUMBER."
+  (let ((offsets (record-log-offsets log)))
+    (assert (< -1 number (fill-pointer offsets)) ()
+            "Invalid record number: ~d, the log has ~d records." number (fill-pointer offsets))
+    (aref offsets number)))
+
+(defun record-log-read (log number &optional (type (record-log-type log)))
+  "Decode and return record NUMBER. A damaged record signals a record-log-error."
+  (let ((offset (record-log-offset log number)))
+    (unless (eq (record-log-read-block log offset) :record)
+      (error 'record-log-error :pathname (record-log-pathname log) :offset offset
+             :message "Damaged record"))
+    (let ((protocol (record-log-protocol log)))
+      (setf (vector-stream-vector (protocol-input-transport protocol)) (record-log-buffer log))
+      (stream-read-struct protocol type))))
+
+(defun map-record-log (function log &key (start 0) (end (record-log-count log)))
+  "Call FUNCTION with each record whose number is between START and END, and its number. For a
+ damaged record, the skip-record restart continues with the next one."
+  (loop for number from start below end
+        do (block :record
+             (funcall function
+                      (restart-case (record-log-read log number)
+                        (skip-record ()
+                          :report "Skip the damaged record."
+                          (return-from :record)))
+                      number)))
+  nil)
+
+(defun record-log-bisect (log value key &key (predicate #'<) (start 0) (end (record-log-count log)))
+  "Given records which are ordered by the KEY function under PREDICATE, return the number of the
+ first record between START and END whose key is not less than VALUE, and that record, or END and
+ nil if there is none. Each step decodes one record."
+  (let ((low start)
+        (high end)
+        (record nil))
+    (loop while (< low high)
+          do (let* ((middle (floor (+ low high) 2))
+                    (candidate (record-log-read log middle)))
+               (if (funcall predicate (funcall key candidate) value)
+                 (setf low (1+ middle))
+                 (setf high middle
+                       record candidate))))
+    (values low (when (< low end) record))))
+
+(defun record-log-refresh (log)
+  "Index the records which follow the last valid block, eg. those which another process appended
+ since the log was opened, and return the record count."
+  (setf (record-log-end log) (record-log-scan log (record-log-end log)))
+  (record-log-count log))
@@ -54,9 +54,23 @@
      just the immediate service is known. This would make the symbols from a single included base service
      visible, but not those of anything which it includes. Only one a method has been identified does its
      its package determine the home package to intern names.")
+   (dispatch-table
+    :initform nil :type (or null simple-vector)
+    :accessor service-dispatch-table
+    :documentation "The methods, indexed by the octet length of their UTF-8 encoded identifier. Each
+     element is null or a vector of #(octets identifier function) entries, in order that a request
+     identifier can be routed as read from the message, without decoding it. A change to the
+     methods clears it, and the next dispatch rebuilds it, in order that defining n methods costs
+     one rebuild rather than n.")
    (documentation
      :initform nil :initarg :documentation
-     :accessor service-documentation))
+     :accessor service-documentation)
+   (statistics
+    :initform nil
+    :accessor service-statistics-table
+    :documentation "When the server is instrumented, an equal hash table which binds each method
+     identifier to its method-statistics. It is replaced rather than modified, in order that
+     concurrent connections can read it without a lock."))
   (:documentation "A named service associates methods with their names. When created with def-service
  each service is bound to a global parameter named as its Lisp equivalent. A service can also
  serve as the root for a set of subsidiary services, to which it defers method look-ups."))
@@ -78,6 +92,12 @@
   (:documentation "The server class which combines services with a listening socket."))
 
 
+(defclass threaded-socket-server (socket-server)
+  ()
+  (:documentation "A socket server which processes each accepted connection in a thread of its own,
+ in order that concurrent clients do not wait for one another."))
+
+
 (defclass thrift (puri:uri)
   ()
   (:documentation "A specialized URI class to distinguish Thrift locations when constructing a
@@ -107,14 +127,69 @@
         (values fun service)
         (dolist (base-service (service-base-services service))
           (multiple-value-bind (fun service)
-                               (method-definition identifier base-service)
+                               (method-definition base-service identifier)
             (when fun (return-from method-definition (values fun service)))))))))
 
 (defgeneric (setf method-definition) (function service identifier)
   (:method ((function thrift-generic-function) (service service) (identifier string))
     (setf (gethash identifier (service-methods service)) function))
+  (:method ((function symbol) (service service) (identifier string))
+    ;; the response function name, as def-service registers it
+    (setf (gethash identifier (service-methods service)) function))
   (:method ((function null) (service service) (identifier string))
-    (remhash identifier (service-methods service))))
+    (remhash identifier (service-methods service)))
+  (:method :after (function (service service) (identifier string))
+    (declare (ignore function))
+    (setf (service-dispatch-table service) nil)))
+
+
+(defun update-dispatch-table (service)
+  "Rebuild the SERVICE's dispatch table from its methods and return it. Methods are defined
+ before the service handles requests, so concurrent rebuilds produce equivalent tables and the
+ last assignment wins without a lock."
+  (let* ((entries (loop for identifier being each hash-key of (service-methods service)
+                        using (hash-value function)
+                        collect (vector (trivial-utf-8:string-to-utf-8-bytes identifier) identifier function)))
+         (table (make-array (1+ (reduce #'max entries :key #'(lambda (entry) (length (svref entry 0)))
+                                        :initial-value -1))
+                            :initial-element nil)))
+    (dolist (entry entries)
+      (push entry (svref table (length (svref entry 0)))))
+    (setf (service-dispatch-table service)
+          (map 'simple-vector #'(lambda (bucket) (when bucket (coerce bucket 'simple-vector))) table))))
+
+(defun dispatch-table-find (table octets length)
+  "Return the function and the identifier from the TABLE entry which matches the first LENGTH
+ OCTETS, if any."
+  (declare (type simple-vector table)
+           (type (simple-array (unsigned-byte 8) (*)) octets)
+           (type fixnum length))
+  (when (< length (length table))
+    (let ((bucket (svref table length)))
+      (when bucket
+        (loop for entry across (the simple-vector bucket)
+              for key = (svref entry 0)
+              when (loop for i of-type fixnum below length
+                         always (= (aref (the (simple-array (unsigned-byte 8) (*)) key) i) (aref octets i)))
+              return (values (svref entry 2) (svref entry 1)))))))
+
+(defgeneric method-dispatch (service octets length)
+  (:documentation "Given the first LENGTH OCTETS of a request message identifier, locate the
+ method through the dispatch tables of the SERVICE and its base services.
+ VALUES : the method's response function, the defining service and the method identifier,
+ or null if no service defines the method.")
+
+  (:method ((service service) octets length)
+    (multiple-value-bind (function identifier)
+                         (dispatch-table-find (or (service-dispatch-table service)
+                                                  (update-dispatch-table service))
+                                              octets length)
+      (if function
+        (values function service identifier)
+        (dolist (base-service (service-base-services service))
+          (multiple-value-bind (function service identifier)
+                               (method-dispatch base-service octets length)
+            (when function (return-from method-dispatch (values function service identifier)))))))))
 
 
 ;;;
@@ -143,16 +218,17 @@
 
 (defparameter *debug-server* t)
 
+(defparameter *instrument-server* nil
+  "When true, process records per-method request counts, sizes, phase latencies and exceptions
+ in the service's statistics. See instrumentation.lisp.")
+
 (defgeneric serve (connection-server service)
   (:documentation "Accept to a CONNECTION-SERVER, configure the CLIENT's transport and protocol
  in combination with the connection, and process messages until the connection closes.")
 
   (:method ((location thrift) service)
     "Given a basic thrift uri, open a binary socket server and listen on the port."
-    (let ((server (make-instance 'socket-server
-                    :socket (usocket:socket-listen (puri:uri-host location) (puri:uri-port location)
-                                                   :element-type 'unsigned-byte
-                                                   :reuseaddress t))))
+    (let ((server (make-socket-server location)))
       (unwind-protect (serve server service)
         (server-close server))))
 
@@ -160,26 +236,62 @@
     (loop 
       (let ((connection (accept-connection s)))
         (if (open-stream-p (usocket:socket-stream connection))
-          (let* ((input-transport (server-input-transport s connection))
-                 (output-transport (server-output-transport s connection))
-                 (protocol (server-protocol s input-transport output-transport)))
-            (unwind-protect (block :process-loop
-                              (handler-bind ((end-of-file (lambda (eof)
-                                                            (declare (ignore eof))
-                                                            (return-from :process-loop)))
-                                             (error (lambda (error)
-                                                      (if *debug-server*
-                                                        (break "Server error: ~s: ~a" s error)
-                                                        (warn "Server error: ~s: ~a" s error))
-                                                      (stream-write-exception protocol error)
-                                                      (return-from :process-loop))))
-                                (loop (unless (open-stream-p input-transport) (return))
-                                      (process service protocol))))
-              (close input-transport)
-              (close output-transport)))
+          (serve-socket-connection s service connection)
           ;; listening socket closed
           (return))))))
 
+
+(defun make-socket-server (location &key (class 'socket-server))
+  "Open a binary socket listening on the LOCATION's host and port and return a server of the
+ given CLASS for it."
+  (make-instance class
+    :socket (usocket:socket-listen (puri:uri-host location) (puri:uri-port location)
+                                   :element-type 'unsigned-byte
+                                   :reuseaddress t)))
+
+
+(defgeneric serve-socket-connection (server service connection)
+  (:documentation "Process the messages on an accepted CONNECTION until it closes.")
+
+  (:method ((s socket-server) (service service) connection)
+    (let* ((input-transport (server-input-transport s connection))
+           (output-transport (server-output-transport s connection))
+           (protocol (server-protocol s input-transport output-transport)))
+      (unwind-protect (serve-connection service protocol)
+        (close input-transport)
+        (close output-transport))))
+
+  (:method ((s threaded-socket-server) (service service) connection)
+    "Process the connection in a new thread, which inherits the server's debug setting."
+    (let ((debug-server *debug-server*))
+      (bt:make-thread #'(lambda ()
+                          (let ((*debug-server* debug-server))
+                            (call-next-method)))
+                      :name (format nil "thrift connection: ~a" (service-identifier service))))))
+
+
+(defun serve-connection (service protocol)
+  "Process messages from the PROTOCOL's input transport until it is closed or reaches end-of-file.
+ An error is reported to the peer as an exception and terminates the connection."
+  (let ((input-transport (protocol-input-transport protocol))
+        ;; bound once per connection. process rebinds it only for methods from a base service
+        ;; with a different package
+        (*package* (service-package service)))
+    ;; a connection thread reuses the buffers of its messages through its own cache
+    (with-octet-buffer-cache ()
+      (block :process-loop
+        (handler-bind ((end-of-file (lambda (eof)
+                                      (declare (ignore eof))
+                                      (return-from :process-loop)))
+                       (error (lambda (error)
+                                (if *debug-server*
+                                  (break "Server error: ~s: ~a" protocol error)
+                                  (warn "Server error: ~s: ~a" protocol error))
+                                (stream-write-exception protocol error)
+                                (return-from :process-loop))))
+          (loop (unless (open-stream-p input-transport) (return))
+                (process service protocol)))))))
+
   
 (defgeneric process (service protocol)
   (:documentation "Combine a service PEER with an input-protocol and an output-protocol to control processing
@@ -192,20 +304,31 @@
     (flet ((consume-message ()
              (prog1 (stream-read-struct protocol)
                (stream-read-message-end protocol))))
-      (multiple-value-bind (request-identifier type sequence-number)
-                           (stream-read-message-begin protocol)
-        (ecase type
-          ((call oneway)
-           (multiple-value-bind (request-method service)
-                                (method-definition service request-identifier)
-             (cond (request-method
-                    (let ((*package* (service-package service)))
-                      (funcall request-method service sequence-number protocol)))
-                   (t
-                    (unknown-method protocol request-identifier sequence-number (consume-message))))))
-          (reply
-           (unexpected-response protocol request-identifier sequence-number (consume-message)))
-          (exception
-           (request-exception protocol request-identifier sequence-number (consume-message))))))))
+      (let ((bytes-read (transport-bytes-read (protocol-input-transport protocol))))
+        ;; the identifier is matched as read, and decoded only in order to report it
+        (multiple-value-bind (name-octets name-length type sequence-number)
+                             (stream-read-message-begin-octets protocol)
+          (flet ((request-identifier ()
+                   (message-name-string protocol name-octets name-length)))
+            (ecase type
+              ((call oneway)
+               (multiple-value-bind (request-method service request-identifier)
+                                    (method-dispatch service name-octets name-length)
+                 (flet ((call-method ()
+                          (if *instrument-server*
+                            (call-instrumented request-method service request-identifier sequence-number
+                                               protocol bytes-read)
+                            (funcall request-method service sequence-number protocol))))
+                   (cond ((null request-method)
+                          (unknown-method protocol (request-identifier) sequence-number (consume-message)))
+                         ((eq *package* (service-package service))
+                          (call-method))
+                         (t
+                          (let ((*package* (service-package service)))
+                            (call-method)))))))
+              (reply
+               (unexpected-response protocol (request-identifier) sequence-number (consume-message)))
+              (exception
+               (request-exception protocol (request-identifier) sequence-number (consume-message))))))))))
 
 
@@ -0,0 +1,24 @@
+/*
+ * Constants whose binary encodings the cl generator embeds, in order to compare them with
+ * the library's binary-protocol encoding of the same values. gen-cl/ConstantEncoding-*.lisp
+ * are generated from this file with: thrift --gen cl -out gen-cl ConstantEncoding.thrift
+ */
+
+namespace cl constant-encoding-test
+
+enum Color {
+  RED = 1,
+  GREEN = 2,
+  BLUE = 300
+}
+
+struct Point {
+  1: i16 x,
+  2: i16 y = -2,
+  3: Color color = Color.GREEN
+}
+
+const Point ORIGIN = {"x": 258}
+const map<i16,Color> PALETTE = {7: Color.BLUE}
+const list<i16> OFFSETS = [1, -1, 4660]
+const map<string,Point> NAMED = {"p": {"x": 1, "color": Color.BLUE}}
@@ -29,14 +29,55 @@
 (test def-enum
   (progn (def-enum "TestEnum" ((first . 1) (second . 2)))
          (prog1 (and (eql (symbol-value 'test-enum.first) 1)
-                     (eql (symbol-value 'test-enum.second) 2)))))
+                     (eql (symbol-value 'test-enum.second) 2)
+                     (funcall 'test-enum-value-p 2)
+                     (not (funcall 'test-enum-value-p 3))
+                     (thrift.implementation::enum-value-p 'test-enum 1)
+                     (not (thrift.implementation::enum-value-p 'test-enum 3))
+                     (equal (funcall 'test-enum-name 1) "FIRST")
+                     (eql (funcall 'test-enum-value "SECOND") 2)
+                     (let ((protocol (make-test-protocol)))
+                       (thrift.implementation::stream-write-value-as protocol 2 '(enum "TestEnum"))
+                       (rewind protocol)
+                       (and (eql (thrift.implementation::stream-read-value-as protocol '(enum "TestEnum")) 2)
+                            (= (thrift.implementation::stream-position protocol) 4)))))))
 ;;; (run-tests "def-enum")
 
+(test def-enum.validation-form
+  ;; a positive contiguous range reduces to a bounds test
+  (let ((bounds (thrift.implementation::enum-validation-form 'value '(10 11 12)))
+        (sparse (thrift.implementation::enum-validation-form 'value '(1 2 1000))))
+    (and (equal bounds '(and (typep value 'fixnum) (<= 10 value 12)))
+         (eq (first sparse) 'case))))
+
 (test def-constant
   (progn (def-constant "aConstant" 1)
          (prog1 (eql (symbol-value 'a-constant) 1)
            (unintern 'a-constant))))
 
+(test def-typedef
+  (progn
+    (eval '(def-typedef "TestVector" (thrift:list double) :representation :packed-array))
+    (eval '(def-struct "testPoint"
+             (("coordinates" nil :type (thrift:list double) :id 1 :typedef "TestVector")
+              ("origin" (thrift:list 0.0d0 0.0d0) :type (thrift:list double) :id 2 :typedef "TestVector"))))
+    (let ((point (make-instance 'test-point :coordinates '(1.0d0 2.0d0 3.0d0)))
+          (protocol (make-test-protocol)))
+      (prog1 (and (subtypep 'test-vector '(simple-array double-float (*)))
+                  (typep (funcall 'test-point-coordinates point) 'test-vector)
+                  ;; the default takes the representation, which the slot type admits
+                  (typep (funcall 'test-point-origin point) 'test-vector)
+                  (subtypep 'test-vector '(thrift:list double))
+                  (progn (stream-write-struct protocol point)
+                         (rewind protocol)
+                         (let ((coordinates (funcall 'test-point-coordinates
+                                                     (funcall 'stream-read-struct protocol 'test-point))))
+                           (and (typep coordinates 'test-vector)
+                                (equalp coordinates #(1.0d0 2.0d0 3.0d0))))))
+        (mapc #'(lambda (method) (remove-method (c2mop:method-generic-function method) method))
+              (c2mop:specializer-direct-methods (find-class 'test-point)))
+        (setf (find-class 'test-point) nil)))))
+
 
 (defgeneric test-struct-too-field1 (struct))
 (defgeneric test-struct-too-field2 (struct))
@@ -64,6 +105,125 @@
         (setf (find-class 'test-struct-too) nil)))))
 ;;; (run-tests "def-struct")
 
+(test def-struct.equality
+  (progn
+    (eval '(def-struct "testKey"
+             (("name" "a" :type string :id 2)
+              ("id" 0 :type i32 :id 1)
+              ("tags" nil :type (thrift:set i32) :id 3 :optional t))))
+    (let ((key1 (make-instance 'test-key :id 1 :name "a" :tags '(1 2)))
+          (key2 (make-instance 'test-key :id 1 :name "a" :tags '(2 1)))
+          (key3 (make-instance 'test-key :id 1 :name "A" :tags '(1 2)))
+          (key4 (make-instance 'test-key :id 1 :name "a"))
+          (key5 (make-instance 'test-key :id 1 :name "a" :tags '(1 2)))
+          (key6 (make-instance 'test-key :id 1 :name "a" :tags '(1 2))))
+      ;; a required field is unbound after a reset or before its decoder sets it
+      (slot-makunbound key5 'name)
+      (slot-makunbound key6 'name)
+      (prog1 (and (funcall 'test-key-equal key1 key2)
+                  (thrift-equal key1 key2)
+                  (= (funcall 'test-key-hash key1) (funcall 'test-key-hash key2))
+                  (not (funcall 'test-key-equal key1 key3))
+                  (not (funcall 'test-key-equal key1 key4))
+                  (not (funcall 'test-key-equal key1 key5))
+                  (not (funcall 'test-key-equal key5 key1))
+                  (funcall 'test-key-equal key5 key6)
+                  (= (funcall 'test-key-hash key5) (funcall 'test-key-hash key6))
+                  (equal (map-get (thrift:map key1 "found") key2) "found")
+                  ;; hash table maps compare struct keys by value as well
+                  (equal (map-get (constant-map (cons key1 "found")) key2) "found")
+                  (equal (map-get (constant-map (cons key5 "unbound")) key6) "unbound"))
+        (mapc #'(lambda (method) (remove-method (c2mop:method-generic-function method) method))
+              (c2mop:specializer-direct-methods (find-class 'test-key)))
+        (setf (find-class 'test-key) nil)))))
+
+(test def-struct.map-keys
+  ;; struct and binary keys match by value, both while a map is an association list and once
+  ;; assignments have grown it into a hash table
+  (progn
+    (eval '(def-struct "mapKey"
+             (("id" 0 :type i32 :id 1)
+              ("name" "" :type string :id 2))))
+    (flet ((key (id) (make-instance 'map-key :id id :name (format nil "key~d" id)))
+           (octets (&rest octets) (coerce octets '(vector (unsigned-byte 8)))))
+      (let ((thrift.implementation::*map-hash-threshold* 4)
+            (structs ())
+            (binaries ())
+            (strings (thrift:map "a" 1)))
+        (setf (map-get structs (key 1)) 1
+              (map-get binaries (octets 1 2)) 1)
+        (prog1 (and (listp structs)
+                    (eql (map-get structs (key 1)) 1)
+                    (eql (map-get binaries (octets 1 2)) 1)
+                    (null (map-get binaries (octets 2 1)))
+                    ;; strings compare case-sensitively
+                    (null (map-get strings "A"))
+                    (progn (loop for id from 2 to 6
+                                 do (setf (map-get structs (key id)) id
+                                          (map-get binaries (octets id id)) id))
+                           (setf (map-get structs (key 1)) 10)
+                           (and (hash-table-p structs)
+                                (hash-table-p binaries)
+                                (= (thrift.implementation::map-size structs) 6)
+                                (eql (map-get structs (key 1)) 10)
+                                (eql (map-get structs (key 6)) 6)
+                                (eql (map-get binaries (octets 1 2)) 1)
+                                (eql (map-get binaries (octets 5 5)) 5)
+                                (null (map-get structs (key 7)))))
+                    ;; by default, an association list remains one
+                    (let ((thrift.implementation::*map-hash-threshold* nil)
+                          (plain ()))
+                      (dotimes (i 20) (setf (map-get plain i) i))
+                      (and (listp plain) (= (length plain) 20)))
+                    ;; a constant map which is modified in place is detected
+                    (let ((constant (constant-map (cons 1 "one"))))
+                      (thrift.implementation::check-constant-map constant)
+                      (setf (gethash 2 constant) "two")
+                      (handler-case (progn (thrift.implementation::check-constant-map constant) nil)
+                        (error () t))))
+          (mapc #'(lambda (method) (remove-method (c2mop:method-generic-function method) method))
+                (c2mop:specializer-direct-methods (find-class 'map-key)))
+          (setf (find-class 'map-key) nil))))))
+
+(test def-struct.map-hash
+  ;; an association list and an equal hash table are the same key, and so are association lists
+  ;; with their entries in another order. a set may be a vector.
+  (let ((table (thrift.implementation::make-map-table))
+        (alist (list (cons 1 "one") (cons 2 (list 2 2)))))
+    (setf (gethash alist table) :found)
+    (and (eq (gethash (constant-map (cons 2 (list 2 2)) (cons 1 "one")) table) :found)
+         (eq (gethash (list (cons 2 (list 2 2)) (cons 1 "one")) table) :found)
+         (null (gethash (list (cons 1 "one") (cons 2 (list 2))) table))
+         (= (thrift-hash alist) (thrift-hash (constant-map (cons 1 "one") (cons 2 (list 2 2)))))
+         (thrift.implementation::set-equal (vector 1 2 3) (list 3 2 1))
+         (= (thrift.implementation::set-hash (vector 1 2 3))
+            (thrift.implementation::set-hash (list 3 2 1))))))
+
+(test def-struct.encoded-size
+  (progn
+    (eval '(def-struct "testSized"
+             (("name" nil :type string :id 1)
+              ("ids" nil :type (thrift:list i32) :id 2)
+              ("counts" nil :type (thrift:map string i64) :id 3)
+              ("note" nil :type string :id 4 :optional t))))
+    (let ((instance (make-instance 'test-sized :name (format nil "gr~cn" (code-char 246)) :ids '(1 2 3)
+                                   :counts '(("a" . 1) ("bc" . 2)))))
+      (prog1 (let ((octets (encode-struct instance)))
+               (and (= (funcall 'test-sized-encoded-size instance)
+                       (thrift-encoded-size instance)
+                       (length octets))
+                    (equalp octets
+                            (let ((protocol (make-test-protocol)))
+                              (stream-write-struct protocol instance)
+                              (thrift.implementation::vector-stream-vector
+                               (protocol-output-transport protocol))))
+                    ;; an unbound required field counts nothing: its header, length and five octets
+                    (progn (slot-makunbound instance 'name)
+                           (= (thrift-encoded-size instance) (- (length octets) 3 4 5)))))
+        (mapc #'(lambda (method) (remove-method (c2mop:method-generic-function method) method))
+              (c2mop:specializer-direct-methods (find-class 'test-sized)))
+        (setf (find-class 'test-sized) nil)))))
+
 (defgeneric test-exception-reason (exception))
 
 (test def-exception
@@ -115,3 +275,178 @@
                )))))
 ;;; (run-tests "def-service")
 
+
+
+(test def-service.instrumentation
+  (progn (defun thrift-test-implementation::instrumented-echo (arg1) arg1)
+         (eval '(def-service "InstrumentedService" nil
+                  (:method "instrumentedEcho" ((("arg1" string 1)) string))))
+         ;; set, rather than bound, as the loopback server runs in a thread of its own
+         (let ((service (symbol-value 'thrift-test::instrumented-service))
+               (instrument-server *instrument-server*))
+           (setf *instrument-server* t)
+           (unwind-protect
+             (progn (with-loopback-client (protocol service)
+                      (dotimes (i 3) (funcall 'thrift-test::instrumented-echo protocol "testing")))
+                    (let ((snapshot (find "instrumentedEcho" (service-statistics service)
+                                          :key #'(lambda (snapshot) (getf snapshot :method))
+                                          :test #'equal)))
+                      (and (eql (getf snapshot :requests) 3)
+                           (eql (getf snapshot :errors) 0)
+                           (plusp (getf snapshot :request-bytes))
+                           (plusp (getf snapshot :response-bytes))
+                           (eql (getf (getf snapshot :total) :count) 3))))
+             (setf *instrument-server* instrument-server)
+             (fmakunbound 'thrift-test-implementation::instrumented-echo)
+             (fmakunbound 'thrift-test::instrumented-echo)
+             (fmakunbound 'thrift-test-response::instrumented-echo)))))
+
+
+(test def-service.direct-calls
+  (progn (defun thrift-test-implementation::direct-echo (arg1) arg1)
+         (eval '(def-service "DirectService" nil
+                  (:direct-calls t)
+                  (:method "directEcho" ((("arg1" string 1)) string))))
+         (let ((service (symbol-value 'thrift-test::direct-service)))
+           (unwind-protect
+             (and (not (typep (fdefinition 'thrift-test::direct-echo) 'generic-function))
+                  (not (typep (fdefinition 'thrift-test-response::direct-echo) 'generic-function))
+                  (with-loopback-client (protocol service)
+                    (equal (funcall 'thrift-test::direct-echo protocol "testing") "testing"))
+                  (typep (nth-value 1 (ignore-errors (funcall 'thrift-test::direct-echo nil "testing")))
+                         'type-error))
+             (fmakunbound 'thrift-test-implementation::direct-echo)
+             (fmakunbound 'thrift-test::direct-echo)
+             (fmakunbound 'thrift-test-response::direct-echo)))))
+
+
+(test def-service.request-buffers
+  (progn (defun thrift-test-implementation::pooled-echo (arg1) arg1)
+         (eval '(def-service "PooledService" nil
+                  (:method "pooledEcho" ((("arg1" string 1)) string))))
+         (unwind-protect
+           (with-octet-buffer-cache ()
+             (let* ((request-base (make-test-transport))
+                    (request-transport (framed-transport request-base))
+                    (client (make-test-protocol :output-transport request-transport
+                                                :input-transport (make-test-transport)))
+                    (server (make-test-protocol :input-transport request-transport
+                                                :output-transport (make-test-transport))))
+               (thrift.implementation::stream-write-message-begin client "pooledEcho" 'call 1)
+               (stream-write-struct client (thrift:list (cons 1 "testing"))
+                                    (thrift.implementation::str-sym "pooledEcho_args"))
+               (stream-write-message-end client)
+               (rewind request-base)
+               (flet ((cached-buffers ()
+                        (loop for class in (getf (octet-buffer-pool-statistics) :classes)
+                              sum (getf class :cache))))
+                 ;; the request frame's buffer is taken from the cache and returned to it once the
+                 ;; response function has decoded the arguments
+                 (let ((cached (cached-buffers)))
+                   (multiple-value-bind (identifier type sequence) (stream-read-message-begin server)
+                     (declare (ignore identifier type))
+                     (and (equal (funcall 'thrift-test-response::pooled-echo t sequence server) "testing")
+                          (null (slot-value request-transport 'thrift.implementation::read-buffer))
+                          (= (cached-buffers) cached)))))))
+           (fmakunbound 'thrift-test-implementation::pooled-echo)
+           (fmakunbound 'thrift-test::pooled-echo)
+           (fmakunbound 'thrift-test-response::pooled-echo))))
+
+
+(test def-struct.required
+  (progn
+    (eval '(def-struct "testRequired"
+             (("name" nil :type string :id 1 :required t)
+              ("count" 0 :type i32 :id 2)
+              ("note" nil :type string :id 3 :optional t))))
+    ;; the same struct without the required field
+    (eval '(def-struct "testRequiredLoose"
+             (("count" 0 :type i32 :id 2))))
+    (flet ((decode (instance)
+             (let ((protocol (make-test-protocol)))
+               (stream-write-struct protocol instance)
+               (rewind protocol)
+               (handler-case (funcall 'stream-read-struct protocol 'test-required)
+                 (required-field-error (error) error)))))
+      (prog1 (let ((complete (decode (make-instance 'test-required :name "a" :count 1)))
+                   (incomplete (decode (make-instance 'test-required-loose :count 1))))
+               (and (funcall 'test-required-isset-name complete)
+                    (not (funcall 'test-required-isset-note complete))
+                    (typep incomplete 'required-field-error)
+                    (equal (cell-error-name incomplete) "name")))
+        (mapc #'(lambda (method) (remove-method (c2mop:method-generic-function method) method))
+              (append (c2mop:specializer-direct-methods (find-class 'test-required))
+                      (c2mop:specializer-direct-methods (find-class 'test-required-loose))))
+        (setf (find-class 'test-required) nil)
+        (setf (find-class 'test-required-loose) nil)))))
+
+
+(test def-struct.sparse
+  (progn
+    (eval '(def-struct "testSparse"
+             (("a" nil :type i32 :id 1 :optional t)
+              ("b" nil :type string :id 2 :optional t)
+              ("c" nil :type i64 :id 3 :optional t)
+              ("d" nil :type (thrift:list i32) :id 4 :optional t))
+             (:metaclass thrift-sparse-struct-class)))
+    (let ((instance (make-instance 'test-sparse :d '(1 2) :b "two"))
+          (protocol (make-test-protocol)))
+      (setf (funcall 'test-sparse-a instance) 1)
+      (slot-makunbound instance 'b)
+      (stream-write-struct protocol instance)
+      (rewind protocol)
+      (prog1 (let ((decoded (funcall 'stream-read-struct protocol 'test-sparse)))
+               (and (eql (funcall 'test-sparse-a decoded) 1)
+                    (equal (funcall 'test-sparse-d decoded) '(1 2))
+                    (not (slot-boundp decoded 'b))
+                    (not (slot-boundp decoded 'c))
+                    (= (length (slot-value decoded 'thrift.implementation::sparse-values)) 2)
+                    (thrift-equal instance decoded)))
+        (mapc #'(lambda (method) (remove-method (c2mop:method-generic-function method) method))
+              (c2mop:specializer-direct-methods (find-class 'test-sparse)))
+        (setf (find-class 'test-sparse) nil)))))
+
+
+(test def-struct.reset
+  (progn
+    (eval '(def-struct "testPooled"
+             (("name" nil :type string :id 1 :optional t)
+              ("count" 0 :type i32 :id 2))))
+    (let ((protocol (make-test-protocol)))
+      (stream-write-struct protocol (make-instance 'test-pooled :count 2))
+      (prog1 (with-struct-pool ()
+               (let ((instance (make-instance 'test-pooled :name "a" :count 1)))
+                 (release-struct instance)
+                 (rewind protocol)
+                 (let ((decoded (funcall 'stream-read-struct protocol 'test-pooled)))
+                   (and (eq decoded instance)
+                        (not (slot-boundp decoded 'name))
+                        (eql (funcall 'test-pooled-count decoded) 2)
+                        (progn (setf (funcall 'test-pooled-name decoded) "b")
+                               (rewind protocol)
+                               (eq (stream-read-struct-into protocol decoded) decoded))
+                        (not (funcall 'test-pooled-isset-name decoded))
+                        (not (eq (lease-struct 'test-pooled) instance))))))
+        (mapc #'(lambda (method) (remove-method (c2mop:method-generic-function method) method))
+              (c2mop:specializer-direct-methods (find-class 'test-pooled)))
+        (setf (find-class 'test-pooled) nil)))))
+
+
+(test def-struct.binary-view
+  (progn
+    (eval '(def-struct "testView"
+             (("data" nil :type binary :id 1 :representation :view))))
+    (let ((protocol (make-test-protocol))
+          (data (make-array 4 :element-type '(unsigned-byte 8) :initial-contents '(1 2 3 4))))
+      (stream-write-struct protocol (make-instance 'test-view :data data))
+      (rewind protocol)
+      ;; the compiled decoder reads the field as a view
+      (prog1 (let* ((decoded (funcall (compile nil '(lambda (protocol) (stream-read-struct protocol 'test-view)))
+                                      protocol))
+                    (view (funcall 'test-view-data decoded)))
+               (and (equalp view data)
+                    (eq (array-displacement view)
+                        (thrift.implementation::get-vector-stream-vector (protocol-input-transport protocol)))))
+        (mapc #'(lambda (method) (remove-method (c2mop:method-generic-function method) method))
+              (c2mop:specializer-direct-methods (find-class 'test-view)))
+        (setf (find-class 'test-view) nil)))))
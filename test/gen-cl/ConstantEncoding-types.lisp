@@ -0,0 +1,19 @@
+;;;  -*- Package: constant-encoding-test -*-
+;;;
+;;; Autogenerated by Thrift
+;;; DO NOT EDIT UNLESS YOU ARE SURE THAT YOU KNOW WHAT YOU ARE DOING
+
+(thrift:def-package :constant-encoding-test)
+
+(cl:in-package :constant-encoding-test)
+
+(thrift:def-enum "Color"
+  (("RED" . 1)
+   ("GREEN" . 2)
+   ("BLUE" . 300)))
+
+(thrift:def-struct "Point"
+  (("x" nil :id 1 :type i16)
+   ("y" -2 :id 2 :type i16)
+   ("color" 2 :id 3 :type (enum "Color"))))
+
@@ -0,0 +1,34 @@
+;;;  -*- Package: constant-encoding-test -*-
+;;;
+;;; Autogenerated by Thrift
+;;; DO NOT EDIT UNLESS YOU ARE SURE THAT YOU KNOW WHAT YOU ARE DOING
+
+(cl:in-package :constant-encoding-test)
+
+(thrift:def-constant "ORIGIN" (make-instance 'point 
+  :x 258
+  )
+  :type (struct "Point")
+  :encoded #(6 0 1 1 2 6 0 2 255 254 8 0 3 0 0 0 2 0))
+
+(thrift:def-constant "PALETTE" (thrift:constant-map 
+  (cl:cons 7 300))
+  :type (thrift:map i16 (enum "Color"))
+  :encoded #(6 8 0 0 0 1 0 7 0 0 1 44))
+
+(thrift:def-constant "OFFSETS" (thrift:list
+    1
+    -1
+    4660
+    )
+  :type (thrift:list i16)
+  :encoded #(6 0 0 0 3 0 1 255 255 18 52))
+
+(thrift:def-constant "NAMED" (thrift:constant-map 
+  (cl:cons "p" (make-instance 'point 
+    :x 1
+    :color 300
+    )))
+  :type (thrift:map string (struct "Point"))
+  :encoded #(11 12 0 0 0 1 0 0 0 1 112 6 0 1 0 1 6 0 2 255 254 8 0 3 0 0 1 44 0))
+
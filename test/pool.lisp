@@ -0,0 +1,95 @@
+;;; -*- Mode: lisp; Syntax: ansi-common-lisp; Base: 10; Package: thrift-test; -*-
+
+(in-package :thrift-test)
+
+;;; tests for the connection pool
+;;; (run-tests "pool.*")
+;;; The test location creates connections over vector stream transports, in order that the
+;;; pool can be exercised without sockets.
+
+(defvar *pool-test-location* (puri:parse-uri "thrift://127.0.0.1:19090"))
+
+(defmethod client ((location (eql *pool-test-location*)) &key &allow-other-keys)
+  (make-test-protocol))
+
+(defun pool-test-statistic (pool key)
+  (getf (first (connection-pool-statistics pool)) key))
+
+
+(test pool.lease-return
+  (let* ((pool (make-connection-pool :max-idle 1))
+         (first (pool-lease pool *pool-test-location*))
+         (second (pool-lease pool *pool-test-location*)))
+    (pool-return pool first)
+    ;; beyond the idle limit, so it is closed
+    (pool-return pool second)
+    (let ((third (pool-lease pool *pool-test-location*)))
+      (and (not (eq first second))
+           (eq third first)
+           (= (pool-test-statistic pool :created) 2)
+           (= (pool-test-statistic pool :leases) 3)
+           (= (pool-test-statistic pool :leased) 1)
+           (= (pool-test-statistic pool :idle) 0)))))
+
+
+(test pool.max-connections
+  (let* ((pool (make-connection-pool :max-connections 1 :wait-timeout 5))
+         (first (pool-lease pool *pool-test-location*))
+         (waiter (bt:make-thread #'(lambda () (pool-lease pool *pool-test-location*)))))
+    (sleep 0.1)
+    (pool-return pool first)
+    (let ((second (bt:join-thread waiter))
+          (impatient (make-connection-pool :max-connections 1 :wait-timeout 0.05)))
+      (pool-lease impatient *pool-test-location*)
+      (and (eq first second)
+           (= (pool-test-statistic pool :created) 1)
+           (= (pool-test-statistic pool :waits) 1)
+           (handler-case (progn (pool-lease impatient *pool-test-location*) nil)
+             (connection-pool-timeout-error () t))))))
+
+
+(test pool.idle-timeout
+  (let* ((pool (make-connection-pool :idle-timeout 10 :min-idle 1))
+         (first (pool-lease pool *pool-test-location*))
+         (second (pool-lease pool *pool-test-location*)))
+    (pool-return pool first)
+    (pool-return pool second)
+    ;; age the idle connections beyond the timeout
+    (dolist (entry (thrift.implementation::endpoint-idle
+                    (thrift.implementation::connection-pool-endpoint pool *pool-test-location*)))
+      (decf (rest entry) 100))
+    ;; the minimum idle connection is retained
+    (and (= (pool-evict pool) 1)
+         (= (pool-test-statistic pool :idle) 1)
+         (= (pool-test-statistic pool :evicted) 1)
+         (= (pool-test-statistic pool :created) 2))))
+
+
+(test pool.min-idle
+  (let ((pool (make-connection-pool :min-idle 2 :endpoints (list (list *pool-test-location*)))))
+    (and (= (pool-test-statistic pool :idle) 2)
+         (= (pool-test-statistic pool :created) 2)
+         (let ((first (pool-lease pool *pool-test-location*)))
+           (pool-lease pool *pool-test-location*)
+           (pool-return pool first :broken t)
+           ;; eviction refills the endpoint to the minimum
+           (and (= (pool-evict pool) 0)
+                (= (pool-test-statistic pool :idle) 2)
+                (= (pool-test-statistic pool :leased) 1)
+                (= (pool-test-statistic pool :created) 4))))))
+
+
+(test pool.broken-connection
+  (let* ((pool (make-connection-pool))
+         (first (pool-lease pool *pool-test-location*)))
+    (pool-return pool first)
+    ;; a non-local exit marks the connection broken, so it is not reused
+    (ignore-errors (thrift.implementation::call-with-pooled-client
+                    #'(lambda (protocol)
+                        (assert (eq protocol first))
+                        (error "broken request"))
+                    pool *pool-test-location*))
+    (let ((second (pool-lease pool *pool-test-location*)))
+      (and (not (eq first second))
+           (= (pool-test-statistic pool :created) 2)
+           (= (pool-test-statistic pool :idle) 0)))))
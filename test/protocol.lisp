@@ -162,6 +162,352 @@
                                (t nil) (1 2 3) (32767 1 -1 -32768))))))
 
 
+(test protocol.multiplexed
+  (let* ((transport (make-test-transport))
+         (protocol (make-instance 'multiplexed-protocol :service-identifier "Calculator"
+                                  :direction :io :input-transport transport :output-transport transport))
+         (calculator (make-instance 'service :identifier "Calculator"))
+         (multiplexed (make-instance 'multiplexed-service :services (list calculator))))
+    (setf (gethash "add" (thrift.implementation::service-methods calculator)) 'add)
+    (thrift.implementation::stream-write-message-begin protocol "add" 'call 1)
+    (rewind protocol)
+    (let ((identifier (stream-read-message-begin protocol)))
+      (and (equal identifier "Calculator:add")
+           (multiple-value-bind (function service) (method-definition multiplexed identifier)
+             (and (eq function 'add) (eq service calculator)))
+           (null (method-definition multiplexed "Unknown:add"))))))
+
+
+(test protocol.method-dispatch
+  (let* ((protocol (make-test-protocol))
+         (base (make-instance 'service :identifier "Base" :methods '(("ping" . ping))))
+         (service (make-instance 'service :identifier "Calculator" :base-services (list base)
+                                 :methods '(("add" . add) ("sub" . sub) ("multiply" . multiply)))))
+    (flet ((dispatch (identifier)
+             (rewind protocol)
+             (thrift.implementation::stream-write-message-begin protocol identifier 'call 1)
+             (rewind protocol)
+             (multiple-value-bind (octets length) (thrift.implementation::stream-read-message-begin-octets protocol)
+               (method-dispatch service octets length))))
+      (and (eq (dispatch "sub") 'sub)
+           (eq (dispatch "multiply") 'multiply)
+           (equal (multiple-value-list (dispatch "ping")) (list 'ping base "ping"))
+           (null (dispatch "mul"))
+           ;; a definition clears the table, and the next dispatch rebuilds it
+           (progn (setf (method-definition service "divide") 'divide)
+                  (null (thrift.implementation::service-dispatch-table service)))
+           (eq (dispatch "divide") 'divide)
+           (thrift.implementation::service-dispatch-table service)))))
+
+
+(test protocol.loopback-transport
+  (multiple-value-bind (client server) (make-loopback-transports :buffer-size 7)
+    (let* ((data (make-array 100 :element-type '(unsigned-byte 8)
+                             :initial-contents (loop for i below 100 collect i)))
+           (result (make-array 100 :element-type '(unsigned-byte 8)))
+           (writer (bt:make-thread #'(lambda () (write-sequence data client) (close client)))))
+      (read-sequence result server)
+      (bt:join-thread writer)
+      (and (equalp data result)
+           (handler-case (progn (read-byte server) nil)
+             (end-of-file () t))))))
+
+
+(test protocol.transport-byte-counts
+  ;; a short sequence read counts just the bytes which it transferred
+  (let ((input (make-test-transport :vector '(1 2 3 4 5)))
+        (output (make-test-transport))
+        (framed (framed-transport (make-test-transport)))
+        (sequence (make-array 8 :element-type '(unsigned-byte 8))))
+    (stream-read-byte input)
+    (stream-read-sequence input sequence 0 8)
+    (stream-write-byte output 1)
+    (stream-write-sequence output sequence 2 5)
+    (stream-write-sequence framed sequence 0 4)
+    (and (= (transport-bytes-read input) 5)
+         (= (transport-bytes-written output) 4)
+         (= (transport-bytes-written framed) 4))))
+
+
+(test protocol.transport-statistics
+  ;; only the sequence read and the flushes are recorded as operations, but the bytes of the byte
+  ;; read and of the sequence write are added at the boundaries
+  (let ((thrift.implementation::*transport-statistics-aggregate* (make-transport-statistics))
+        (counted (make-test-transport :vector '(1 2 3 4 5 6 7 8)))
+        (uncounted (make-test-transport :vector '(1 2 3 4 5 6 7 8)))
+        (sequence (make-array 4 :element-type '(unsigned-byte 8))))
+    (setf (transport-statistics counted) (make-transport-statistics))
+    (dolist (transport (list counted uncounted))
+      (stream-read-byte transport)
+      (stream-read-sequence transport sequence 0 4)
+      (stream-write-sequence transport sequence 0 3)
+      (stream-force-output transport)
+      (stream-finish-output transport))
+    (let ((snapshot (transport-statistics-snapshot counted))
+          (aggregate (transport-statistics-snapshot nil)))
+      (and (= (getf snapshot :fills) 1)
+           (= (getf snapshot :bytes-read) 5)
+           (= (getf snapshot :flushes) 2)
+           (= (getf snapshot :output-flushes) 1)
+           (= (getf snapshot :bytes-written) 3)
+           (= (getf snapshot :bytes/output-flush) 3)
+           (equal aggregate snapshot)
+           (null (transport-statistics-snapshot uncounted))
+           (progn (reset-transport-statistics counted)
+                  (stream-read-sequence counted sequence 0 2)
+                  (= (getf (transport-statistics-snapshot counted) :bytes-read) 2))))))
+
+
+(test protocol.framed-transport
+  (with-octet-buffer-cache ()
+    (let* ((base (make-test-transport))
+           (protocol (make-test-protocol :input-transport (framed-transport base)))
+           (struct (make-instance 'test-struct :field1 "one" :field2 2)))
+      (stream-write-message protocol struct 'call)
+      (let ((frame-size (stream-position base)))
+        (rewind base)
+        (multiple-value-bind (name type sequence response) (stream-read-message protocol)
+          (declare (ignore sequence))
+          ;; a released buffer is reused from the connection's cache
+          (let ((buffer (acquire-octet-buffer 100)))
+            (release-octet-buffer buffer)
+            (and (equal name 'test-struct)
+                 (eq type 'call)
+                 (equal (test-struct-field1 response) "one")
+                 (= (aref (thrift.implementation::get-vector-stream-vector base) 3) (- frame-size 4))
+                 (eq buffer (acquire-octet-buffer 128)))))))))
+
+
+(test protocol.framed-transport.binary-view
+  (progn
+    (eval '(def-struct "framedView"
+             (("data" nil :type binary :id 1 :representation :view))))
+    (prog1 (with-octet-buffer-cache ()
+             (let* ((base (make-test-transport))
+                    (transport (framed-transport base))
+                    (protocol (make-test-protocol :input-transport transport))
+                    (reader (compile nil '(lambda (protocol) (stream-read-struct protocol 'framed-view)))))
+               (flet ((write-frame (octets)
+                        (stream-write-struct protocol (make-instance 'framed-view
+                                                        :data (make-array 4 :element-type '(unsigned-byte 8)
+                                                                          :initial-contents octets)))
+                        (stream-force-output transport)))
+                 (write-frame '(1 2 3 4))
+                 (write-frame '(9 9 9 9))
+                 (rewind base)
+                 ;; the message end releases the first frame's buffer, but the view keeps it from
+                 ;; being reused for the second frame
+                 (let ((first (funcall reader protocol)))
+                   (transport-release-buffers transport)
+                   (let ((second (funcall reader protocol)))
+                     (and (equalp (funcall 'framed-view-data first) #(1 2 3 4))
+                          (equalp (funcall 'framed-view-data second) #(9 9 9 9))
+                          (not (eq (array-displacement (funcall 'framed-view-data first))
+                                   (array-displacement (funcall 'framed-view-data second))))))))))
+      (mapc #'(lambda (method) (remove-method (c2mop:method-generic-function method) method))
+            (c2mop:specializer-direct-methods (find-class 'framed-view)))
+      (setf (find-class 'framed-view) nil))))
+
+
+;;; the record log tests define this struct type for their records
+
+(defun call-with-test-record-log (op)
+  (eval '(def-struct "logRecord"
+           (("sequence" 0 :type i32 :id 1)
+            ("body" "" :type string :id 2))))
+  (let* ((pathname (make-pathname :name "thrift-test-record-log" :type "log"
+                                  :defaults (thrift.implementation::binary-spill-directory)))
+         (index-pathname (thrift.implementation::record-log-index-pathname pathname)))
+    (flet ((delete-files ()
+             (when (probe-file pathname) (delete-file pathname))
+             (when (probe-file index-pathname) (delete-file index-pathname))))
+      (delete-files)
+      (unwind-protect (funcall op pathname index-pathname)
+        (delete-files)
+        (mapc #'(lambda (method) (remove-method (c2mop:method-generic-function method) method))
+              (c2mop:specializer-direct-methods (find-class 'log-record)))
+        (setf (find-class 'log-record) nil)))))
+
+(defun append-test-records (pathname start end)
+  "Append records with sequence numbers from START below END, and return their offsets."
+  (with-record-log (log pathname :direction :output :sync-interval 4)
+    (loop for n from start below end
+          collect (record-log-offset log (record-log-append log (make-instance 'log-record :sequence n :body "record"))))))
+
+(defun test-record-sequences (log)
+  (let ((sequences ()))
+    (handler-bind ((record-log-error #'(lambda (c) (declare (ignore c)) (invoke-restart 'skip-record))))
+      (map-record-log #'(lambda (record n)
+                          (declare (ignore n))
+                          (push (funcall 'log-record-sequence record) sequences))
+                      log))
+    (nreverse sequences)))
+
+(defun overwrite-test-octet (pathname offset octet)
+  (with-open-file (stream pathname :direction :io :element-type '(unsigned-byte 8) :if-exists :overwrite)
+    (file-position stream offset)
+    (write-byte octet stream)))
+
+
+(test protocol.record-log
+  (call-with-test-record-log
+   #'(lambda (pathname index-pathname)
+       (append-test-records pathname 0 10)
+       ;; a lost index is rebuilt when the log is reopened
+       (delete-file index-pathname)
+       (append-test-records pathname 10 20)
+       (with-record-log (log pathname :type 'log-record)
+         (flet ((record-sequence (record) (funcall 'log-record-sequence record)))
+           (let ((sequences ()))
+             (map-record-log #'(lambda (record n)
+                                 (declare (ignore n))
+                                 (push (record-sequence record) sequences))
+                             log :start 15)
+             (and (= (record-log-count log) 20)
+                  (equal (nreverse sequences) '(15 16 17 18 19))
+                  (= (record-sequence (record-log-read log 7)) 7)
+                  (= (record-log-bisect log 12 #'record-sequence) 12)
+                  (= (record-log-bisect log 99 #'record-sequence) 20)
+                  (equal (test-record-sequences log) (loop for n below 20 collect n)))))))))
+
+
+(test protocol.record-log.resync
+  (call-with-test-record-log
+   #'(lambda (pathname index-pathname)
+       (let ((offsets (append-test-records pathname 0 12)))
+         (and
+          ;; a damaged payload signals an error when read through the index; map-record-log skips it
+          (progn (overwrite-test-octet pathname (+ (nth 5 offsets) 10) #xff)
+                 (with-record-log (log pathname :type 'log-record)
+                   (and (= (record-log-count log) 12)
+                        (typep (nth-value 1 (ignore-errors (record-log-read log 5))) 'record-log-error)
+                        (equal (test-record-sequences log) '(0 1 2 3 4 6 7 8 9 10 11)))))
+          ;; a damaged length ends the rebuilding scan at record 5, which resumes at the sync
+          ;; block which precedes record 8
+          (progn (overwrite-test-octet pathname (nth 5 offsets) #x7f)
+                 (delete-file index-pathname)
+                 (with-record-log (log pathname :type 'log-record)
+                   (equal (test-record-sequences log) '(0 1 2 3 4 8 9 10 11))))
+          ;; a torn tail is followed by a sync block when the log is appended to
+          (progn (with-open-file (stream pathname :direction :output :element-type '(unsigned-byte 8)
+                                         :if-exists :append)
+                   (write-sequence #(0 0 1 0 1 2) stream))
+                 (append-test-records pathname 12 14)
+                 (with-record-log (log pathname :type 'log-record)
+                   (equal (test-record-sequences log) '(0 1 2 3 4 8 9 10 11 12 13)))))))))
+
+
+
+(test protocol.binary-spill
+  ;; a value beyond the threshold is copied in chunks to a file, whose length is retained, and
+  ;; a file is written in chunks as a binary value
+  (let ((*binary-spill-threshold* 100)
+        (*binary-chunk-size* 16)
+        (octets (coerce (loop for i below 1000 collect (mod i 256)) '(vector (unsigned-byte 8))))
+        (protocol (make-test-protocol))
+        (pathname nil))
+    (stream-write-binary protocol octets)
+    (stream-write-binary protocol (subseq octets 0 100))
+    (rewind protocol)
+    (unwind-protect
+      (progn (setf pathname (stream-read-binary-spill protocol))
+             (let ((small (stream-read-binary-spill protocol))
+                   (copy (make-test-protocol)))
+               (and (pathnamep pathname)
+                    (equal (pathname-directory pathname)
+                           (pathname-directory (thrift.implementation::binary-spill-directory)))
+                    (equalp (with-open-file (input pathname :element-type '(unsigned-byte 8))
+                              (let ((content (make-array (file-length input) :element-type '(unsigned-byte 8))))
+                                (read-sequence content input)
+                                content))
+                            octets)
+                    (eql (gethash pathname thrift.implementation::*binary-spill-lengths*) 1000)
+                    (= (thrift.implementation::binary-string-size pathname) 1004)
+                    (typep small '(vector (unsigned-byte 8)))
+                    (= (length small) 100)
+                    ;; written from the file, the value encodes as it did from the vector
+                    (= (stream-write-binary copy pathname) 1004)
+                    (progn (rewind copy)
+                           (equalp (stream-read-binary copy) octets))
+                    (with-open-file (input pathname :element-type '(unsigned-byte 8))
+                      (file-position input 990)
+                      (let ((tail (make-test-protocol)))
+                        (and (= (stream-write-binary tail input) 14)
+                             (progn (rewind tail)
+                                    (equalp (stream-read-binary tail) (subseq octets 990)))))))))
+      (when (and pathname (probe-file pathname))
+        (delete-file pathname)))))
+
+
+#+sbcl
+(test protocol.mapped-file-transport
+  (let ((pathname (make-pathname :name "thrift-test-mapped" :type "bin"
+                                 :defaults (thrift.implementation::binary-spill-directory)))
+        (empty-pathname (make-pathname :name "thrift-test-mapped-empty" :type "bin"
+                                       :defaults (thrift.implementation::binary-spill-directory))))
+    (with-open-file (stream pathname :direction :output :element-type '(unsigned-byte 8)
+                            :if-exists :supersede)
+      (write-sequence (coerce (loop for i below 10 collect i) '(vector (unsigned-byte 8))) stream))
+    (with-open-file (stream empty-pathname :direction :output :if-exists :supersede))
+    (flet ((end-of-file-p (op)
+             (handler-case (progn (funcall op) nil)
+               (end-of-file () t))))
+      (unwind-protect
+        (let ((transport (mapped-file-transport pathname))
+              (empty (mapped-file-transport empty-pathname))
+              (octets (make-array 4 :element-type '(unsigned-byte 8)))
+              (adjustable (make-array 2 :element-type '(unsigned-byte 8) :adjustable t)))
+          (unwind-protect
+            (and (= (stream-read-byte transport) 0)
+                 (progn (stream-read-sequence transport octets)
+                        (equalp octets #(1 2 3 4)))
+                 (progn (stream-read-sequence transport adjustable)
+                        (equalp adjustable #(5 6)))
+                 ;; a truncated read signals and leaves the position
+                 (= (stream-position transport 8) 8)
+                 (end-of-file-p #'(lambda () (stream-read-sequence transport octets)))
+                 (= (stream-position transport) 8)
+                 (progn (stream-read-sequence transport octets 1 3)
+                        (equalp octets #(1 8 9 4)))
+                 (stream-eofp transport)
+                 (end-of-file-p #'(lambda () (stream-read-byte transport)))
+                 (= (transport-bytes-read transport) 9)
+                 (end-of-file-p #'(lambda () (stream-read-byte empty)))
+                 (stream-eofp empty))
+            (close transport)
+            (close empty)))
+        (delete-file pathname)
+        (delete-file empty-pathname)))))
+
+
+(test protocol.encoded-value
+  (let ((protocol (make-test-protocol))
+        (value '(1 2 3)))
+    (stream-write-list protocol value 'i32)
+    (let ((encoded (make-encoded-value '(thrift:list i32)
+                                       (vector-stream-vector (protocol-output-transport protocol)))))
+      (stream-write-list protocol encoded 'i32)
+      (thrift.implementation::stream-write-value-as protocol encoded '(thrift:list i32))
+      (rewind protocol)
+      (and (equal (stream-read-list protocol 'i32) value)
+           (equal (stream-read-list protocol 'i32) value)))))
+
+(test protocol.generated-constant-encodings
+  ;; the octets which the generator embeds for ConstantEncoding.thrift match the binary protocol's
+  ;; encoding of the same values, for i16, enum, struct, list and map constants
+  (let ((*package* (find-package :constant-encoding-test)))
+    (every #'(lambda (identifier)
+               (let* ((encoded (constant-encoded-value identifier))
+                      (protocol (make-test-protocol))
+                      (transport (protocol-output-transport protocol)))
+                 (thrift.implementation::stream-write-value-as protocol (symbol-value (thrift.implementation::str-sym identifier))
+                                                               (encoded-value-type encoded))
+                 (equalp (subseq (thrift.implementation::get-vector-stream-vector transport)
+                                 0 (stream-position transport))
+                         (encoded-value-octets encoded))))
+           '("ORIGIN" "PALETTE" "OFFSETS" "NAMED"))))
+
+
 #+(or ccl sbcl)
 (defun time-struct-io (&optional (count 1024))
   (let ((initargs '(:field1 1 :field2 2 :field3 3 :field4 4 :field5 5
@@ -75,7 +75,22 @@
 
 (defclass transport (#+sbcl sb-gray:fundamental-stream #+ccl stream)
   ((stream :reader transport-stream)
-   (direction :initarg :direction :accessor stream-direction))
+   (direction :initarg :direction :accessor stream-direction)
+   (bytes-read
+    :initform 0
+    :accessor transport-bytes-read
+    :type fixnum
+    :documentation "The count of bytes read through the binary transport operators.")
+   (bytes-written
+    :initform 0
+    :accessor transport-bytes-written
+    :type fixnum
+    :documentation "The count of bytes written through the binary transport operators.")
+   (statistics
+    :initform nil :initarg :statistics
+    :accessor transport-statistics
+    :documentation "When present, a transport-statistics instance which counts calls, bytes, flushes
+     and the time blocked in them. See instrumentation.lisp."))
   (:documentation "The abstract transport class is a specialized stream which wraps a base binary
  stream - a file or a socket, with methods which codec operators for primitive data types."))
 
@@ -85,7 +100,9 @@
 
 
 (defclass socket-transport (binary-transport)
-  ()
+  ((socket
+    :initarg :socket :reader transport-socket
+    :documentation "The usocket instance, retained in order to test connection state."))
   (:documentation "A specialzed transport which wraps a socket and its stream."))
 
 
@@ -185,54 +202,83 @@
 
 ;;;
 ;;; input
+;;; each primary method maintains the byte counts, as do those of the specialized transports. The
+;;; counts permit the server instrumentation to attribute request and response sizes to methods.
+;;; A sequence read counts the bytes actually transferred.
 
 #-sbcl
 (defmethod stream-read-byte ((transport binary-transport))
   (let ((unsigned-byte (stream-read-byte (transport-stream transport))))
-    (if unsigned-byte
-      (signed-byte-8 unsigned-byte)
-      (error 'end-of-file :stream (transport-stream transport)))))
+    (cond (unsigned-byte
+           (incf (the fixnum (transport-bytes-read transport)))
+           (signed-byte-8 unsigned-byte))
+          (t
+           (error 'end-of-file :stream (transport-stream transport))))))
 #+sbcl
 (defmethod stream-read-byte ((transport binary-transport))
   (let ((unsigned-byte (read-byte (transport-stream transport))))
+    (incf (the fixnum (transport-bytes-read transport)))
     (signed-byte-8 unsigned-byte)))
 
 
 #-(or mcl sbcl)
 (defmethod stream-read-sequence ((transport binary-transport) (sequence vector) &optional (start 0) (end nil))
-  (stream-read-sequence (transport-stream transport) sequence start end))
+  (let ((position (stream-read-sequence (transport-stream transport) sequence start end)))
+    (incf (the fixnum (transport-bytes-read transport)) (- position start))
+    position))
 
 #+mcl
 (defmethod stream-read-sequence ((transport binary-transport) (sequence vector) &rest args)
   (declare (dynamic-extent args))
-  (apply #'stream-read-sequence (transport-stream transport) sequence args))
+  (let ((position (apply #'stream-read-sequence (transport-stream transport) sequence args)))
+    (incf (the fixnum (transport-bytes-read transport)) (- position (getf args :start 0)))
+    position))
 
 #+sbcl
 (defmethod stream-read-sequence ((transport binary-transport) (sequence vector) &optional (start 0) (end nil))
-  (unless (= (read-sequence sequence (transport-stream transport) :start start :end end)
-             (or end (length sequence)))
-    (error 'end-of-file :stream (transport-stream transport))))
+  (let ((position (read-sequence sequence (transport-stream transport) :start start :end end)))
+    (incf (the fixnum (transport-bytes-read transport)) (- position start))
+    (unless (= position (or end (length sequence)))
+      (error 'end-of-file :stream (transport-stream transport)))))
 
 ;;;
 ;;; output
 
 #-sbcl
 (defmethod stream-write-byte ((transport binary-transport) byte)
-  (stream-write-byte (transport-stream transport) (unsigned-byte-8 byte)))
+  (prog1 (stream-write-byte (transport-stream transport) (unsigned-byte-8 byte))
+    (incf (the fixnum (transport-bytes-written transport)))))
 #+sbcl
 (defmethod stream-write-byte ((transport binary-transport) byte)
-  (write-byte (unsigned-byte-8 byte) (transport-stream transport)))
+  (prog1 (write-byte (unsigned-byte-8 byte) (transport-stream transport))
+    (incf (the fixnum (transport-bytes-written transport)))))
 
 
 #-(or mcl sbcl)
 (defmethod stream-write-sequence ((transport binary-transport) (sequence vector) &optional (start 0) (end nil))
-  (stream-write-sequence (transport-stream transport) sequence start end))
+  (prog1 (stream-write-sequence (transport-stream transport) sequence start end)
+    (incf (the fixnum (transport-bytes-written transport)) (- (or end (length sequence)) start))))
 
 #+mcl
 (defmethod stream-write-sequence ((transport binary-transport) (sequence vector) &rest args)
   (declare (dynamic-extent args))
-  (apply #'stream-write-sequence (transport-stream transport) sequence args))
+  (prog1 (apply #'stream-write-sequence (transport-stream transport) sequence args)
+    (incf (the fixnum (transport-bytes-written transport))
+          (- (or (getf args :end) (length sequence)) (getf args :start 0)))))
 
 #+sbcl
 (defmethod stream-write-sequence ((transport binary-transport) (sequence vector) &optional (start 0) (end nil))
-  (write-sequence sequence (transport-stream transport) :start start :end end))
+  (prog1 (write-sequence sequence (transport-stream transport) :start start :end end)
+    (incf (the fixnum (transport-bytes-written transport)) (- (or end (length sequence)) start))))
+
+
+;;;
+;;; octet views
+;;; a transport which reads from a buffer can yield a value's octets in place. the view counts as read.
+
+(defgeneric transport-octet-view (transport length)
+  (:documentation "If the TRANSPORT's buffer holds the next LENGTH octets, advance past them and
+ return the buffer and the start position. Otherwise return nil and consume nothing.")
+
+  (:method ((transport t) (length t))
+    nil))
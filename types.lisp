@@ -45,22 +45,25 @@
 
 
 (deftype thrift:list (&optional element-type)
-  "The thrift:list container type is implemented as a cl:list. The element type
- serves for declaration, but not discrimination. An empty list should conform."
+  "The thrift:list container type is implemented as a cl:list, or, for a field which declares a
+ :packed-array typedef, as a specialized vector. The element type serves for declaration, but not
+ discrimination. An empty list should conform."
   (declare (ignore element-type))
- 'list)
+  '(or list vector))
 
 (deftype thrift:set (&optional element-type)
-  "The thrift:set container type is implemented as a cl:list. The element type
- serves for declaration, but not discrimination. an empty set should conform."
+  "The thrift:set container type is implemented as a cl:list, or, for a field which declares a
+ :packed-array typedef, as a specialized vector. The element type serves for declaration, but not
+ discrimination. an empty set should conform."
   (declare (ignore element-type))
-  'list)
+  '(or list vector))
 
 (deftype thrift:map (&optional key-type value-type)
-  "The thrift:map container type is implemented as a association list. The key and value types
- serve for declaration, but not discrimination. An empty map should conform."
+  "The thrift:map container type is implemented as a association list, or, for constants, as an
+ equal hash table. The key and value types serve for declaration, but not discrimination.
+ An empty map should conform."
   (declare (ignore key-type value-type))
-  'list)
+  '(or list hash-table))
 
 
 (deftype base-type ()
@@ -149,7 +152,9 @@
   (:method ((value list))
     (if (consp (first value))
       'thrift:map
-      'thrift:list)))
+      'thrift:list))
+  (:method ((value hash-table))
+    'thrift:map))
 
 
 (defgeneric type-name-class (type-name)
@@ -167,7 +172,7 @@
       (enum 'integer)
       (struct (str-sym (second type-name)))
       ((thrift:list thrift:set) 'list)
-      (thrift:map 'list))))
+      (thrift:map t))))
 
 
 (defgeneric type-category (type)
@@ -175,7 +180,9 @@
 
   (:method ((type symbol)) type)
 
-  (:method ((type cons)) (first type)))
+  (:method ((type cons))
+    ;; enums are encoded as i32
+    (if (eq (first type) 'enum) 'i32 (first type))))
 
 ;;;
 ;;; primitive constructors
@@ -200,21 +207,94 @@
 ;;;
 ;;; primitive accessors
 ;;; --- in prepration to support association lists as maps
+;;; Map constants are hash tables, built once at load time and shared by the constant and
+;;; by field defaults. They are registered as immutable: map-set copies one before it adds an
+;;; entry, and the setf expansion for map-get stores the copy in place of the original. Writes must
+;;; go through map-set or (setf map-get): a direct (setf gethash) or remhash on a constant map
+;;; changes the constant and every default which shares it. With the feature :thrift-check-types,
+;;; map-get and map-set assert that a constant map still has the entries it was created with.
+
+(defvar *constant-maps* (make-hash-table :test 'eq
+                                         #+sbcl :weakness #+sbcl :key #+sbcl :synchronized #+sbcl t
+                                         #+ccl :weak #+ccl :key)
+  "Binds the hash tables which constant-map creates to their map-hash, in order to copy them on
+ write and to detect direct modification.")
+
+(defun constant-map (&rest pairs)
+  "Return an immutable map of the (key . value) PAIRS as a hash table. It must be changed only
+ through map-set, which copies it, never with (setf gethash) or remhash."
+  (let ((table (make-map-table (length pairs))))
+    (loop for (key . value) in pairs
+          do (setf (gethash key table) value))
+    (setf (gethash table *constant-maps*) (map-hash table))
+    table))
+
+(defun constant-map-p (map)
+  (and (hash-table-p map) (gethash map *constant-maps*)))
+
+(defun check-constant-map (map)
+  "Signal an error if the constant MAP was modified in place."
+  (let ((hash (constant-map-p map)))
+    (assert (or (null hash) (= hash (map-hash map))) ()
+            "The constant map ~s was modified in place, rather than through map-set." map)))
+
+(defun copy-map (map)
+  (etypecase map
+    (list (copy-alist map))
+    (hash-table (let ((copy (make-map-table (hash-table-count map))))
+                  (maphash #'(lambda (key value) (setf (gethash key copy) value)) map)
+                  copy))))
+
+(defparameter *map-hash-threshold* nil
+  "If non-null, the entry count at which map-set converts an association list map to a hash table,
+ in order that lookups in a map which grows by assignment cease to be linear. The map-set caller
+ then receives a hash table in place of its association list, so this is off by default.")
+
+(defun map-key-test (key)
+  "Strings compare case-sensitively, and struct and binary keys structurally, by thrift-equal."
+  (typecase key
+    (string #'string=)
+    ((or standard-object vector cons hash-table) #'thrift-equal)
+    (t #'eql)))
+
+(defun alist-map-table (map)
+  "Return a hash table map with the entries of the association list MAP."
+  (let ((table (make-map-table (length map))))
+    ;; the first entry for a key shadows later ones, as for assoc
+    (loop for (key . value) in (reverse map)
+          do (setf (gethash key table) value))
+    table))
 
 (defun map-get (map key &optional default)
   "Retrieve the map entry for a given key."
 
-  (let ((pair (assoc key map :test #'equalp)))
-    (if pair
-      (rest pair)
-      default)))
+  #+thrift-check-types (check-constant-map map)
+  (etypecase map
+    (list (let ((pair (assoc key map :test (map-key-test key))))
+            (if pair
+              (rest pair)
+              default)))
+    (hash-table (gethash key map default))))
 
 (defun map-set (map key value)
-  (let ((pair (assoc key map :test #'equalp)))
-    (if pair
-      (setf (rest pair) value)
-      (setf map (acons key value map)))
-    map))
+  "Set the KEY's entry in MAP and return the map. A constant map is copied first. If
+ *map-hash-threshold* is set, an association list which reaches it is returned as a hash table."
+  #+thrift-check-types (check-constant-map map)
+  (etypecase map
+    (list (let ((pair (assoc key map :test (map-key-test key))))
+            (cond (pair
+                   (setf (rest pair) value)
+                   map)
+                  ((and *map-hash-threshold* (>= (length map) *map-hash-threshold*))
+                   (let ((table (alist-map-table map)))
+                     (setf (gethash key table) value)
+                     table))
+                  (t
+                   (acons key value map)))))
+    (hash-table (when (constant-map-p map)
+                  (setf map (copy-map map)))
+                (setf (gethash key map) value)
+                map)))
 
 (define-setf-expander map-get (map key &environment env)
   (multiple-value-bind (temps vals stores
@@ -231,11 +311,149 @@
 
 
 (defun map-map (function map)
-  (loop for (key . value) in map
-        do (funcall function key value))
+  (etypecase map
+    (list (loop for (key . value) in map
+                do (funcall function key value)))
+    (hash-table (maphash function map)))
   nil)
 
 
 (defun map-size (map)
-  (length map))
+  (etypecase map
+    (list (length map))
+    (hash-table (hash-table-count map))))
+
+
+;;;
+;;; structural equality and hashing
+;;; def-struct defines <struct>-equal and <struct>-hash, which compare and combine the fields in
+;;; id order with operators specific to each field type, and specializes thrift-equal and
+;;; thrift-hash to them. The methods here cover the values of other types. Sets and maps are
+;;; unordered, so that their hash combines the element hashes commutatively. Untyped, an
+;;; association list cannot be told from a list of conses, so the list hash is commutative as well,
+;;; and an element (key . value) hashes as a map entry. An association list then hashes as an equal
+;;; hash table does, and two association lists with the same entries in another order are equal.
+
+(declaim (inline mix-hash))
+(defun mix-hash (hash value)
+  (logand (+ (* hash 31) value) most-positive-fixnum))
+
+(defun association-list-p (object)
+  (loop (cond ((null object) (return t))
+              ((and (consp object) (consp (first object))) (pop object))
+              (t (return nil)))))
+
+(defun map-entry-hash (key value)
+  (mix-hash (thrift-hash key) (thrift-hash value)))
+
+
+(defgeneric thrift-equal (a b)
+  (:documentation "Return true iff A and B are equal thrift values: structs field by field,
+ strings case-sensitively, lists element by element and maps, association lists included,
+ entry by entry.")
+  (:method ((a t) (b t)) (eql a b))
+  (:method ((a string) (b string)) (string= a b))
+  (:method ((a vector) (b vector))
+    (and (= (length a) (length b))
+         (every #'thrift-equal a b)))
+  (:method ((a cons) (b cons))
+    (or (let ((a a) (b b))
+          (loop (unless (thrift-equal (pop a) (pop b)) (return nil))
+                (when (or (atom a) (atom b)) (return (thrift-equal a b)))))
+        (and (association-list-p a) (association-list-p b)
+             (map-equal a b))))
+  (:method ((a hash-table) (b t)) (map-equal a b))
+  (:method ((a t) (b hash-table)) (map-equal a b)))
+
+(defgeneric thrift-hash (object)
+  (:documentation "Return a non-negative fixnum hash for OBJECT, consistent with thrift-equal.")
+  (:method ((object t)) (sxhash object))
+  (:method ((object vector))
+    (let ((hash (length object)))
+      (map nil #'(lambda (element) (setf hash (mix-hash hash (thrift-hash element)))) object)
+      hash))
+  (:method ((object string)) (sxhash object))
+  (:method ((object cons))
+    (let ((hash 0))
+      (loop (let ((element (pop object)))
+              (setf hash (logand (+ hash (if (consp element)
+                                           (map-entry-hash (car element) (cdr element))
+                                           (thrift-hash element)))
+                                 most-positive-fixnum)))
+            (when (atom object)
+              (return (if object (mix-hash hash (thrift-hash object)) hash))))))
+  (:method ((object hash-table)) (map-hash object)))
+
+;;; a set is a list or, for a packed array typedef, a vector
+
+(defun set-equal (a b)
+  (and (= (length a) (length b))
+       (every #'(lambda (element) (position element b :test #'thrift-equal)) a)))
+
+(defun set-hash (set)
+  (let ((hash 0))
+    (map nil #'(lambda (element)
+                 (setf hash (logand (+ hash (thrift-hash element)) most-positive-fixnum)))
+         set)
+    hash))
+
+(defun map-equal (a b)
+  (and (typep a '(or list hash-table)) (typep b '(or list hash-table))
+       (= (map-size a) (map-size b))
+       (let ((missing '#:missing))
+         (map-map #'(lambda (key value)
+                      (let ((other (if (hash-table-p b)
+                                     (gethash key b missing)
+                                     (let ((pair (assoc key b :test #'thrift-equal)))
+                                       (if pair (rest pair) missing)))))
+                        (unless (and (not (eq other missing)) (thrift-equal value other))
+                          (return-from map-equal nil))))
+                  a)
+         t)))
+
+(defun map-hash (map)
+  (let ((hash 0))
+    (map-map #'(lambda (key value)
+                 (setf hash (logand (+ hash (map-entry-hash key value)) most-positive-fixnum)))
+             map)
+    hash))
+
+;;; hash table maps compare their keys with thrift-equal, so that struct and binary keys match
+;;; by value. Where the implementation does not accept a custom test, they fall back to equalp.
+
+#+sbcl
+(sb-ext:define-hash-table-test thrift-equal thrift-hash)
+
+(defun make-map-table (&optional (size 8))
+  "Return an empty hash table for map entries, which compares its keys with thrift-equal."
+  (let ((size (max size 8)))
+    #+sbcl (make-hash-table :test 'thrift-equal :size size)
+    #+(or ccl allegro lispworks) (make-hash-table :test 'thrift-equal :hash-function 'thrift-hash :size size)
+    #-(or sbcl ccl allegro lispworks) (make-hash-table :test 'equalp :size size)))
+
+
+(defun field-equal-form (type a b)
+  "Return a form which compares the values A and B of a field of TYPE."
+  (etypecase type
+    ((eql bool) `(eq (not ,a) (not ,b)))
+    ((member thrift:byte i08 i16 i32 i64 u64 double thrift:float) `(eql ,a ,b))
+    ((eql string) `(equal ,a ,b))
+    (symbol `(thrift-equal ,a ,b))
+    (cons (ecase (first type)
+            (enum `(eql ,a ,b))
+            ((struct thrift:list) `(thrift-equal ,a ,b))
+            (thrift:set `(set-equal ,a ,b))
+            (thrift:map `(map-equal ,a ,b))))))
+
+(defun field-hash-form (type value)
+  "Return a form which computes the hash of the VALUE of a field of TYPE."
+  (etypecase type
+    ((eql bool) `(if ,value 1 0))
+    ((member thrift:byte i08 i16 i32 i64 u64 double thrift:float string) `(sxhash ,value))
+    (symbol `(thrift-hash ,value))
+    (cons (ecase (first type)
+            (enum `(sxhash ,value))
+            ((struct thrift:list) `(thrift-hash ,value))
+            (thrift:set `(set-hash ,value))
+            (thrift:map `(map-hash ,value))))))
 
@@ -23,6 +23,15 @@
     :accessor stream-force-output-hook
     :documentation "A function of one argument, the stream, called as the
      base implementation of stream-force-output.")
+   (pooled
+    :initform nil :initarg :pooled
+    :reader vector-stream-pooled-p
+    :documentation "When true, the vector is an octet buffer from the pool. It is replaced by
+     acquisition as it grows and returned by vector-stream-release.")
+   ;; the byte counts merge with those of a vector-stream-transport, so that the primary
+   ;; methods can maintain them for every vector stream
+   (bytes-read :initform 0 :type fixnum)
+   (bytes-written :initform 0 :type fixnum)
    #+(or CMU sbcl lispworks) (direction :initarg :direction)
    )
   (:default-initargs
@@ -60,7 +69,7 @@
   (make-array length :element-type type :initial-element 0))
 
 (defmethod shared-initialize
-           ((instance vector-stream) (slots t) &key (vector nil vector-s) (length 128))
+           ((instance vector-stream) (slots t) &key (vector nil vector-s) (length 128) pooled)
   (with-slots (position) instance
     (setf position 0)
     (when vector-s
@@ -78,7 +87,10 @@
        instance))
     (call-next-method)
     (unless (slot-boundp instance 'vector)
-      (setf-vector-stream-vector (make-vector-stream-buffer length) instance))))
+      (setf-vector-stream-vector (if pooled
+                                   (acquire-octet-buffer length)
+                                   (make-vector-stream-buffer length))
+                                 instance))))
 
 #+cmu
 (let ((old-definition (fdefinition 'stream-element-type)))
@@ -139,10 +151,11 @@
 ;;; input
 
 (defmethod stream-read-byte ((stream vector-input-stream))
-  (with-slots (position vector) stream
+  (with-slots (position vector bytes-read) stream
     (when (< position (length vector))
       (let ((byte (aref vector position)))
         (incf position)
+        (incf (the fixnum bytes-read))
         (if (> byte 127)
           (- (logxor 255 (1- byte)))
           byte)))))
@@ -173,28 +186,63 @@
   (unless end (setf end (length sequence)))
   (assert (typep start '(integer 0)))
   (assert (>= end start))
-  (with-slots (vector position) stream
+  (with-slots (vector position bytes-read) stream
     (let* ((new-position (min (+ position (- end start)) (length vector))))
       (when (> new-position position)
         (replace sequence vector
                  :start1 start :end1 end
                  :start2 position :end2 new-position)
+        (incf (the fixnum bytes-read) (- new-position position))
         (setf position new-position))
       new-position)))
 
+(defmethod transport-octet-view ((stream vector-stream-transport) length)
+  (with-slots (vector position) stream
+    (when (<= (+ position length) (length vector))
+      (incf (the fixnum (transport-bytes-read stream)) length)
+      (values vector (shiftf position (+ position length))))))
+
 
 ;;;
 ;;; output
-
+;;; the buffer grows only when a write would exceed it, so that a buffer which is allocated at
+;;; the encoded size is filled exactly, and then it doubles, in order that a sequence of single
+;;; byte writes copies in amortized constant time.
+
+(defun grow-vector-stream-buffer (vector minimum-length)
+  (adjust-array vector (max minimum-length (* 2 (length vector)) 16)
+                :element-type *binary-transport-element-type*))
+
+(defun vector-stream-grow (stream minimum-length)
+  "Replace the STREAM's vector with one of at least MINIMUM-LENGTH which retains its content.
+ A pooled stream acquires the new buffer and releases the old one."
+  (with-slots (vector pooled) stream
+    (setf vector
+          (if pooled
+            (let ((new (acquire-octet-buffer (max minimum-length (* 2 (length vector))))))
+              (replace new vector)
+              (release-octet-buffer vector)
+              new)
+            (grow-vector-stream-buffer vector minimum-length)))))
+
+(defgeneric vector-stream-release (stream)
+  (:documentation "Return a pooled STREAM's buffer to the pool and reset the stream to empty. The
+ next write acquires a new buffer. A stream which is not pooled is just reset.")
+  (:method ((stream vector-stream))
+    (with-slots (vector position pooled) stream
+      (when pooled
+        (release-octet-buffer vector)
+        (setf vector (load-time-value (make-array 0 :element-type '(unsigned-byte 8)))))
+      (setf position 0)
+      stream)))
 
 (defmethod stream-write-byte ((stream vector-output-stream) (datum integer) &aux next)
-  (with-slots (position vector) stream
-    (unless (< (setf next (1+ position)) (length vector))
-      (setf vector
-            (adjust-array vector (+ next (floor (/ next 4)))
-                          :element-type *binary-transport-element-type*)))
+  (with-slots (position vector bytes-written) stream
+    (unless (<= (setf next (1+ position)) (length vector))
+      (vector-stream-grow stream next))
     (setf (aref vector position)
           (logand #xff datum))
+    (incf (the fixnum bytes-written))
     (setf position next)))
 
 
@@ -205,10 +253,8 @@
 (defmethod stream-writer ((stream vector-output-stream))
   (values #'(lambda (stream byte &aux next)
               (with-slots (position vector) stream
-                (unless (< (setf next (1+ position)) (length vector))
-                  (setf vector
-                        (adjust-array vector (+ next (floor (/ next 4)))
-                                      :element-type *binary-transport-element-type*)))
+                (unless (<= (setf next (1+ position)) (length vector))
+                  (vector-stream-grow stream next))
                 (setf (aref vector position)
                       (logand #xff byte))
                 (setf position next)))
@@ -219,15 +265,44 @@
   (unless end (setf end (length sequence)))
   (assert (typep start '(integer 0)))
   (assert (>= end start))
-  (with-slots (vector position) stream
+  (with-slots (vector position bytes-written) stream
     (let* ((new-position (+ position (- end start))))
       (when (> new-position position)
-        (unless (< new-position (length vector))
-          (setf vector
-                (adjust-array vector (floor (+ new-position (floor (/ new-position 4))))
-                              :element-type *binary-transport-element-type*)))
+        (unless (<= new-position (length vector))
+          (vector-stream-grow stream new-position))
         (replace vector sequence
                  :start1 position :end1 new-position
                  :start2 start :end2 end)
+        (incf (the fixnum bytes-written) (- new-position position))
         (setf position new-position))
       new-position)))
+
+
+(defun encode-struct (value &optional (type (type-of value)))
+  "Return the binary protocol encoding of the struct VALUE as an octet vector. The vector is
+ allocated once, at the size which thrift-encoded-size computes."
+  (let* ((size (thrift-encoded-size value))
+         (transport (make-instance 'vector-stream-transport
+                      :vector (make-vector-stream-buffer size)))
+         (protocol (make-instance 'binary-protocol :transport transport :direction :output)))
+    (stream-write-struct protocol value type)
+    (assert (= (stream-position transport) size) ()
+            "Encoded size mismatch for ~s: ~d computed, ~d written."
+            type size (stream-position transport))
+    (get-vector-stream-vector transport)))
+
+(defun call-with-encoded-struct (op value &optional (type (type-of value)))
+  (let* ((size (thrift-encoded-size value))
+         (transport (make-instance 'vector-stream-transport :length size :pooled t))
+         (protocol (make-instance 'binary-protocol :transport transport :direction :output)))
+    (unwind-protect (progn (stream-write-struct protocol value type)
+                           (funcall op (get-vector-stream-vector transport) (stream-position transport)))
+      (vector-stream-release transport))))
+
+(defmacro with-encoded-struct (((octets length) value &optional (type nil type-s)) &body body)
+  "Execute BODY with OCTETS bound to a pooled buffer which holds the binary protocol encoding of
+ the struct VALUE in its first LENGTH bytes. The buffer is released upon exit."
+  (with-gensyms (op)
+    `(flet ((,op (,octets ,length) ,@body))
+       (declare (dynamic-extent #',op))
+       (call-with-encoded-struct #',op ,value ,@(when type-s (list type))))))